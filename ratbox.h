@@ -6,12 +6,15 @@
 #define RATBOX_H
 
 #include <algorithm>
+#include <atomic>
 #include <inttypes.h>
 #include <map>
 #include <math.h>
 #include <queue>
+#include <sched.h>
 #include <set>
-#include <sys/uio.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <flint/fmpq.h>
 
@@ -38,17 +41,6 @@ tr_map_outputs(Trace &tr, ssize_t *outmap)
     tr.noutputs = noutputs;
 }
 
-API nloc_t
-maybe_replace(const nloc_t key, const std::unordered_map<nloc_t, nloc_t> &map)
-{
-    const auto it = map.find(key);
-    if (it == map.end()) {
-        return key;
-    } else {
-        return it->second;
-    }
-}
-
 static HiOp
 instr_imm(int64_t value)
 {
@@ -56,33 +48,147 @@ instr_imm(int64_t value)
     else return HiOp{HOP_NEGINT, (uint64_t)-value, 0, 0};
 }
 
+/* Dense per-location arrays.
+ *
+ * The passes over the code keep what they know about each
+ * location of the code in flat arrays indexed by the location,
+ * instead of hash tables. The arrays are mapped with mmap(),
+ * so only the pages that are actually touched take memory.
+ * The backward passes (tr_opt_erase_dead_code() and
+ * tr_finalize()) never look at a location above the current
+ * instruction again, so they give the part of the array above
+ * it back to the kernel as they go with locarray_trim().
+ * Because most references are to the nearby locations, the
+ * memory in use stays close to the size of the live part of
+ * the array. The released pages read back as zeros.
+ */
+
+#define LOCARRAY_TRIMSTEP ((size_t)1 << 20)
+
+struct LocArray {
+    uint8_t *mem;
+    size_t size;
+    // The bytes from here on are already released.
+    size_t trimmed;
+};
+
+static LocArray
+locarray_alloc(size_t size)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size = (size + pagesize - 1)/pagesize*pagesize;
+    if (size == 0) return LocArray{NULL, 0, 0};
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (unlikely(mem == MAP_FAILED)) {
+        crash("locarray_alloc(): mmap() of %zu bytes failed: %s\n", size, strerror(errno));
+    }
+    return LocArray{(uint8_t*)mem, size, size};
+}
+
+static void
+locarray_free(LocArray &a)
+{
+    if (a.mem != NULL) munmap(a.mem, a.size);
+    a = LocArray{NULL, 0, 0};
+}
+
+// Release the whole pages past the given byte offset, if
+// there are enough of them to bother.
+static inline void
+locarray_trim(LocArray &a, size_t offset)
+{
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    offset = (offset + pagesize - 1)/pagesize*pagesize;
+    if (offset + LOCARRAY_TRIMSTEP <= a.trimmed) {
+        (void)madvise(a.mem + offset, a.trimmed - offset, MADV_DONTNEED);
+        a.trimmed = offset;
+    }
+}
+
+/* Constant propagation.
+ *
+ * What is known about each code location is kept in a dense
+ * array (see LocArray) of one word per location: either its
+ * value, if it is a small integer (PROP_INT), or the index of
+ * its value among the big constants (PROP_BIG), or the earlier
+ * location it is a copy of (PROP_REPL), or nothing. The
+ * operations on known values are evaluated exactly; results
+ * that do not fit into an INT instruction are added as new big
+ * constants, as long as they have at most PROP_MAXBITS bits.
+ * The inverses of the known values are not folded, since
+ * a rational constant would take more than one instruction.
+ */
+
+#define PROP_MAXBITS 4096
+#define PROP_TAG ((uint64_t)3 << 62)
+#define PROP_INT ((uint64_t)1 << 62)
+#define PROP_BIG ((uint64_t)2 << 62)
+#define PROP_REPL ((uint64_t)3 << 62)
+
+static inline void
+prop_get_fmpz(fmpz_t res, uint64_t info, const Trace &tr)
+{
+    if ((info & PROP_TAG) == PROP_INT) {
+        fmpz_set_si(res, (int64_t)(info << 2) >> 2);
+    } else {
+        fmpz_set(res, &tr.constants[info & ~PROP_TAG]);
+    }
+}
+
 API size_t
-tr_opt_propagate_constants(Trace &tr)
+tr_opt_propagate_constants(Trace &tr, size_t nroots, Value **roots)
 {
     size_t nreplaced = 0;
-    std::unordered_map<nloc_t, int64_t> values;
-    std::unordered_map<nloc_t, nloc_t> repl;
-    nloc_t DST = tr.nfinlocations;
+    const nloc_t loc0 = tr.nfinlocations;
+    assert(tr.nextloc - loc0 == code_size(tr.code)/sizeof(HiOp));
+    LocArray infomem = locarray_alloc((tr.nextloc - loc0)*sizeof(uint64_t));
+    uint64_t *info = (uint64_t*)infomem.mem;
+    fmpz_t x, y, z;
+    fmpz_init(x);
+    fmpz_init(y);
+    fmpz_init(z);
+    nloc_t DST = loc0;
     CODE_PAGEITER_BEGIN(tr.code, 1)
     HIOP_ITER_BEGIN(PAGE, PAGEEND)
-#define needA A = maybe_replace(A, repl); const auto &itA = values.find(A); bool knowA = itA != values.end(); (void)knowA;
-#define needB B = maybe_replace(B, repl); const auto &itB = values.find(B); bool knowB = itB != values.end(); (void)knowB;
-#define needC C = maybe_replace(C, repl); const auto &itC = values.find(C); bool knowC = itC != values.end(); (void)knowC;
-#define valA (itA->second)
-#define valB (itB->second)
-#define valC (itC->second)
+#define infoof(X) (((X) >= loc0) ? info[(X) - loc0] : 0)
+#define resolve(X) (((infoof(X) & PROP_TAG) == PROP_REPL) ? (infoof(X) & ~PROP_TAG) : (X))
+#define need(X) X = resolve(X); uint64_t info##X = infoof(X); \
+        bool know##X = (info##X & PROP_TAG) == PROP_INT; (void)know##X; \
+        bool const##X = know##X || ((info##X & PROP_TAG) == PROP_BIG); (void)const##X;
+#define needA need(A)
+#define needB need(B)
+#define needC need(C)
+#define valA ((int64_t)(infoA << 2) >> 2)
+#define valB ((int64_t)(infoB << 2) >> 2)
+#define valC ((int64_t)(infoC << 2) >> 2)
+#define getA(res) prop_get_fmpz(res, infoA, tr)
+#define getB(res) prop_get_fmpz(res, infoB, tr)
+#define getC(res) prop_get_fmpz(res, infoC, tr)
 #define replace_instr(...) *(HiOp*)INSTR = (__VA_ARGS__); nreplaced++;
-#define replace_imm(val) replace_instr(instr_imm(values[DST] = (val)))
+#define replace_imm(val) { int64_t _v = (val); info[DST - loc0] = PROP_INT | ((uint64_t)_v & ~PROP_TAG); replace_instr(instr_imm(_v)); }
+#define replace_copy(X) { info[DST - loc0] = PROP_REPL | (X); replace_instr(HiOp{HOP_NOP, 0, 0, 0}); }
+#define replace_fmpz(val) \
+        if (fmpz_bits(val) <= 40) { \
+            replace_imm(fmpz_get_si(val)); \
+        } else if (fmpz_bits(val) <= PROP_MAXBITS) { \
+            size_t _idx = tr.constants.size(); \
+            fmpz _c; \
+            fmpz_init_set(&_c, val); \
+            tr.constants.push_back(_c); \
+            info[DST - loc0] = PROP_BIG | _idx; \
+            replace_instr(HiOp{HOP_BIGINT, _idx, 0, 0}); \
+        } else { \
+            update_instr(); \
+        }
 #define update_instr() *(HiOp*)INSTR = HiOp{OP, A, B, C};
         switch(OP) {
         case HOP_VAR: break;
-        case HOP_INT: values[DST] = (int64_t)A; break;
-        case HOP_NEGINT: values[DST] = -(int64_t)A; break;
-        case HOP_BIGINT: break;
+        case HOP_INT: info[DST - loc0] = PROP_INT | A; break;
+        case HOP_NEGINT: info[DST - loc0] = PROP_INT | ((uint64_t)-(int64_t)A & ~PROP_TAG); break;
+        case HOP_BIGINT: info[DST - loc0] = PROP_BIG | A; break;
         case HOP_COPY: {
                 needA;
-                repl[DST] = A;
-                replace_instr(HiOp{HOP_NOP, 0, 0, 0})
+                replace_copy(A);
             }
             break;
         case HOP_INV: {
@@ -102,6 +208,7 @@ tr_opt_propagate_constants(Trace &tr)
         case HOP_NEG: {
                 needA;
                 if (knowA) { replace_imm(-valA); break; }
+                if (constA) { getA(x); fmpz_neg(z, x); replace_fmpz(z); break; }
                 update_instr();
             }
             break;
@@ -113,12 +220,15 @@ tr_opt_propagate_constants(Trace &tr)
         case HOP_POW: {
                 needA;
                 if (knowA && (valA == 0)) { replace_imm(0); break; }
-                if (knowA) {
-                    int64_t a = valA, r = 1;
-                    for (uint64_t n = 0; n < B; n++) {
-                        if (abs(r) <= IMM_MAX / abs(a)) { r *= a; } else { r = IMM_MAX+1; break; }
+                if (knowA && (valA == 1)) { replace_imm(1); break; }
+                if (knowA && (valA == -1)) { replace_imm((B % 2) ? -1 : 1); break; }
+                if (constA) {
+                    getA(x);
+                    if (fmpz_bits(x)*B <= PROP_MAXBITS) {
+                        fmpz_pow_ui(z, x, B);
+                        replace_fmpz(z);
+                        break;
                     }
-                    if (abs(r) <= IMM_MAX) { replace_imm(r); break; }
                 }
                 update_instr();
             }
@@ -130,8 +240,9 @@ tr_opt_propagate_constants(Trace &tr)
                     int64_t r = valA + valB;
                     if (abs(r) <= IMM_MAX) { replace_imm(r); break; }
                 }
-                if (knowA && (valA == 0)) { repl[DST] = B; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
-                if (knowB && (valB == 0)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (constA && constB) { getA(x); getB(y); fmpz_add(z, x, y); replace_fmpz(z); break; }
+                if (knowA && (valA == 0)) { replace_copy(B); break; }
+                if (knowB && (valB == 0)) { replace_copy(A); break; }
                 update_instr();
             }
             break;
@@ -142,8 +253,9 @@ tr_opt_propagate_constants(Trace &tr)
                     int64_t r = valA - valB;
                     if (abs(r) <= IMM_MAX) { replace_imm(r); break; }
                 }
+                if (constA && constB) { getA(x); getB(y); fmpz_sub(z, x, y); replace_fmpz(z); break; }
                 if (knowA && (valA == 0)) { replace_instr(HiOp{HOP_NEG, B, 0, 0}); break; }
-                if (knowB && (valB == 0)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowB && (valB == 0)) { replace_copy(A); break; }
                 update_instr();
             }
             break;
@@ -153,11 +265,12 @@ tr_opt_propagate_constants(Trace &tr)
                 if (knowA && knowB) {
                     if ((valB == 0) || (abs(valA) <= IMM_MAX/abs(valB))) { replace_imm(valA*valB); break; }
                 }
+                if (constA && constB) { getA(x); getB(y); fmpz_mul(z, x, y); replace_fmpz(z); break; }
                 if (knowA && (valA == 0)) { replace_imm(0); break; }
-                if (knowA && (valA == 1)) { repl[DST] = B; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowA && (valA == 1)) { replace_copy(B); break; }
                 if (knowA && (valA == -1)) { replace_instr(HiOp{HOP_NEG, B, 0, 0}); break; }
                 if (knowB && (valB == 0)) { replace_imm(0); break; }
-                if (knowB && (valB == 1)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowB && (valB == 1)) { replace_copy(A); break; }
                 if (knowB && (valB == -1)) { replace_instr(HiOp{HOP_NEG, A, 0, 0}); break; }
                 update_instr();
             }
@@ -169,11 +282,12 @@ tr_opt_propagate_constants(Trace &tr)
                 if (knowA && knowC) {
                     if ((valC == 0) || (abs(valA) <= IMM_MAX/abs(valC))) { replace_imm(valA*valC); break; }
                 }
+                if (constA && constC) { getA(x); getC(y); fmpz_mul(z, x, y); replace_fmpz(z); break; }
                 if (knowA && (valA == 0)) { replace_imm(0); break; }
-                if (knowA && (valA == 1)) { repl[DST] = C; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowA && (valA == 1)) { replace_copy(C); break; }
                 if (knowA && (valA == -1)) { replace_instr(HiOp{HOP_NEG, C, 0, 0}); break; }
                 if (knowC && (valC == 0)) { replace_imm(0); break; }
-                if (knowC && (valC == 1)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowC && (valC == 1)) { replace_copy(A); break; }
                 if (knowC && (valC == -1)) { replace_instr(HiOp{HOP_NEG, A, 0, 0}); break; }
                 update_instr();
             }
@@ -182,10 +296,11 @@ tr_opt_propagate_constants(Trace &tr)
                 needA;
                 needB;
                 needC;
-                if (knowB && (valB == 0)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (constA && constB && constC) { getB(x); getC(y); fmpz_mul(z, x, y); getA(x); fmpz_add(z, z, x); replace_fmpz(z); break; }
+                if (knowB && (valB == 0)) { replace_copy(A); break; }
                 if (knowB && (valB == 1)) { replace_instr(HiOp{HOP_ADD, A, C, 0}); break; }
                 if (knowB && (valB == -1)) { replace_instr(HiOp{HOP_SUB, A, C, 0}); break; }
-                if (knowC && (valC == 0)) { repl[DST] = A; replace_instr(HiOp{HOP_NOP, 0, 0, 0}); break; }
+                if (knowC && (valC == 0)) { replace_copy(A); break; }
                 if (knowC && (valC == 1)) { replace_instr(HiOp{HOP_ADD, A, B, 0}); break; }
                 if (knowC && (valC == -1)) { replace_instr(HiOp{HOP_SUB, A, B, 0}); break; }
                 if (knowA && (valA == 0)) { replace_instr(HiOp{HOP_MUL, B, C, 0}); break; }
@@ -215,49 +330,299 @@ tr_opt_propagate_constants(Trace &tr)
 halt:;
     CODE_PAGEITER_END()
     for (size_t i = 0; i < tr.noutputs; i++) {
-        tr.outputs[i] = maybe_replace(tr.outputs[i], repl);
+        tr.outputs[i] = resolve(tr.outputs[i]);
+    }
+    for (size_t i = 0; i < nroots; i++) {
+        roots[i]->loc = resolve(roots[i]->loc);
     }
+#undef infoof
+#undef resolve
+#undef need
+#undef needA
+#undef needB
+#undef needC
+#undef valA
+#undef valB
+#undef valC
+#undef getA
+#undef getB
+#undef getC
+#undef replace_instr
+#undef replace_imm
+#undef replace_copy
+#undef replace_fmpz
+#undef update_instr
+    fmpz_clear(x);
+    fmpz_clear(y);
+    fmpz_clear(z);
+    locarray_free(infomem);
     return nreplaced;
 }
 
-struct InstructionHash {
-    const uint8_t *code;
-    inline size_t operator()(const nloc_t idx) const {
-        uint64_t A = *(uint64_t*)ASSUME_ALIGNED(code + idx*sizeof(HiOp), 8);
-        uint64_t B = *(uint64_t*)ASSUME_ALIGNED(code + idx*sizeof(HiOp) + 8, 8);
-        size_t h = A*0x9E3779B185EBCA87ull; // XXH_PRIME64_1
-        h ^= h >> 33;
-        h *= 0xC2B2AE3D27D4EB4Full; // XXH_PRIME64_2;
-        h += B;
-        h ^= h >> 33;
-        h *= 0xC2B2AE3D27D4EB4Full; // XXH_PRIME64_2;
-        h ^= h >> 29;
-        h *= 0x165667B19E3779F9ull; // XXH_PRIME64_3;
-        h ^= h >> 32;
-        return h;
-    }
+/* Algebraic simplification.
+ *
+ * tr_opt_simplify() rewrites the instructions that (partially)
+ * cancel the instructions defining their operands, e.g.
+ * neg(neg x) into x, or add(x, neg y) into sub(x, y). The
+ * rewrites are listed in simp_rules: each one matches an
+ * operation and the operations that define its operands, and
+ * gives a single new instruction made of the operands of both.
+ * A rewrite into copy(y) redirects all the later uses of the
+ * instruction to y. The new instruction is matched against the
+ * rules again, so the rewrites chain. The (rewritten) definition
+ * of each location is kept in a dense array (see LocArray).
+ *
+ * Only the one-for-one rewrites are made: those that would need
+ * additional instructions, like mul(inv x, inv y) into
+ * inv(mul(x, y)), are not. The instructions left unused are
+ * erased by tr_opt_erase_dead_code() afterwards.
+ */
+
+// Besides the opcodes, an operand of a rule can be required to
+// be defined by any instruction, or by one of the immediates.
+#define SIMP_ANY 0xFF
+#define SIMP_ZERO 0xFE
+#define SIMP_ONE 0xFD
+#define SIMP_MINUSONE 0xFC
+
+// Where the operands of the new instruction come from: the
+// instruction itself (A, B, C), or the instructions defining
+// its operands (AA is the first operand of the definition of
+// A). SO_EXP is the product of the exponents of pow(pow(...)).
+enum SimpOperand { SO_NONE, SO_A, SO_B, SO_C, SO_AA, SO_AB, SO_BA, SO_CA, SO_EXP };
+
+struct SimpRule {
+    const char *name;
+    uint8_t op;
+    uint8_t argop[3];
+    uint8_t newop;
+    uint8_t arg[3];
+};
+
+#define ANY SIMP_ANY
+// The rules are grouped by the operation.
+static const SimpRule simp_rules[] = {
+    {"inv(inv x) = x", HOP_INV, {HOP_INV, ANY, ANY}, HOP_COPY, {SO_AA, SO_NONE, SO_NONE}},
+    {"inv(neg x) = neginv x", HOP_INV, {HOP_NEG, ANY, ANY}, HOP_NEGINV, {SO_AA, SO_NONE, SO_NONE}},
+    {"inv(neginv x) = neg x", HOP_INV, {HOP_NEGINV, ANY, ANY}, HOP_NEG, {SO_AA, SO_NONE, SO_NONE}},
+    {"neginv(neginv x) = x", HOP_NEGINV, {HOP_NEGINV, ANY, ANY}, HOP_COPY, {SO_AA, SO_NONE, SO_NONE}},
+    {"neginv(neg x) = inv x", HOP_NEGINV, {HOP_NEG, ANY, ANY}, HOP_INV, {SO_AA, SO_NONE, SO_NONE}},
+    {"neginv(inv x) = neg x", HOP_NEGINV, {HOP_INV, ANY, ANY}, HOP_NEG, {SO_AA, SO_NONE, SO_NONE}},
+    {"neg(neg x) = x", HOP_NEG, {HOP_NEG, ANY, ANY}, HOP_COPY, {SO_AA, SO_NONE, SO_NONE}},
+    {"neg(inv x) = neginv x", HOP_NEG, {HOP_INV, ANY, ANY}, HOP_NEGINV, {SO_AA, SO_NONE, SO_NONE}},
+    {"neg(neginv x) = inv x", HOP_NEG, {HOP_NEGINV, ANY, ANY}, HOP_INV, {SO_AA, SO_NONE, SO_NONE}},
+    {"neg(x - y) = y - x", HOP_NEG, {HOP_SUB, ANY, ANY}, HOP_SUB, {SO_AB, SO_AA, SO_NONE}},
+    {"pow(pow(x, n), m) = pow(x, n*m)", HOP_POW, {HOP_POW, ANY, ANY}, HOP_POW, {SO_AA, SO_EXP, SO_NONE}},
+    {"x + neg y = x - y", HOP_ADD, {ANY, HOP_NEG, ANY}, HOP_SUB, {SO_A, SO_BA, SO_NONE}},
+    {"neg x + y = y - x", HOP_ADD, {HOP_NEG, ANY, ANY}, HOP_SUB, {SO_B, SO_AA, SO_NONE}},
+    {"neg x - neg y = y - x", HOP_SUB, {HOP_NEG, HOP_NEG, ANY}, HOP_SUB, {SO_BA, SO_AA, SO_NONE}},
+    {"x - neg y = x + y", HOP_SUB, {ANY, HOP_NEG, ANY}, HOP_ADD, {SO_A, SO_BA, SO_NONE}},
+    {"x*(-1) = neg x", HOP_MUL, {ANY, SIMP_MINUSONE, ANY}, HOP_NEG, {SO_A, SO_NONE, SO_NONE}},
+    {"(-1)*x = neg x", HOP_MUL, {SIMP_MINUSONE, ANY, ANY}, HOP_NEG, {SO_B, SO_NONE, SO_NONE}},
+    {"neg x*neg y = x*y", HOP_MUL, {HOP_NEG, HOP_NEG, ANY}, HOP_MUL, {SO_AA, SO_BA, SO_NONE}},
+    {"addmul(0, x, y) = x*y", HOP_ADDMUL, {SIMP_ZERO, ANY, ANY}, HOP_MUL, {SO_B, SO_C, SO_NONE}},
+    {"addmul(x, 1, y) = x + y", HOP_ADDMUL, {ANY, SIMP_ONE, ANY}, HOP_ADD, {SO_A, SO_C, SO_NONE}},
+    {"addmul(x, y, 1) = x + y", HOP_ADDMUL, {ANY, ANY, SIMP_ONE}, HOP_ADD, {SO_A, SO_B, SO_NONE}},
+    {"addmul(x, -1, y) = x - y", HOP_ADDMUL, {ANY, SIMP_MINUSONE, ANY}, HOP_SUB, {SO_A, SO_C, SO_NONE}},
+    {"addmul(x, y, -1) = x - y", HOP_ADDMUL, {ANY, ANY, SIMP_MINUSONE}, HOP_SUB, {SO_A, SO_B, SO_NONE}},
+    {"addmul(x, neg y, neg z) = addmul(x, y, z)", HOP_ADDMUL, {ANY, HOP_NEG, HOP_NEG}, HOP_ADDMUL, {SO_A, SO_BA, SO_CA}}
 };
+#undef ANY
+
+#define SIMP_NRULES (sizeof(simp_rules)/sizeof(simp_rules[0]))
+
+// The number of leading operands of an instruction that are
+// code locations.
+static inline int
+hiop_nlocargs(uint8_t op)
+{
+    switch (op) {
+    case HOP_COPY: case HOP_INV: case HOP_NEGINV: case HOP_NEG: case HOP_SHOUP_PRECOMP:
+    case HOP_POW: case HOP_ASSERT_INT: case HOP_ASSERT_NEGINT:
+        return 1;
+    case HOP_ADD: case HOP_SUB: case HOP_MUL:
+        return 2;
+    case HOP_SHOUP_MUL: case HOP_ADDMUL:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static inline bool
+simp_match(uint8_t argop, const HiOp &def)
+{
+    switch (argop) {
+    case SIMP_ANY: return true;
+    case SIMP_ZERO: return (def.op == HOP_INT) && (def.a == 0);
+    case SIMP_ONE: return (def.op == HOP_INT) && (def.a == 1);
+    case SIMP_MINUSONE: return (def.op == HOP_NEGINT) && (def.a == 1);
+    default: return def.op == argop;
+    }
+}
+
+// Apply the rule to the instruction whose operands are defined
+// by the given instructions; return false if it does not match.
+static bool
+simp_apply(const SimpRule &rule, const HiOp &instr, const HiOp *def, HiOp &res)
+{
+    for (int i = 0; i < 3; i++) {
+        if (!simp_match(rule.argop[i], def[i])) return false;
+    }
+    uint64_t args[3] = {0, 0, 0};
+    for (int i = 0; i < 3; i++) {
+        switch (rule.arg[i]) {
+        case SO_NONE: args[i] = 0; break;
+        case SO_A: args[i] = instr.a; break;
+        case SO_B: args[i] = instr.b; break;
+        case SO_C: args[i] = instr.c; break;
+        case SO_AA: args[i] = def[0].a; break;
+        case SO_AB: args[i] = def[0].b; break;
+        case SO_BA: args[i] = def[1].a; break;
+        case SO_CA: args[i] = def[2].a; break;
+        case SO_EXP:
+            // The finalized code keeps the exponents in 32 bits.
+            if ((instr.b != 0) && (def[0].b > UINT32_MAX/instr.b)) return false;
+            args[i] = def[0].b*instr.b;
+            break;
+        }
+    }
+    res = HiOp{rule.newop, args[0], args[1], args[2]};
+    return true;
+}
 
-struct InstructionEq {
-    const uint8_t *code;
-    inline bool operator()(const nloc_t aidx, const nloc_t bidx) const {
-        void *p1 = ASSUME_ALIGNED(code + aidx*sizeof(HiOp), sizeof(HiOp));
-        void *p2 = ASSUME_ALIGNED(code + bidx*sizeof(HiOp), sizeof(HiOp));
-        return memcmp(p1, p2, sizeof(HiOp)) == 0;
+// Fill nhits[SIMP_NRULES] with the number of times each rule
+// was applied; return the number of rewritten instructions.
+// The outputs and the given roots are moved off the erased
+// instructions.
+API size_t
+tr_opt_simplify(Trace &tr, size_t nroots, Value **roots, size_t *nhits)
+{
+    size_t nsimplified = 0;
+    const nloc_t loc0 = tr.nfinlocations;
+    assert(tr.nextloc - loc0 == code_size(tr.code)/sizeof(HiOp));
+    size_t rulefrom[HOP_NOP + 1], ruleto[HOP_NOP + 1];
+    for (int op = 0; op <= HOP_NOP; op++) rulefrom[op] = ruleto[op] = 0;
+    for (size_t i = 0; i < SIMP_NRULES; i++) {
+        uint8_t op = simp_rules[i].op;
+        if (rulefrom[op] == ruleto[op]) rulefrom[op] = i;
+        ruleto[op] = i + 1;
+    }
+    for (size_t i = 0; i < SIMP_NRULES; i++) nhits[i] = 0;
+    LocArray defmem = locarray_alloc((tr.nextloc - loc0)*sizeof(HiOp));
+    HiOp *defs = (HiOp*)defmem.mem;
+    nloc_t DST = loc0;
+    CODE_PAGEITER_BEGIN(tr.code, 1)
+    HIOP_ITER_BEGIN(PAGE, PAGEEND)
+#define defof(X) (((X) >= loc0) ? defs[(X) - loc0] : HiOp{HOP_NOP, 0, 0, 0})
+#define resolve(X) ((((X) >= loc0) && (defs[(X) - loc0].op == HOP_COPY)) ? (nloc_t)defs[(X) - loc0].a : (nloc_t)(X))
+        if (OP == HOP_HALT) {
+            DST += (HiOp*)PAGEEND - (HiOp*)INSTR;
+            goto halt;
+        }
+        if (OP != HOP_NOP) {
+            HiOp instr = HiOp{OP, A, B, C};
+            int nargs = hiop_nlocargs(OP);
+            if (nargs >= 1) instr.a = resolve(A);
+            if (nargs >= 2) instr.b = resolve(B);
+            if (nargs >= 3) instr.c = resolve(C);
+            bool changed = false;
+            // Every rewrite either removes an operand, or
+            // replaces one with an earlier location, so this
+            // terminates.
+            while (instr.op != HOP_COPY) {
+                HiOp def[3] = {HiOp{HOP_NOP, 0, 0, 0}, HiOp{HOP_NOP, 0, 0, 0}, HiOp{HOP_NOP, 0, 0, 0}};
+                for (int i = 0; i < hiop_nlocargs(instr.op); i++) {
+                    def[i] = defof(i == 0 ? instr.a : i == 1 ? instr.b : instr.c);
+                }
+                size_t i = rulefrom[instr.op];
+                for (; i < ruleto[instr.op]; i++) {
+                    if (simp_apply(simp_rules[i], instr, def, instr)) break;
+                }
+                if (i == ruleto[instr.op]) break;
+                nhits[i]++;
+                changed = true;
+            }
+            defs[DST - loc0] = instr;
+            if (instr.op == HOP_COPY) {
+                *INSTR = HiOp{HOP_NOP, 0, 0, 0};
+            } else {
+                *INSTR = instr;
+            }
+            if (changed) nsimplified++;
+        }
+        DST++;
+    HIOP_ITER_END(PAGE, PAGEEND)
+halt:;
+    CODE_PAGEITER_END()
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        tr.outputs[i] = resolve(tr.outputs[i]);
+    }
+    for (size_t i = 0; i < nroots; i++) {
+        roots[i]->loc = resolve(roots[i]->loc);
     }
+#undef defof
+#undef resolve
+    locarray_free(defmem);
+    return nsimplified;
+}
+
+/* Global value numbering.
+ *
+ * tr_opt_deduplicate() finds the instructions that compute the
+ * same operation on the same operands as some earlier one,
+ * anywhere in the code, and redirects all their uses to that
+ * earlier instruction (leaving the duplicates for the dead
+ * code elimination to erase). The operands are renamed first,
+ * and the operands of the commutative operations are sorted,
+ * so that duplicates of duplicates are found too.
+ *
+ * The instructions seen so far are kept in an open-addressing
+ * hash table of DedupEntry, which is not allowed to grow over
+ * the given memory budget. If the whole code would not fit,
+ * the instructions are partitioned by their hash, and the code
+ * is processed once per partition, each time only looking up
+ * (and remembering) the instructions of that partition. Some
+ * duplicates are then missed: those that only become such
+ * after the renaming done by a later pass. The replacements
+ * themselves are kept in a flat array of one location per
+ * instruction.
+ */
+
+#define DEDUP_MEMORY ((size_t)1 << 30)
+
+struct DedupEntry {
+    uint64_t key[2];
+    // One plus the location; zero for the free entries.
+    nloc_t loc;
 };
 
 API size_t
-tr_opt_deduplicate(Trace &tr)
+tr_opt_deduplicate(Trace &tr, size_t maxmem)
 {
     size_t nreplaced = 0;
-    nloc_t DST = tr.nfinlocations;
+    size_t ninstr = code_size(tr.code)/sizeof(HiOp);
+    size_t maxslots = 16;
+    while ((3*maxslots < 4*ninstr) && (2*maxslots*sizeof(DedupEntry) <= maxmem)) maxslots *= 2;
+    size_t npasses = 1;
+    while (3*npasses*maxslots < 4*ninstr) npasses *= 2;
+    DedupEntry *table = NULL;
+    // The replacement of each location of the code.
+    nloc_t loc0 = tr.nfinlocations;
+    std::vector<nloc_t> repl(ninstr);
+    for (size_t i = 0; i < ninstr; i++) repl[i] = loc0 + i;
+#define lookup(loc) (((loc) < loc0) ? (nloc_t)(loc) : repl[(loc) - loc0])
+    for (size_t pass = 0; pass < npasses; pass++) {
+    // The table starts small, and is doubled once 3/4 full, up
+    // to maxslots.
+    size_t nslots = (maxslots < 4096) ? maxslots : 4096;
+    size_t mask = nslots - 1;
+    free(table);
+    table = (DedupEntry*)safe_malloc(nslots*sizeof(DedupEntry));
+    memset(table, 0, nslots*sizeof(DedupEntry));
+    size_t nused = 0;
+    nloc_t DST = loc0;
     CODE_PAGEITER_BEGIN(tr.code, 1)
-    nloc_t DST0 = DST;
-    std::unordered_set<nloc_t, InstructionHash, InstructionEq>
-        locs(0, InstructionHash{PAGE - DST0*sizeof(HiOp)}, InstructionEq{PAGE - DST0*sizeof(HiOp)});
-    std::unordered_map<nloc_t, nloc_t> repl;
-#define lookup(loc) (((loc) < DST0) ? (loc) : maybe_replace(loc, repl))
     HIOP_ITER_BEGIN(PAGE, PAGEEND)
         uint64_t newA, newB, newC;
         switch(OP) {
@@ -312,28 +677,57 @@ tr_opt_deduplicate(Trace &tr)
             DST += (HiOp*)PAGEEND - (HiOp*)INSTR;
             goto halt;
         }
-        if (OP != HOP_NOP) {
-            const auto it = locs.find(DST);
-            if (it != locs.end()) {
-                repl[DST] = *it;
-                //*INSTR = HiOp{HOP_NOP, 0, 0, 0};
-                nreplaced++;
-            } else {
-                locs.insert(DST);
+        if ((OP != HOP_NOP) && (OP != HOP_ASSERT_INT) && (OP != HOP_ASSERT_NEGINT)) {
+            size_t h = hiop_hash(INSTR);
+            // An instruction already replaced in an earlier pass
+            // must not become the replacement of another one.
+            if ((((h >> 40) & (npasses - 1)) == pass) && (repl[DST - loc0] == DST)) {
+                for (size_t slot = h & mask;; slot = (slot + 1) & mask) {
+                    DedupEntry &e = table[slot];
+                    if (e.loc == 0) {
+                        // Past 3/4 of the table only look up.
+                        if (4*nused < 3*nslots) {
+                            memcpy(e.key, INSTR, sizeof(HiOp));
+                            e.loc = DST + 1;
+                            nused++;
+                        }
+                        if ((4*nused >= 3*nslots) && (nslots < maxslots)) {
+                            DedupEntry *old = table;
+                            nslots *= 2;
+                            mask = nslots - 1;
+                            table = (DedupEntry*)safe_malloc(nslots*sizeof(DedupEntry));
+                            memset(table, 0, nslots*sizeof(DedupEntry));
+                            for (size_t i = 0; i < nslots/2; i++) {
+                                if (old[i].loc == 0) continue;
+                                size_t j = hiop_hash((const HiOp*)old[i].key) & mask;
+                                while (table[j].loc != 0) j = (j + 1) & mask;
+                                table[j] = old[i];
+                            }
+                            free(old);
+                        }
+                        break;
+                    }
+                    if (memcmp(e.key, INSTR, sizeof(HiOp)) == 0) {
+                        repl[DST - loc0] = e.loc - 1;
+                        nreplaced++;
+                        break;
+                    }
+                }
             }
         }
         DST++;
     HIOP_ITER_END(PAGE, PAGEEND)
 halt:;
-    // This part is needlessly slow.
+    CODE_PAGEITER_END()
+    }
+    free(table);
+    // With several passes, the replacements can form chains.
     for (size_t i = 0; i < tr.noutputs; i++) {
         nloc_t loc = tr.outputs[i];
-        if ((DST0 <= loc) && (loc <= DST)) {
-            tr.outputs[i] = maybe_replace(loc, repl);
-        }
+        while (lookup(loc) != loc) loc = lookup(loc);
+        tr.outputs[i] = loc;
     }
 #undef lookup
-    CODE_PAGEITER_END()
     return nreplaced;
 }
 
@@ -353,39 +747,47 @@ tr_opt_erase_asserts(Trace &tr)
 API size_t
 tr_opt_erase_dead_code(Trace &tr, size_t nroots, const Value *roots)
 {
-    std::unordered_set<nloc_t> live;
-    for (size_t i = 0; i < nroots; i++) live.insert(roots[i].loc);
-    for (size_t i = 0; i < tr.noutputs; i++) live.insert(tr.outputs[i]);
+    // A bitmap of the live code locations; the ones before the
+    // code are never erased, so they need not be tracked.
+    const nloc_t loc0 = tr.nfinlocations;
+    assert(tr.nextloc - loc0 == code_size(tr.code)/sizeof(HiOp));
+    LocArray livemem = locarray_alloc((tr.nextloc - loc0 + 63)/64*sizeof(uint64_t));
+    uint64_t *live = (uint64_t*)livemem.mem;
+#define mark_live(X) if ((X) >= loc0) live[((X) - loc0)/64] |= (uint64_t)1 << (((X) - loc0)%64);
+    for (size_t i = 0; i < nroots; i++) { mark_live(roots[i].loc); }
+    for (size_t i = 0; i < tr.noutputs; i++) { mark_live(tr.outputs[i]); }
     size_t nerased = 0;
     nloc_t DST = tr.nextloc;
     CODE_REVPAGEITER_BEGIN(tr.code, 1)
+    locarray_trim(livemem, (DST - loc0 + 63)/64*sizeof(uint64_t));
     HIOP_REVITER_BEGIN(PAGE, PAGEEND)
         DST--;
         if ((OP == HOP_ASSERT_INT) || (OP == HOP_ASSERT_NEGINT)) {
-            live.insert(A);
+            mark_live(A);
         } else if (OP == HOP_NOP) {
         } else if (OP == HOP_HALT) {
         } else {
-            auto it = live.find(DST);
-            if (it != live.end()) {
-                live.erase(it);
+            uint64_t &w = live[(DST - loc0)/64];
+            uint64_t bit = (uint64_t)1 << ((DST - loc0)%64);
+            if (w & bit) {
+                w &= ~bit;
                 switch (OP) {
                 case HOP_VAR: case HOP_INT: case HOP_NEGINT: case HOP_BIGINT:
                     break;
                 case HOP_COPY: case HOP_INV: case HOP_NEGINV: case HOP_NEG: case HOP_SHOUP_PRECOMP: case HOP_POW:
-                    live.insert(A);
+                    mark_live(A);
                     break;
                 case HOP_ADD: case HOP_SUB: case HOP_MUL:
-                    live.insert(A);
-                    live.insert(B);
+                    mark_live(A);
+                    mark_live(B);
                     break;
                 case HOP_SHOUP_MUL: case HOP_ADDMUL:
-                    live.insert(A);
-                    live.insert(B);
-                    live.insert(C);
+                    mark_live(A);
+                    mark_live(B);
+                    mark_live(C);
                     break;
                 case HOP_ASSERT_INT: case HOP_ASSERT_NEGINT:
-                    live.insert(A);
+                    mark_live(A);
                     break;
                 case HOP_NOP:
                     break;
@@ -397,18 +799,251 @@ tr_opt_erase_dead_code(Trace &tr, size_t nroots, const Value *roots)
         }
     HIOP_REVITER_END(PAGE, PAGEEND)
     CODE_REVPAGEITER_END()
+#undef mark_live
+    locarray_free(livemem);
     return nerased;
 }
 
+// Drop the big constants no BIGINT instruction refers to any
+// more (e.g. the intermediate results of the constant folding
+// after tr_opt_erase_dead_code()), and renumber the rest.
+// Return the number of the dropped constants.
+API size_t
+tr_opt_compact_constants(Trace &tr)
+{
+    const nloc_t NOIDX = ~(nloc_t)0;
+    std::vector<nloc_t> newidx(tr.constants.size(), NOIDX);
+    CODE_PAGEITER_BEGIN(tr.fincode, 0)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        if (OP == LOP_BIGINT) newidx[B] = 0;
+    LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    CODE_ITER_BEGIN(tr.code, 0)
+        if (OP == HOP_BIGINT) newidx[A] = 0;
+    CODE_ITER_END()
+    size_t nkept = 0;
+    for (size_t i = 0; i < tr.constants.size(); i++) {
+        if (newidx[i] == NOIDX) {
+            fmpz_clear(&tr.constants[i]);
+        } else {
+            newidx[i] = nkept;
+            tr.constants[nkept++] = tr.constants[i];
+        }
+    }
+    size_t ndropped = tr.constants.size() - nkept;
+    if (ndropped == 0) return 0;
+    tr.constants.resize(nkept);
+    tr.constants.shrink_to_fit();
+    CODE_PAGEITER_BEGIN(tr.fincode, 1)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        if (OP == LOP_BIGINT) *(LoOp2*)INSTR = LoOp2{OP, A, (uint32_t)newidx[B]};
+    LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    CODE_ITER_BEGIN(tr.code, 1)
+        if (OP == HOP_BIGINT) *INSTR = HiOp{OP, newidx[A], 0, 0};
+    CODE_ITER_END()
+    return ndropped;
+}
+
+/* Tree-height reduction.
+ *
+ * Sums and products built one term at a time, like
+ * ((a + b) + c) + d, form chains of instructions where no
+ * link can start before the previous one is done. For each
+ * chain of ADD and SUB (or of MUL) where every intermediate
+ * result is used only by the next link, tr_opt_rebalance()
+ * takes the terms in turn into nacc separate accumulators,
+ * and adds (or multiplies) these together with a balanced
+ * tree where the chain ends, so that nacc independent links
+ * are always ready to be evaluated at once. The number of the
+ * instructions stays the same: the first nacc-1 added terms
+ * start the accumulators for free, and it takes nacc-1
+ * instructions to combine them.
+ *
+ * The combination can only come after the last link, and all
+ * the links are moved around, so the code is written anew
+ * (without the NOP instructions), and the outputs and the
+ * roots are updated to the new locations.
+ */
+
+#define REBALANCE_NACC 4
+#define REBALANCE_MAXACC 16
+
+// The flags kept for each location next to its new location
+// (or the index of the chain it is the end of so far).
+#define RB_MULTIUSE ((uint64_t)1 << 63)
+#define RB_USED ((uint64_t)1 << 62)
+#define RB_CHAIN ((uint64_t)1 << 61)
+#define RB_LOCMASK (RB_CHAIN - 1)
+// The new location of a NOP, which nothing may refer to.
+#define RB_NOLOC RB_LOCMASK
+
+struct RebalanceChain {
+    // HOP_ADD for the chains of ADD and SUB, or HOP_MUL.
+    uint8_t op;
+    size_t nacc;
+    size_t nterms;
+    nloc_t acc[REBALANCE_MAXACC];
+};
+
+// Combine the accumulators of the chain, return the location
+// of the result.
+static nloc_t
+rebalance_close(Code &code, nloc_t loc0, RebalanceChain &ch)
+{
+    for (size_t step = 1; step < ch.nacc; step *= 2) {
+        for (size_t i = 0; i + step < ch.nacc; i += 2*step) {
+            code_pack_HiOp2(code, ch.op, ch.acc[i], ch.acc[i + step]);
+            ch.acc[i] = loc0 + code_size(code)/sizeof(HiOp) - 1;
+        }
+    }
+    return ch.acc[0];
+}
+
+API size_t
+tr_opt_rebalance(Trace &tr, size_t nroots, Value **roots, size_t nacc)
+{
+    assert((nacc >= 1) && (nacc <= REBALANCE_MAXACC));
+    const nloc_t loc0 = tr.nfinlocations;
+    assert(tr.nextloc - loc0 == code_size(tr.code)/sizeof(HiOp));
+    LocArray infomem = locarray_alloc((tr.nextloc - loc0)*sizeof(uint64_t));
+    uint64_t *info = (uint64_t*)infomem.mem;
+#define count_use(X) \
+        if ((X) >= loc0) { \
+            uint64_t &_i = info[(X) - loc0]; \
+            _i |= (_i & RB_USED) ? RB_MULTIUSE : RB_USED; \
+        }
+    CODE_ITER_BEGIN(tr.code, 0)
+        int n = hiop_nlocargs(OP);
+        if (n >= 1) count_use(A);
+        if (n >= 2) count_use(B);
+        if (n >= 3) count_use(C);
+    CODE_ITER_END()
+    for (size_t i = 0; i < nroots; i++) { count_use(roots[i]->loc); }
+    for (size_t i = 0; i < tr.noutputs; i++) { count_use(tr.outputs[i]); }
+#undef count_use
+    size_t nrebalanced = 0;
+    std::vector<RebalanceChain> chains;
+    std::vector<size_t> freechains;
+    Code code = code_init();
+#define lastloc() (loc0 + code_size(code)/sizeof(HiOp) - 1)
+#define setloc(X, loc) info[(X) - loc0] = (info[(X) - loc0] & (RB_MULTIUSE | RB_USED)) | (loc)
+#define is_chain(X, kind) \
+        (((X) >= loc0) && ((info[(X) - loc0] & (RB_CHAIN | RB_MULTIUSE)) == RB_CHAIN) && \
+         (chains[info[(X) - loc0] & RB_LOCMASK].op == (kind)))
+    // Replace X with its new location, ending its chain first
+    // if it has one.
+#define newloc(X) \
+        if ((X) >= loc0) { \
+            uint64_t _i = info[(X) - loc0]; \
+            if (_i & RB_CHAIN) { \
+                size_t _c = _i & RB_LOCMASK; \
+                if (chains[_c].nacc > 1) nrebalanced++; \
+                setloc(X, rebalance_close(code, loc0, chains[_c])); \
+                freechains.push_back(_c); \
+            } \
+            assert((info[(X) - loc0] & RB_LOCMASK) != RB_NOLOC); \
+            X = info[(X) - loc0] & RB_LOCMASK; \
+        }
+    nloc_t DST = loc0;
+    CODE_PAGEITER_BEGIN(tr.code, 0)
+    HIOP_ITER_BEGIN(PAGE, PAGEEND)
+        if (OP == HOP_HALT) {
+            DST += (HiOp*)PAGEEND - (HiOp*)INSTR;
+            goto halt;
+        }
+        if ((nacc > 1) && ((OP == HOP_ADD) || (OP == HOP_SUB) || (OP == HOP_MUL))) {
+            const uint8_t kind = (OP == HOP_MUL) ? HOP_MUL : HOP_ADD;
+            bool cont = true;
+            nloc_t tail = A, term = B;
+            if (is_chain(A, kind)) { tail = A; term = B; }
+            else if ((OP != HOP_SUB) && is_chain(B, kind)) { tail = B; term = A; }
+            else cont = false;
+            if (cont) {
+                // Continue the chain ending at the operand.
+                size_t c = info[tail - loc0] & RB_LOCMASK;
+                newloc(term);
+                RebalanceChain &ch = chains[c];
+                if ((OP != HOP_SUB) && (ch.nacc < nacc)) {
+                    ch.acc[ch.nacc++] = term;
+                } else {
+                    size_t i = ch.nterms % ch.nacc;
+                    code_pack_HiOp2(code, OP, ch.acc[i], term);
+                    ch.acc[i] = lastloc();
+                }
+                ch.nterms++;
+                setloc(DST, RB_CHAIN | c);
+            } else {
+                newloc(A);
+                newloc(B);
+                code_pack_HiOp2(code, OP, A, B);
+                if ((info[DST - loc0] & (RB_USED | RB_MULTIUSE)) == RB_USED) {
+                    // Start a new chain here.
+                    size_t c;
+                    if (freechains.empty()) {
+                        c = chains.size();
+                        chains.push_back(RebalanceChain());
+                    } else {
+                        c = freechains.back();
+                        freechains.pop_back();
+                    }
+                    RebalanceChain &ch = chains[c];
+                    ch.op = kind;
+                    ch.nacc = 1;
+                    ch.nterms = 1;
+                    ch.acc[0] = lastloc();
+                    setloc(DST, RB_CHAIN | c);
+                } else {
+                    setloc(DST, lastloc());
+                }
+            }
+        } else if (OP != HOP_NOP) {
+            int n = hiop_nlocargs(OP);
+            if (n >= 1) { newloc(A); }
+            if (n >= 2) { newloc(B); }
+            if (n >= 3) { newloc(C); }
+            code_pack_HiOp3(code, OP, A, B, C);
+            setloc(DST, lastloc());
+        } else {
+            setloc(DST, RB_NOLOC);
+        }
+        DST++;
+    HIOP_ITER_END(PAGE, PAGEEND)
+halt:;
+    CODE_PAGEITER_END()
+    for (size_t i = 0; i < nroots; i++) { newloc(roots[i]->loc); }
+    for (size_t i = 0; i < tr.noutputs; i++) { newloc(tr.outputs[i]); }
+#undef lastloc
+#undef setloc
+#undef is_chain
+#undef newloc
+    locarray_free(infomem);
+    code_flush(code);
+    code_cache_free(tr.code);
+    code_clear(tr.code);
+    tr.code = code;
+    tr.nextloc = loc0 + code_size(tr.code)/sizeof(HiOp);
+    return nrebalanced;
+}
+
+// Run all the optimization passes over the trace, keeping only
+// what the outputs need. If nacc is not zero, also rebalance the
+// sum and product chains over nacc accumulators; this renumbers
+// all the locations of the code, so any Value held across the
+// call refers to something else afterwards.
 API void
-tr_optimize(Trace &tr)
+tr_optimize(Trace &tr, size_t nacc = 0)
 {
     tr_flush(tr);
     tr_opt_erase_asserts(tr);
     tr_opt_erase_dead_code(tr, 0, NULL);
-    tr_opt_propagate_constants(tr);
-    tr_opt_deduplicate(tr);
+    tr_opt_propagate_constants(tr, 0, NULL);
+    size_t nhits[SIMP_NRULES];
+    tr_opt_simplify(tr, 0, NULL, nhits);
+    tr_opt_deduplicate(tr, DEDUP_MEMORY);
     tr_opt_erase_dead_code(tr, 0, NULL);
+    tr_opt_compact_constants(tr);
+    if (nacc > 0) tr_opt_rebalance(tr, 0, NULL, nacc);
 }
 
 /* Trace finalization
@@ -419,22 +1054,13 @@ revcode_flush(Code &code)
 {
     if (code.buflen > 0) {
         size_t leftover = CODE_PAGESIZE - code.buflen;
-        ssize_t n;
-        if (leftover == 0) {
-            SYSCALL(n = write(code.fd, code.buf, CODE_PAGESIZE));
-        } else {
-            memset(code.buf, 0, leftover);
-            struct iovec iov[2] = {
-                {code.buf + leftover, code.buflen},
-                {code.buf, leftover}
-            };
-            SYSCALL(n = writev(code.fd, iov, 2));
-        }
-        if (unlikely(n != CODE_PAGESIZE)) {
-            crash("revcode_flush(): failed to write all the data\n");
-        }
+        uint8_t *page = code_writer_slot(code);
+        memcpy(page, code.buf + leftover, code.buflen);
+        memset(page + code.buflen, 0, leftover);
+        code_writer_push(code);
         code.filesize += CODE_PAGESIZE;
         code.buflen = 0;
+        code_resized(code, code.filesize - CODE_PAGESIZE);
     }
 }
 
@@ -460,26 +1086,272 @@ revcode_copy(Code &code, Code &dst)
 #define revcode_pack_LoOp3(code, op, a, b, c) revcode_pack(code, 4, LoOp3, {op, a, b, c})
 #define revcode_pack_LoOp4(code, op, a, b, c, d) revcode_pack(code, 4, LoOp4, {op, a, b, c, d})
 
-API void
-tr_finalize(Trace &tr, size_t nroots, Value **roots)
+/* The free data locations for tr_finalize().
+ *
+ * In the ordered mode the free locations are kept in a bitmap
+ * with a hierarchy of summaries on top (bit i of bits[k+1]
+ * says if word i of bits[k] is non-zero), so that the lowest
+ * and the highest of them can be found quickly. A value first
+ * tries the hint (the location just freed by the instruction
+ * that uses it), so that in-place updates stay in place. Then
+ * the short-lived values take a free location in the same
+ * cache line as the hint, or the lowest free one, so that the
+ * values in use at any given moment are packed densely near
+ * the start of the data array. The long-lived ones take the
+ * highest free location, out of their way.
+ *
+ * Otherwise this is a plain LIFO free list.
+ */
+#define LOCPOOL_LINE (64/sizeof(ncoef_t))
+#define LOCPOOL_NOHINT (~(nloc_t)0)
+
+struct LocPool {
+    size_t maxused;
+    bool ordered;
+    std::vector<nloc_t> free;
+    std::vector<std::vector<uint64_t>> bits;
+};
+
+static void
+locpool_init(LocPool &p, size_t maxused, bool ordered)
+{
+    p.maxused = maxused;
+    p.ordered = ordered;
+    p.free.clear();
+    p.bits.clear();
+}
+
+static inline void
+locpool_release(LocPool &p, nloc_t x)
+{
+    if (!p.ordered) { p.free.push_back(x); return; }
+    for (auto &&b : p.bits) {
+        bool wasempty = b[x/64] == 0;
+        b[x/64] |= (uint64_t)1 << (x%64);
+        if (!wasempty) break;
+        x /= 64;
+    }
+}
+
+static inline void
+locpool_mark_used(LocPool &p, nloc_t x)
+{
+    for (auto &&b : p.bits) {
+        b[x/64] &= ~((uint64_t)1 << (x%64));
+        if (b[x/64] != 0) break;
+        x /= 64;
+    }
+}
+
+// A new location, just past the used ones; the bitmaps are
+// grown to cover it, with all the new bits cleared.
+static nloc_t
+locpool_grow(LocPool &p)
+{
+    nloc_t x = p.maxused++;
+    size_t n = p.maxused;
+    for (size_t k = 0; ; k++) {
+        n = (n + 63)/64;
+        if (k == p.bits.size()) {
+            // A new summary level over the previous top one.
+            if ((k > 0) && (p.bits[k-1].size() <= 1)) break;
+            p.bits.emplace_back();
+            if (k > 0) {
+                for (size_t i = 0; i < p.bits[k-1].size(); i++) {
+                    if (p.bits[k-1][i] != 0) {
+                        p.bits[k].resize(i/64 + 1, 0);
+                        p.bits[k][i/64] |= (uint64_t)1 << (i%64);
+                    }
+                }
+            }
+        }
+        if (p.bits[k].size() < n) p.bits[k].resize(n, 0);
+        if (n <= 1) break;
+    }
+    return x;
+}
+
+static inline nloc_t
+locpool_take(LocPool &p, bool longlived, nloc_t hint)
+{
+    if (!p.ordered) {
+        if (p.free.empty()) return p.maxused++;
+        nloc_t x = p.free.back();
+        p.free.pop_back();
+        return x;
+    }
+    if (p.bits.empty() || (p.bits.back()[0] == 0)) return locpool_grow(p);
+    if (hint < p.maxused) {
+        unsigned shift = hint%64 - hint%LOCPOOL_LINE;
+        uint64_t line = (p.bits[0][hint/64] >> shift) & (((uint64_t)1 << LOCPOOL_LINE) - 1);
+        nloc_t x = LOCPOOL_NOHINT;
+        if (line & ((uint64_t)1 << (hint%LOCPOOL_LINE))) {
+            x = hint;
+        } else if ((line != 0) && !longlived) {
+            x = hint - hint%LOCPOOL_LINE + __builtin_ctzll(line);
+        }
+        if (x != LOCPOOL_NOHINT) {
+            locpool_mark_used(p, x);
+            return x;
+        }
+    }
+    nloc_t x = 0;
+    for (size_t k = p.bits.size(); k-- > 0;) {
+        uint64_t w = p.bits[k][x];
+        x = x*64 + (longlived ? 63 - __builtin_clzll(w) : __builtin_ctzll(w));
+    }
+    locpool_mark_used(p, x);
+    return x;
+}
+
+/* Superinstruction kinds that tr_finalize() may fuse pairs of
+ * high-level instructions into.
+ */
+enum {
+    FUSE_ADDMUL = 1, // a + b*c
+    FUSE_SUBMUL = 2, // a - b*c
+    FUSE_DIFFMUL = 4, // (a - b)*c
+    FUSE_NEGMUL = 8, // -(a*b) and (-a)*b
+    FUSE_ADD3 = 16, // (a + b) + c
+    FUSE_SUM = 32, // a + b - c + ... (4 or more terms)
+    FUSE_ALL = 63
+};
+
+struct FinalizeStats {
+    // Number of the instruction pairs fused into one.
+    size_t nfused;
+    // Number of the sums turned into accumulations, and of
+    // their terms.
+    size_t nsums;
+    size_t nsumterms;
+    // Number of the inversions computed in batches, and of
+    // the batches themselves.
+    size_t ninvbatched;
+    size_t ninvbatches;
+};
+
+/* Convert the high-level code into the low-level code,
+ * allocating the data locations; fuse the instruction pairs
+ * of the given kinds into superinstructions.
+ *
+ * Also group up to maxinvbatch INV/NEGINV instructions whose
+ * operands are all computed by the same point, and compute
+ * each group with Montgomery's trick: k-1 multiplications for
+ * the prefix products, one BATCHINV of the last product, and
+ * 2(k-1) multiplications to untangle the individual inverses.
+ * The results of such a group are computed right after the
+ * last of the operands, and stay reserved until their
+ * original instructions.
+ *
+ * With FUSE_SUM, trees of ADD and SUB instructions where each
+ * intermediate result is used only once (and within the same
+ * code page) are flattened into a single accumulation: the
+ * terms are summed into a 128-bit accumulator with ACC1/ACC3
+ * (or NACC1/NACC3 for the subtracted ones, which add n-x),
+ * and reduced modulo n only once, by ACCEND. This works
+ * because the terms are below n < 2^63, so the high limb of
+ * the accumulator stays small.
+ *
+ * With a non-zero cachebudget (in bytes), the data locations
+ * are allocated with the cache in mind: the live values are
+ * packed near the start of the data array, the operands of
+ * each instruction are placed next to each other where
+ * possible, and the values that live too long to stay in a
+ * cache of this size are kept at the end (see LocPool).
+ * Otherwise the most recently freed location is reused.
+ */
+API FinalizeStats
+tr_finalize(Trace &tr, size_t nroots, Value **roots, unsigned fusion, size_t maxinvbatch, size_t cachebudget)
 {
     tr_flush(tr);
-    size_t maxused = tr.nfinlocations;
-    std::vector<nloc_t> free;
-    std::unordered_map<nloc_t, uint32_t> map;
+    FinalizeStats stats = {0, 0, 0, 0, 0};
+    LocPool pool;
+    locpool_init(pool, tr.nfinlocations, cachebudget != 0);
+    // The values that stay live for longer than this many
+    // instructions (each touching a few data words) would fall
+    // out of a cache of cachebudget bytes anyway, so they are
+    // kept apart from the rest.
+    const size_t coldspan = cachebudget/(4*sizeof(ncoef_t));
+    nloc_t hint = LOCPOOL_NOHINT;
+    // The new location of each code location plus one, or zero
+    // if it has none (yet, or anymore); see LocArray.
+    const nloc_t loc0 = tr.nfinlocations;
+    LocArray mapmem = locarray_alloc((tr.nextloc - loc0)*sizeof(uint32_t));
+    uint32_t *map = (uint32_t*)mapmem.mem;
+    // The pending inversions, latest first, and the largest
+    // of their operands.
+    struct PendingInv { uint32_t newDST; nloc_t A; bool neg; };
+    std::vector<PendingInv> invbatch;
+    std::vector<uint32_t> invsrc;
+    nloc_t invbatch_maxA = 0;
+    // For the sum flattening: the number of uses of each
+    // instruction of the current page by the instructions of
+    // the same page, and the terms of the current sum.
+    const size_t npage = CODE_PAGESIZE/sizeof(HiOp);
+    std::vector<uint16_t> localuses;
+    struct SumTerm { nloc_t loc; bool neg; };
+    std::vector<SumTerm> sumstack, sumterms;
+    std::vector<uint32_t> sumpos, sumneg;
+    // Going backwards, the first use of a value is the end of
+    // its live range, which started at DST == X.
 #define allocate(newX, X) \
-        if (likely(X >= tr.nfinlocations)) { \
-            auto it = map.find(X); \
-            if (likely(it != map.end())) { \
-                newX = it->second; \
+        if (likely(X >= loc0)) { \
+            uint32_t &m = map[X - loc0]; \
+            if (likely(m != 0)) { \
+                newX = m - 1; \
             } else { \
-                if (free.empty()) { newX = maxused++; } \
-                else { newX = free.back(); free.pop_back(); } \
-                map[X] = newX; \
+                newX = locpool_take(pool, DST > X + coldspan, hint); \
+                m = newX + 1; \
             } \
         } else { \
             newX = X; \
         }
+    // Emit the pending inversions (in reverse, as everything
+    // else here). With d[j] and s[j] being the destinations and
+    // the operands, the forward code is:
+    //     d[1] = s[0]*s[1]; d[j] = d[j-1]*s[j] for j = 2..k-1
+    //     d[0] = batchinv d[k-1]
+    //     for j = k-1..1:
+    //         d[j] = d[0]*(j == 1 ? s[0] : d[j-1]) (negated for NEGINV)
+    //         d[0] = d[0]*s[j]
+    //     d[0] = -d[0] (for NEGINV)
+    // The operands are allocated before the destinations are
+    // freed, so they never overlap.
+#define flush_invbatch() \
+        if (invbatch.size() == 1) { \
+            PendingInv &pi = invbatch[0]; \
+            locpool_release(pool, pi.newDST); \
+            hint = pi.newDST; \
+            uint32_t newA; \
+            allocate(newA, pi.A); \
+            revcode_pack_LoOp2(rc, pi.neg ? LOP_NEGINV : LOP_INV, pi.newDST, newA); \
+            invbatch.clear(); \
+        } else if (invbatch.size() > 1) { \
+            size_t k = invbatch.size(); \
+            invsrc.resize(k); \
+            for (size_t j = 0; j < k; j++) { \
+                allocate(invsrc[j], invbatch[j].A); \
+            } \
+            uint32_t d0 = invbatch[0].newDST; \
+            if (invbatch[0].neg) revcode_pack_LoOp2(rc, LOP_NEG, d0, d0); \
+            for (size_t j = 1; j < k; j++) { \
+                uint32_t prev = (j == 1) ? invsrc[0] : invbatch[j-1].newDST; \
+                revcode_pack_LoOp2(rc, LOP_SETMUL, d0, invsrc[j]); \
+                revcode_pack_LoOp3(rc, invbatch[j].neg ? LOP_NEGMUL : LOP_MUL, invbatch[j].newDST, d0, prev); \
+            } \
+            revcode_pack_LoOp2(rc, LOP_BATCHINV, d0, invbatch[k-1].newDST); \
+            for (size_t j = k - 1; j >= 1; j--) { \
+                uint32_t prev = (j == 1) ? invsrc[0] : invbatch[j-1].newDST; \
+                revcode_pack_LoOp3(rc, LOP_MUL, invbatch[j].newDST, prev, invsrc[j]); \
+            } \
+            for (size_t j = 0; j < k; j++) { \
+                locpool_release(pool, invbatch[j].newDST); \
+            } \
+            stats.ninvbatched += k; \
+            stats.ninvbatches++; \
+            invbatch.clear(); \
+        }
+    nloc_t DST = tr.nextloc;
     for (size_t i = 0; i < nroots; i++) {
         nloc_t newloc;
         allocate(newloc, roots[i]->loc);
@@ -491,22 +1363,177 @@ tr_finalize(Trace &tr, size_t nroots, Value **roots)
         tr.outputs[i] = newloc;
     }
     Code rc = code_init();
-    nloc_t DST = tr.nextloc;
     CODE_REVPAGEITER_BEGIN(tr.code, 0)
+    locarray_trim(mapmem, (DST - loc0)*sizeof(uint32_t));
+    const nloc_t pagefirst = DST - npage;
+    if (fusion & FUSE_SUM) {
+        localuses.assign(npage, 0);
+#define count_use(X) if (((X) >= pagefirst) && ((X) < pagefirst + npage)) localuses[(X) - pagefirst]++;
+        HIOP_ITER_BEGIN(PAGE, PAGEEND)
+            switch (OP) {
+            case HOP_COPY: case HOP_INV: case HOP_NEGINV: case HOP_NEG: case HOP_SHOUP_PRECOMP:
+            case HOP_POW: case HOP_ASSERT_INT: case HOP_ASSERT_NEGINT:
+                count_use(A);
+                break;
+            case HOP_ADD: case HOP_SUB: case HOP_MUL:
+                count_use(A);
+                count_use(B);
+                break;
+            case HOP_SHOUP_MUL: case HOP_ADDMUL:
+                count_use(A);
+                count_use(B);
+                count_use(C);
+                break;
+            }
+        HIOP_ITER_END(PAGE, PAGEEND)
+#undef count_use
+    }
     HIOP_REVITER_BEGIN(PAGE, PAGEEND)
         DST--;
         uint32_t newA, newB, newC;
+        // The last operand of the pending inversions is computed
+        // here, so they need to be done right after.
+        if (!invbatch.empty() && (DST == invbatch_maxA)) {
+            flush_invbatch();
+        }
         if ((OP == HOP_ASSERT_INT) || (OP == HOP_ASSERT_NEGINT)) {
             allocate(newA, A);
             revcode_pack_LoOp2(rc, OP, newA, (uint32_t)B);
         } else {
-            auto itdst = map.find(DST);
-            if (itdst != map.end()) {
-                uint32_t newDST = itdst->second;
-                map.erase(itdst);
-                free.push_back(newDST);
-                assert(free.back() == newDST);
-                switch (OP) {
+            uint32_t mdst = map[DST - loc0];
+            if ((mdst != 0) && (maxinvbatch > 1) && ((OP == HOP_INV) || (OP == HOP_NEGINV))) {
+                // Keep the destination reserved until the batch
+                // is flushed.
+                uint32_t newDST = mdst - 1;
+                map[DST - loc0] = 0;
+                if (invbatch.empty() || (A > invbatch_maxA)) invbatch_maxA = A;
+                invbatch.push_back(PendingInv{newDST, A, OP == HOP_NEGINV});
+                if (invbatch.size() >= maxinvbatch) {
+                    flush_invbatch();
+                }
+            } else if (mdst != 0) {
+                uint32_t newDST = mdst - 1;
+                map[DST - loc0] = 0;
+                locpool_release(pool, newDST);
+                hint = newDST;
+                // Collect the terms of the sum tree rooted here;
+                // the single-use inner nodes are then dead, and
+                // will be skipped.
+                sumterms.clear();
+                if ((fusion & FUSE_SUM) && ((OP == HOP_ADD) || (OP == HOP_SUB))) {
+                    sumstack.clear();
+                    sumstack.push_back(SumTerm{A, false});
+                    sumstack.push_back(SumTerm{B, OP == HOP_SUB});
+                    while (!sumstack.empty()) {
+                        SumTerm t = sumstack.back();
+                        sumstack.pop_back();
+                        if ((t.loc >= pagefirst) && (t.loc < DST) &&
+                                (localuses[t.loc - pagefirst] == 1) && (map[t.loc - loc0] == 0)) {
+                            const HiOp &h = INSTR[-(ptrdiff_t)(DST - t.loc)];
+                            if ((h.op == HOP_ADD) || (h.op == HOP_SUB)) {
+                                sumstack.push_back(SumTerm{h.a, t.neg});
+                                sumstack.push_back(SumTerm{h.b, t.neg != (h.op == HOP_SUB)});
+                                continue;
+                            }
+                        }
+                        sumterms.push_back(t);
+                    }
+                }
+                // If the previous instruction computes an operand
+                // of this one, and it is not used anywhere else
+                // (is not live past this point), fold it into a
+                // superinstruction; the previous instruction is
+                // then dead, and will be skipped. The last operand
+                // of the pending inversions is not dead though.
+                uint32_t fop = LOP_NOP;
+                uint64_t fA = 0, fB = 0, fC = 0;
+                if (fusion && (sumterms.size() < 4) && (INSTR > (HiOp*)PAGE) && (map[DST - 1 - loc0] == 0) &&
+                        (invbatch.empty() || (invbatch_maxA != DST - 1))) {
+                    const HiOp p = INSTR[-1];
+                    const nloc_t T = DST - 1;
+                    switch (OP) {
+                    case HOP_ADD:
+                        if ((A == T) != (B == T)) {
+                            uint64_t X = (A == T) ? B : A;
+                            if ((p.op == HOP_MUL) && (fusion & FUSE_ADDMUL)) {
+                                fop = LOP_ADDMUL; fA = X; fB = p.a; fC = p.b;
+                            } else if ((p.op == HOP_ADD) && (fusion & FUSE_ADD3)) {
+                                fop = LOP_ADD3; fA = p.a; fB = p.b; fC = X;
+                            }
+                        }
+                        break;
+                    case HOP_SUB:
+                        if ((B == T) && (A != T) && (p.op == HOP_MUL) && (fusion & FUSE_SUBMUL)) {
+                            fop = LOP_SUBMUL; fA = A; fB = p.a; fC = p.b;
+                        }
+                        break;
+                    case HOP_MUL:
+                        if ((A == T) != (B == T)) {
+                            uint64_t X = (A == T) ? B : A;
+                            if ((p.op == HOP_SUB) && (fusion & FUSE_DIFFMUL)) {
+                                fop = LOP_DIFFMUL; fA = p.a; fB = p.b; fC = X;
+                            } else if ((p.op == HOP_NEG) && (fusion & FUSE_NEGMUL)) {
+                                fop = LOP_NEGMUL; fA = p.a; fB = X;
+                            }
+                        }
+                        break;
+                    case HOP_NEG:
+                        if ((A == T) && (p.op == HOP_MUL) && (fusion & FUSE_NEGMUL)) {
+                            fop = LOP_NEGMUL; fA = p.a; fB = p.b;
+                        }
+                        break;
+                    }
+                }
+                if (sumterms.size() >= 4) {
+                    stats.nsums++;
+                    stats.nsumterms += sumterms.size();
+                    sumpos.clear();
+                    sumneg.clear();
+                    for (auto &&t : sumterms) {
+                        allocate(newA, t.loc);
+                        (t.neg ? sumneg : sumpos).push_back(newA);
+                    }
+                    // Forward order: ACC3*, ACC1*, NACC3*, NACC1*,
+                    // ACCEND; packed here in reverse.
+                    revcode_pack_LoOp1(rc, LOP_ACCEND, newDST);
+                    for (size_t i = sumneg.size() - sumneg.size() % 3; i < sumneg.size(); i++) {
+                        revcode_pack_LoOp1(rc, LOP_NACC1, sumneg[i]);
+                    }
+                    for (size_t i = sumneg.size() - sumneg.size() % 3; i >= 3; i -= 3) {
+                        revcode_pack_LoOp3(rc, LOP_NACC3, sumneg[i-3], sumneg[i-2], sumneg[i-1]);
+                    }
+                    for (size_t i = sumpos.size() - sumpos.size() % 3; i < sumpos.size(); i++) {
+                        revcode_pack_LoOp1(rc, LOP_ACC1, sumpos[i]);
+                    }
+                    for (size_t i = sumpos.size() - sumpos.size() % 3; i >= 3; i -= 3) {
+                        revcode_pack_LoOp3(rc, LOP_ACC3, sumpos[i-3], sumpos[i-2], sumpos[i-1]);
+                    }
+                } else if (fop != LOP_NOP) {
+                    stats.nfused++;
+                    switch (fop) {
+                    case LOP_ADDMUL:
+                        allocate(newA, fA);
+                        allocate(newB, fB);
+                        allocate(newC, fC);
+                        if (newDST == newA) {
+                            revcode_pack_LoOp3(rc, LOP_SETADDMUL, newA, newB, newC);
+                        } else {
+                            revcode_pack_LoOp4(rc, LOP_ADDMUL, newDST, newA, newB, newC);
+                        }
+                        break;
+                    case LOP_ADD3: case LOP_SUBMUL: case LOP_DIFFMUL:
+                        allocate(newA, fA);
+                        allocate(newB, fB);
+                        allocate(newC, fC);
+                        revcode_pack_LoOp4(rc, fop, newDST, newA, newB, newC);
+                        break;
+                    case LOP_NEGMUL:
+                        allocate(newA, fA);
+                        allocate(newB, fB);
+                        revcode_pack_LoOp3(rc, fop, newDST, newA, newB);
+                        break;
+                    }
+                } else switch (OP) {
                 case HOP_VAR: case HOP_BIGINT:
                     revcode_pack_LoOp2(rc, OP, newDST, (uint32_t)A);
                     break;
@@ -563,15 +1590,20 @@ tr_finalize(Trace &tr, size_t nroots, Value **roots)
                 }
             }
         }
-#undef allocate
     HIOP_REVITER_END(PAGE, PAGEEND)
     CODE_REVPAGEITER_END()
+    // The operands can also be in the already finalized code.
+    flush_invbatch();
+#undef flush_invbatch
+#undef allocate
+    locarray_free(mapmem);
     code_reset(tr.code);
     revcode_flush(rc);
     revcode_copy(rc, tr.fincode);
     code_clear(rc);
-    tr.nfinlocations = maxused;
+    tr.nfinlocations = pool.maxused;
     tr.nextloc = tr.nfinlocations + code_size(tr.code)/sizeof(HiOp);
+    return stats;
 }
 
 API void
@@ -581,6 +1613,22 @@ tr_unfinalize(Trace &tr, size_t nroots, Value **roots)
     std::vector<nloc_t> data;
     data.resize(tr.nfinlocations, 0);
     nloc_t DST = 0;
+    // The accumulations are unrolled into chains of ADD and SUB;
+    // acc is the location of the partial sum so far. The ACC*
+    // instructions emit a variable number of instructions, and
+    // then compensate for the DST++ at the end of the switch.
+    const nloc_t NOACC = ~(nloc_t)0;
+    nloc_t acc = NOACC;
+#define acc_term(x, neg) \
+        if (acc != NOACC) { \
+            code_pack_HiOp2(tr.code, (neg) ? HOP_SUB : HOP_ADD, acc, x); \
+            acc = DST++; \
+        } else if (neg) { \
+            code_pack_HiOp1(tr.code, HOP_NEG, x); \
+            acc = DST++; \
+        } else { \
+            acc = x; \
+        }
     CODE_PAGEITER_BEGIN(tr.fincode, 0)
     LOOP_ITER_BEGIN(PAGE, PAGEEND)
         switch(OP) {
@@ -626,6 +1674,49 @@ tr_unfinalize(Trace &tr, size_t nroots, Value **roots)
             code_pack_HiOp3(tr.code, HOP_ADDMUL, data[A], data[B], data[C]);
             data[A] = DST;
             break;
+        case LOP_ADD3:
+            code_pack_HiOp2(tr.code, HOP_ADD, data[B], data[C]);
+            code_pack_HiOp2(tr.code, HOP_ADD, DST, data[D]);
+            data[A] = ++DST;
+            break;
+        case LOP_SUBMUL:
+            code_pack_HiOp2(tr.code, HOP_MUL, data[C], data[D]);
+            code_pack_HiOp2(tr.code, HOP_SUB, data[B], DST);
+            data[A] = ++DST;
+            break;
+        case LOP_DIFFMUL:
+            code_pack_HiOp2(tr.code, HOP_SUB, data[B], data[C]);
+            code_pack_HiOp2(tr.code, HOP_MUL, DST, data[D]);
+            data[A] = ++DST;
+            break;
+        case LOP_NEGMUL:
+            code_pack_HiOp2(tr.code, HOP_MUL, data[B], data[C]);
+            code_pack_HiOp1(tr.code, HOP_NEG, DST);
+            data[A] = ++DST;
+            break;
+        case LOP_BATCHINV:
+            code_pack_HiOp1(tr.code, HOP_INV, data[B]);
+            data[A] = DST;
+            break;
+        case LOP_ACC1: case LOP_NACC1:
+            acc_term(data[A], OP == LOP_NACC1);
+            DST--;
+            break;
+        case LOP_ACC3: case LOP_NACC3:
+            acc_term(data[A], OP == LOP_NACC3);
+            acc_term(data[B], OP == LOP_NACC3);
+            acc_term(data[C], OP == LOP_NACC3);
+            DST--;
+            break;
+        case LOP_ACCEND:
+            if (acc == NOACC) {
+                code_pack_HiOp1(tr.code, HOP_INT, 0);
+                acc = DST++;
+            }
+            data[A] = acc;
+            acc = NOACC;
+            DST--;
+            break;
         case LOP_HALT:
             goto halt;
         }
@@ -633,6 +1724,7 @@ tr_unfinalize(Trace &tr, size_t nroots, Value **roots)
     LOOP_ITER_END(PAGE, PAGEEND)
 halt:;
     CODE_PAGEITER_END()
+#undef acc_term
     code_reset(tr.fincode);
     tr.nfinlocations = 0;
     tr.nextloc = tr.nfinlocations + code_size(tr.code)/sizeof(HiOp);
@@ -647,17 +1739,23 @@ halt:;
 /* Trace import
  */
 
+// Shift the locations of the finalized code by locshift, the
+// BIGINT constant indices by constshift, and remap the inputs
+// according to inmap.
 static uint8_t *
-fixup_fincode(uint8_t *from, uint8_t *to, size_t *inmap, uint32_t locshift)
+fixup_fincode(uint8_t *from, uint8_t *to, size_t *inmap, uint32_t locshift, uint32_t constshift)
 {
     LOOP_ITER_BEGIN(from, to)
         switch(OP) {
         case LOP_VAR:
             *(LoOp2*)INSTR = LoOp2{OP, A + locshift, (uint32_t)inmap[B]};
             break;
-        case LOP_INT: case LOP_NEGINT: case LOP_BIGINT:
+        case LOP_INT: case LOP_NEGINT:
             *(LoOp2*)INSTR = LoOp2{OP, A + locshift, B};
             break;
+        case LOP_BIGINT:
+            *(LoOp2*)INSTR = LoOp2{OP, A + locshift, B + constshift};
+            break;
         case HOP_COPY: case HOP_INV: case HOP_NEGINV: case HOP_NEG: case HOP_SHOUP_PRECOMP:
             *(LoOp2*)INSTR = LoOp2{OP, A + locshift, B + locshift};
             break;
@@ -671,14 +1769,23 @@ fixup_fincode(uint8_t *from, uint8_t *to, size_t *inmap, uint32_t locshift)
             *(LoOp4*)INSTR = LoOp4{OP, A + locshift, B + locshift, C + locshift, D + locshift};
             break;
         case LOP_ASSERT_INT: case LOP_ASSERT_NEGINT:
-            *(LoOp3*)INSTR = LoOp3{OP, A + locshift, B + locshift, C};
+            *(LoOp2*)INSTR = LoOp2{OP, A + locshift, B};
             break;
         case LOP_NOP:
             break;
-        case LOP_SETMUL:
+        case LOP_SETMUL: case LOP_BATCHINV:
             *(LoOp2*)INSTR = LoOp2{OP, A + locshift, B + locshift};
             break;
-        case LOP_SETADDMUL:
+        case LOP_SETADDMUL: case LOP_NEGMUL:
+            *(LoOp3*)INSTR = LoOp3{OP, A + locshift, B + locshift, C + locshift};
+            break;
+        case LOP_ADD3: case LOP_SUBMUL: case LOP_DIFFMUL:
+            *(LoOp4*)INSTR = LoOp4{OP, A + locshift, B + locshift, C + locshift, D + locshift};
+            break;
+        case LOP_ACC1: case LOP_NACC1: case LOP_ACCEND:
+            *(LoOp1*)INSTR = LoOp1{OP, A + locshift};
+            break;
+        case LOP_ACC3: case LOP_NACC3:
             *(LoOp3*)INSTR = LoOp3{OP, A + locshift, B + locshift, C + locshift};
             break;
         case LOP_HALT:
@@ -688,15 +1795,19 @@ fixup_fincode(uint8_t *from, uint8_t *to, size_t *inmap, uint32_t locshift)
     return from;
 }
 
+// The same as fixup_fincode(), but for the non-finalized code.
 static uint8_t *
-fixup_code(uint8_t *from, uint8_t *to, size_t *inmap, nloc_t locshift)
+fixup_code(uint8_t *from, uint8_t *to, size_t *inmap, nloc_t locshift, nloc_t constshift)
 {
     HIOP_ITER_BEGIN(from, to)
         switch(OP) {
         case HOP_VAR:
             *INSTR = HiOp{OP, inmap[A], 0, 0};
             break;
-        case HOP_INT: case HOP_NEGINT: case HOP_BIGINT:
+        case HOP_INT: case HOP_NEGINT:
+            break;
+        case HOP_BIGINT:
+            *INSTR = HiOp{OP, A + constshift, 0, 0};
             break;
         case HOP_COPY: case HOP_INV: case HOP_NEGINV: case HOP_NEG: case HOP_SHOUP_PRECOMP:
             *INSTR = HiOp{OP, A + locshift, 0, 0};
@@ -720,6 +1831,53 @@ fixup_code(uint8_t *from, uint8_t *to, size_t *inmap, nloc_t locshift)
     return from;
 }
 
+// Read size bytes of the compact finalized code, and append
+// it to the finalized code of the trace in the usual form,
+// remapping the inputs and shifting the locations and the
+// constants as in fixup_fincode(), unless fresh is set.
+static int
+tr_import_compact(Trace &tr, FILE *f, size_t size, uint8_t *page, bool fresh, size_t *inmap, uint32_t locshift, uint32_t constshift)
+{
+    const size_t cap = 65536;
+    // compact_decode_op() may read a few bytes past the end.
+    std::vector<uint8_t> in(cap + 4, 0);
+    size_t have = 0, fill = 0;
+    const uint8_t *p = &in[0];
+    uint32_t prev = 0;
+    memset(page, 0, CODE_PAGESIZE);
+    for (;;) {
+        size_t avail = &in[have] - p;
+        if ((avail < COMPACT_MAXOPSIZE) && (size > 0)) {
+            memmove(&in[0], p, avail);
+            size_t n = std::min(size, cap - avail);
+            if (fread(&in[avail], n, 1, f) != 1) return 1;
+            size -= n;
+            have = avail + n;
+            memset(&in[have], 0, 4);
+            p = &in[0];
+            avail = have;
+        }
+        if (avail == 0) break;
+        LoOp4 op;
+        const uint8_t *next = compact_decode_op(p, prev, op);
+        if ((next == NULL) || (next > &in[have])) return 1;
+        p = next;
+        if (fill + LoOpSize[op.op] > CODE_PAGESIZE) {
+            if (!fresh) fixup_fincode(page, page + CODE_PAGESIZE, inmap, locshift, constshift);
+            code_append_pages(tr.fincode, page, CODE_PAGESIZE);
+            memset(page, 0, CODE_PAGESIZE);
+            fill = 0;
+        }
+        memcpy(page + fill, &op, LoOpSize[op.op]);
+        fill += LoOpSize[op.op];
+    }
+    if (fill > 0) {
+        if (!fresh) fixup_fincode(page, page + CODE_PAGESIZE, inmap, locshift, constshift);
+        code_append_pages(tr.fincode, page, CODE_PAGESIZE);
+    }
+    return 0;
+}
+
 API int
 tr_mergeimport_FILE(Trace &tr, FILE *f)
 {
@@ -727,15 +1885,18 @@ tr_mergeimport_FILE(Trace &tr, FILE *f)
     size_t ninputs0 = tr.ninputs;
     size_t noutputs0 = tr.noutputs;
     size_t nextloc0 = tr.nextloc;
-    bool fresh = ((ninputs0 == 0) && (noutputs0 == 0) && (nextloc0 == 0));
+    size_t nconstants0 = tr.constants.size();
+    bool fresh = ((ninputs0 == 0) && (noutputs0 == 0) && (nextloc0 == 0) && (nconstants0 == 0));
     std::vector<size_t> inputs;
     // Read the header
     TraceFileHeader h;
     if (fread(&h, sizeof(TraceFileHeader), 1, f) != 1) return 1;
-    if (h.magic != RATRACER_MAGIC) return 1;
-    if ((h.fincodesize % CODE_PAGESIZE) != 0) return 1;
+    bool compact = (h.magic == RATRACER_MAGIC_COMPACT);
+    if ((h.magic != RATRACER_MAGIC) && !compact) return 1;
+    if (!compact && ((h.fincodesize % CODE_PAGESIZE) != 0)) return 1;
     if ((h.codesize % CODE_PAGESIZE) != 0) return 1;
     // Merge inputs
+    NameIndex names = name_index(tr.input_names);
     inputs.reserve(h.ninputs);
     for (size_t i = 0; i < h.ninputs; i++) {
         uint16_t len = 0;
@@ -743,16 +1904,15 @@ tr_mergeimport_FILE(Trace &tr, FILE *f)
         std::string name(len, 0);
         if (len > 0) {
             if (fread(&name[0], len, 1, f) != 1) return 1;
-            for (size_t k = 0; k < tr.input_names.size(); k++) {
-                if (tr.input_names[k] == name) {
-                    inputs.push_back(k);
-                    goto found;
-                }
+            auto it = names.find(name);
+            if (it != names.end()) {
+                inputs.push_back(it->second);
+                continue;
             }
+            names.emplace(name, tr.input_names.size());
         }
         tr.input_names.push_back(std::move(name));
         inputs.push_back(tr.ninputs++);
-    found:;
     }
     // Append outputs
     for (size_t i = 0; i < h.noutputs; i++) {
@@ -778,17 +1938,23 @@ tr_mergeimport_FILE(Trace &tr, FILE *f)
     // Append the instructions
     {
         uint8_t *page = (uint8_t*)safe_memalign(CODE_BUFALIGN, CODE_PAGESIZE);
-        for (size_t i = 0; i < h.fincodesize; i += CODE_PAGESIZE) {
+        if (compact) {
+            if (tr_import_compact(tr, f, h.fincodesize, page, fresh, &inputs[0], nextloc0, nconstants0) != 0) {
+                free(page);
+                return 1;
+            }
+        }
+        for (size_t i = 0; !compact && (i < h.fincodesize); i += CODE_PAGESIZE) {
             if (fread(page, CODE_PAGESIZE, 1, f) != 1) { free(page); return 1; }
             if (!fresh) {
-                fixup_fincode(page, page + CODE_PAGESIZE, &inputs[0], nextloc0);
+                fixup_fincode(page, page + CODE_PAGESIZE, &inputs[0], nextloc0, nconstants0);
             }
             code_append_pages(tr.fincode, page, CODE_PAGESIZE);
         }
         for (size_t i = 0; i < h.codesize; i += CODE_PAGESIZE) {
             if (fread(page, CODE_PAGESIZE, 1, f) != 1) { free(page); return 1; }
             if (!fresh) {
-                fixup_code(page, page + CODE_PAGESIZE, &inputs[0], nextloc0);
+                fixup_code(page, page + CODE_PAGESIZE, &inputs[0], nextloc0, nconstants0);
             }
             code_append_pages(tr.code, page, CODE_PAGESIZE);
         }
@@ -808,6 +1974,84 @@ tr_mergeimport(Trace &tr, const char *filename)
     return r;
 }
 
+/* Merging of trace shards
+ *
+ * Several tracers can record concurrently, each into a trace
+ * of its own (a shard; see tracer_init_shard()), and the
+ * shards can then be appended to one trace with tr_merge().
+ * This does the same as tr_mergeimport() of a saved shard
+ * would, but without the file: the inputs are matched by
+ * name, and the locations and the constants of the shard are
+ * shifted past the ones already in the trace.
+ *
+ * Either the trace must have no non-finalized code, or the
+ * shard no finalized code, so that the locations of the two
+ * don't overlap.
+ */
+
+// Append the shard to the trace. On success, set locshift to
+// the amount the shard's locations were shifted by, so that
+// the values recorded in the shard can be used with the
+// merged trace as Value{v.loc + locshift, v.n}.
+API int
+tr_merge(Trace &tr, Trace &shard, nloc_t &locshift)
+{
+    tr_flush(tr);
+    tr_flush(shard);
+    if ((code_size(tr.code) != 0) && (shard.nfinlocations != 0)) return 1;
+    nloc_t nextloc0 = tr.nextloc;
+    size_t nconstants0 = tr.constants.size();
+    // Merge inputs
+    NameIndex names = name_index(tr.input_names);
+    std::vector<size_t> inputs;
+    inputs.reserve(shard.ninputs);
+    for (size_t i = 0; i < shard.ninputs; i++) {
+        if ((i >= shard.input_names.size()) || shard.input_names[i].empty()) {
+            // The unnamed inputs keep their numbers.
+            inputs.push_back(i);
+            if (i + 1 > tr.ninputs) tr.ninputs = i + 1;
+            continue;
+        }
+        const std::string &name = shard.input_names[i];
+        auto it = names.find(name);
+        if (it != names.end()) {
+            inputs.push_back(it->second);
+            continue;
+        }
+        names.emplace(name, tr.ninputs);
+        tr.input_names.resize(tr.ninputs);
+        tr.input_names.push_back(name);
+        inputs.push_back(tr.ninputs++);
+    }
+    // Append outputs
+    for (size_t i = 0; i < shard.noutputs; i++) {
+        tr.outputs.push_back(shard.outputs[i] + nextloc0);
+        tr.output_names.push_back(shard.output_names[i]);
+        tr.noutputs++;
+    }
+    // Append big constants
+    for (size_t i = 0; i < shard.constants.size(); i++) {
+        fmpz x;
+        fmpz_init_set(&x, &shard.constants[i]);
+        tr.constants.push_back(x);
+    }
+    // Append the instructions
+    uint8_t *page = (uint8_t*)safe_memalign(CODE_BUFALIGN, CODE_PAGESIZE);
+    CODE_PAGESUBITER_BEGIN(shard.fincode.fd, page, 0, shard.fincode.filesize, 0)
+        fixup_fincode(PAGE, PAGEEND, inputs.data(), nextloc0, nconstants0);
+        code_append_pages(tr.fincode, PAGE, CODE_PAGESIZE);
+    CODE_PAGESUBITER_END()
+    CODE_PAGESUBITER_BEGIN(shard.code.fd, page, 0, shard.code.filesize, 0)
+        fixup_code(PAGE, PAGEEND, inputs.data(), nextloc0, nconstants0);
+        code_append_pages(tr.code, PAGE, CODE_PAGESIZE);
+    CODE_PAGESUBITER_END()
+    free(page);
+    tr.nfinlocations += shard.nfinlocations;
+    tr.nextloc = tr.nfinlocations + code_size(tr.code)/sizeof(HiOp);
+    locshift = nextloc0;
+    return 0;
+}
+
 API size_t
 tr_replace_variables(Trace &tr, size_t fi1, size_t fi2, size_t ti1, size_t ti2, std::map<size_t, Value> varmap)
 {
@@ -913,301 +2157,1898 @@ halt:;
     }
 }
 
-static void
-tr_print_disasm_fin(FILE *f, Trace &tr)
+static void
+tr_print_disasm_fin(FILE *f, Trace &tr)
+{
+    CODE_PAGEITER_BEGIN(tr.fincode, 0)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        switch (OP) {
+        case LOP_HALT: goto halt;
+        case LOP_VAR: fprintf(f, "%" PRIu32 " = var #%" PRIu32 "\n", A, B); break;
+        case LOP_INT: fprintf(f, "%" PRIu32 " = int #%" PRIu64 "\n", A, (uint64_t)B | ((uint64_t)C << 32)); break;
+        case LOP_NEGINT: fprintf(f, "%" PRIu32 " = negint #%" PRIu32 "\n", A, B); break;
+        case LOP_BIGINT: fprintf(f, "%" PRIu32 " = bigint #%" PRIu32 "\n", A, B); break;
+        case LOP_COPY: fprintf(f, "%" PRIu32 " = copy %" PRIu32 "\n", A, B); break;
+        case LOP_INV: fprintf(f, "%" PRIu32 " = inv %" PRIu32 "\n", A, B); break;
+        case LOP_NEGINV: fprintf(f, "%" PRIu32 " = neginv %" PRIu32 "\n", A, B); break;
+        case LOP_BATCHINV: fprintf(f, "%" PRIu32 " = batchinv %" PRIu32 "\n", A, B); break;
+        case LOP_ACC1: fprintf(f, "acc %" PRIu32 "\n", A); break;
+        case LOP_ACC3: fprintf(f, "acc %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_NACC1: fprintf(f, "nacc %" PRIu32 "\n", A); break;
+        case LOP_NACC3: fprintf(f, "nacc %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_ACCEND: fprintf(f, "%" PRIu32 " = accend\n", A); break;
+        case LOP_NEG: fprintf(f, "%" PRIu32 " = neg %" PRIu32 "\n", A, B); break;
+        case LOP_SHOUP_PRECOMP: fprintf(f, "%" PRIu32 " = shoup_precomp %" PRIu32 "\n", A, B); break;
+        case LOP_POW: fprintf(f, "%" PRIu32 " = pow %" PRIu32 " #%" PRIu32 "\n", A, B, C); break;
+        case LOP_ADD: fprintf(f, "%" PRIu32 " = add %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_SUB: fprintf(f, "%" PRIu32 " = sub %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_MUL: fprintf(f, "%" PRIu32 " = mul %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_SHOUP_MUL: fprintf(f, "%" PRIu32 " = shoup_mul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
+        case LOP_ADDMUL: fprintf(f, "%" PRIu32 " = addmul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
+        case LOP_ASSERT_INT: fprintf(f, "assert_int %" PRIu32 " #%" PRIu32 "\n", A, B); break;
+        case LOP_ASSERT_NEGINT: fprintf(f, "assert_negint %" PRIu32 " #%" PRIu32 "\n", A, B); break;
+        case LOP_NOP: fprintf(f, "nop\n"); break;
+        case LOP_SETMUL: fprintf(f, "setmul %" PRIu32 " %" PRIu32 "\n", A, B); break;
+        case LOP_SETADDMUL: fprintf(f, "setaddmul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        case LOP_ADD3: fprintf(f, "%" PRIu32 " = add3 %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
+        case LOP_SUBMUL: fprintf(f, "%" PRIu32 " = submul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
+        case LOP_DIFFMUL: fprintf(f, "%" PRIu32 " = diffmul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
+        case LOP_NEGMUL: fprintf(f, "%" PRIu32 " = negmul %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
+        default: fprintf(f, "op_%d %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", OP, A, B, C, D); break;
+        }
+    LOOP_ITER_END(PAGE, PAGEEND)
+halt:;
+    CODE_PAGEITER_END()
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        nloc_t loc = tr.outputs[i];
+        fprintf(f, "output %zu #%zu '%s'\n", loc, i, tr.output_names[i].c_str());
+    }
+}
+
+API void
+tr_print_disasm(FILE *f, Trace &tr)
+{
+    tr_flush(tr);
+    fprintf(f, "# low-level code (%zuB)\n", code_size(tr.fincode));
+    tr_print_disasm_fin(f, tr);
+    fprintf(f, "# high-level code (%zuB)\n", code_size(tr.code));
+    tr_print_disasm_tmp(f, tr);
+}
+
+/* Trace evaluation
+ */
+
+NMOD_VEC_INLINE
+mp_limb_t _nmod_mul(mp_limb_t a, mp_limb_t b, nmod_t mod)
+{
+    mp_limb_t res, hi, lo;
+    umul_ppmm(hi, lo, a, b);
+    NMOD_RED2(res, hi, lo, mod);
+    return res;
+}
+
+#define INSTR_VAR(dst, a, b, c) data[dst] = input[a];
+#define INSTR_INT(dst, a, b, c) data[dst] = a;
+#define INSTR_NEGINT(dst, a, b, c) data[dst] = nmod_neg(a, mod);
+// Here the constants are the ones from tr_reduce_constants().
+#define INSTR_BIGINT(dst, a, b, c) data[dst] = constants[a];
+#define INSTR_COPY(dst, a, b, c) data[dst] = data[a];
+#define INSTR_INV(dst, a, b, c) if (unlikely(n_gcdinv(&data[dst], data[a], mod.n) != 1)) return 2;
+#define INSTR_NEGINV(dst, a, b, c) if (unlikely(n_gcdinv(&data[dst], nmod_neg(data[a], mod), mod.n) != 1)) return 3;
+#define INSTR_NEG(dst, a, b, c) data[dst] = nmod_neg(data[a], mod);
+#define INSTR_SHOUP_PRECOMP(dst, a, b, c) data[dst] = n_mulmod_precomp_shoup(data[a], mod.n);
+#define INSTR_POW(dst, a, b, c) data[dst] = nmod_pow_ui(data[a], b, mod);
+#define INSTR_ADD(dst, a, b, c) data[dst] = _nmod_add(data[a], data[b], mod);
+#define INSTR_SUB(dst, a, b, c) data[dst] = _nmod_sub(data[a], data[b], mod);
+#define INSTR_MUL(dst, a, b, c) data[dst] = nmod_mul(data[a], data[b], mod);
+#define INSTR_SHOUP_MUL(dst, a, b, c) data[dst] = n_mulmod_shoup(data[a], data[b], data[c], mod.n);
+#define INSTR_ADDMUL(dst, a, b, c) data[dst] = nmod_addmul(data[a], data[b], data[c], mod);
+#define INSTR_ASSERT_INT(dst, a, b, c) if (unlikely(data[a] != b)) return 4;
+#define INSTR_ASSERT_NEGINT(dst, a, b, c) if (unlikely(data[a] != nmod_neg(b, mod))) return 5;
+#define INSTR_NOP(dst, a, b, c)
+#define INSTR_ADD3(dst, a, b, c) data[dst] = _nmod_add(_nmod_add(data[a], data[b], mod), data[c], mod);
+#define INSTR_SUBMUL(dst, a, b, c) data[dst] = _nmod_sub(data[a], nmod_mul(data[b], data[c], mod), mod);
+#define INSTR_DIFFMUL(dst, a, b, c) data[dst] = nmod_mul(_nmod_sub(data[a], data[b], mod), data[c], mod);
+#define INSTR_NEGMUL(dst, a, b, c) data[dst] = nmod_neg(nmod_mul(data[a], data[b], mod), mod);
+#define INSTR_BATCHINV(dst, a, b, c) if (unlikely(n_gcdinv(&data[dst], data[a], mod.n) != 1)) return 6;
+// The accumulator is acc_hi:acc_lo, local to each evaluator.
+#define INSTR_ACC1(dst, a, b, c) add_ssaaaa(acc_hi, acc_lo, acc_hi, acc_lo, 0, data[a]);
+#define INSTR_ACC3(dst, a, b, c) INSTR_ACC1(0, a, 0, 0) INSTR_ACC1(0, b, 0, 0) INSTR_ACC1(0, c, 0, 0)
+#define INSTR_NACC1(dst, a, b, c) add_ssaaaa(acc_hi, acc_lo, acc_hi, acc_lo, 0, mod.n - data[a]);
+#define INSTR_NACC3(dst, a, b, c) INSTR_NACC1(0, a, 0, 0) INSTR_NACC1(0, b, 0, 0) INSTR_NACC1(0, c, 0, 0)
+#define INSTR_ACCEND(dst, a, b, c) NMOD_RED2(data[dst], acc_hi, acc_lo, mod); acc_hi = acc_lo = 0;
+
+/* The jump table and the list of the low-level instructions
+ * shared by all the LoOp evaluators. Each evaluator defines
+ * INSTR(opname, nargs, code) to decode one instruction into
+ * A, B, C, D and to run the code; LOOP_INSTRUCTIONS(X) then
+ * expands into the evaluator body using the X_<opname> family
+ * of implementation macros (e.g. INSTR_ADD). LOP_HALT is not
+ * in the list: each evaluator handles it itself.
+ */
+#define LOOP_JUMPTABLE { \
+        &&do_HALT, \
+        &&do_VAR, \
+        &&do_INT, \
+        &&do_NEGINT, \
+        &&do_BIGINT, \
+        &&do_COPY, \
+        &&do_INV, \
+        &&do_NEGINV, \
+        &&do_NEG, \
+        &&do_SHOUP_PRECOMP, \
+        &&do_POW, \
+        &&do_ADD, \
+        &&do_SUB, \
+        &&do_MUL, \
+        &&do_SHOUP_MUL, \
+        &&do_ADDMUL, \
+        &&do_ASSERT_INT, \
+        &&do_ASSERT_NEGINT, \
+        &&do_NOP, \
+        &&do_SETMUL, \
+        &&do_SETADDMUL, \
+        &&do_ADD3, \
+        &&do_SUBMUL, \
+        &&do_DIFFMUL, \
+        &&do_NEGMUL, \
+        &&do_BATCHINV, \
+        &&do_ACC1, \
+        &&do_ACC3, \
+        &&do_NACC1, \
+        &&do_NACC3, \
+        &&do_ACCEND, \
+    }
+
+#define LOOP_INSTRUCTIONS(X) \
+        INSTR(VAR, 2, X##_VAR(A, B, C, D)) \
+        INSTR(INT, 3, X##_INT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0)) \
+        INSTR(NEGINT, 3, X##_NEGINT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0)) \
+        INSTR(BIGINT, 2, X##_BIGINT(A, B, C, D)) \
+        INSTR(COPY, 2, X##_COPY(A, B, C, D)) \
+        INSTR(INV, 2, X##_INV(A, B, C, D)) \
+        INSTR(NEGINV, 2, X##_NEGINV(A, B, C, D)) \
+        INSTR(NEG, 2, X##_NEG(A, B, C, D)) \
+        INSTR(SHOUP_PRECOMP, 2, X##_SHOUP_PRECOMP(A, B, C, D)) \
+        INSTR(POW, 3, X##_POW(A, B, C, D)) \
+        INSTR(ADD, 3, X##_ADD(A, B, C, D)) \
+        INSTR(SUB, 3, X##_SUB(A, B, C, D)) \
+        INSTR(MUL, 3, X##_MUL(A, B, C, D)) \
+        INSTR(SHOUP_MUL, 4, X##_SHOUP_MUL(A, B, C, D)) \
+        INSTR(ADDMUL, 4, X##_ADDMUL(A, B, C, D)) \
+        INSTR(ASSERT_INT, 2, X##_ASSERT_INT(0, A, B, C)) \
+        INSTR(ASSERT_NEGINT, 2, X##_ASSERT_NEGINT(0, A, B, C)) \
+        INSTR(NOP, 0, ) \
+        INSTR(SETMUL, 2, X##_MUL(A, A, B, C)) \
+        INSTR(SETADDMUL, 3, X##_ADDMUL(A, A, B, C)) \
+        INSTR(ADD3, 4, X##_ADD3(A, B, C, D)) \
+        INSTR(SUBMUL, 4, X##_SUBMUL(A, B, C, D)) \
+        INSTR(DIFFMUL, 4, X##_DIFFMUL(A, B, C, D)) \
+        INSTR(NEGMUL, 3, X##_NEGMUL(A, B, C, D)) \
+        INSTR(BATCHINV, 2, X##_BATCHINV(A, B, C, D)) \
+        INSTR(ACC1, 1, X##_ACC1(0, A, B, C)) \
+        INSTR(ACC3, 3, X##_ACC3(0, A, B, C)) \
+        INSTR(NACC1, 1, X##_NACC1(0, A, B, C)) \
+        INSTR(NACC3, 3, X##_NACC3(0, A, B, C)) \
+        INSTR(ACCEND, 1, X##_ACCEND(A, B, C, D))
+
+static const char * code_error_strings[] = {
+    /* 0 */ "success",
+    /* 1 */ "unsupported opcode",
+    /* 2 */ "modular invert does not exist (in INV)",
+    /* 3 */ "modular invert does not exist (in NEGINV)",
+    /* 4 */ "asserted value does not match (in INT)",
+    /* 5 */ "asserted value does not match (in NEGINT)",
+    /* 6 */ "modular invert does not exist (in a batch of INV and NEGINV)",
+    /* 7 */ "not enough threads for the parallel evaluation",
+};
+
+API const char *
+code_strerror(int code)
+{
+    if ((code < 0) || (code >= countof(code_error_strings)))
+        return "unknown error";
+    return code_error_strings[code];
+}
+
+API int
+code_evaluate_hi(const Code &restrict code, uint64_t index0, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    if (code_size(code) == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    uint64_t DST = index0;
+    CODE_ITER_BEGIN(code, 0)
+        switch(OP) {
+        case HOP_VAR: INSTR_VAR(DST, A, B, C); break;
+        case HOP_INT: INSTR_INT(DST, A, B, C); break;
+        case HOP_NEGINT: INSTR_NEGINT(DST, A, B, C); break;
+        case HOP_BIGINT: INSTR_BIGINT(DST, A, B, C); break;
+        case HOP_COPY: INSTR_COPY(DST, A, B, C); break;
+        case HOP_INV: INSTR_INV(DST, A, B, C); break;
+        case HOP_NEGINV: INSTR_NEGINV(DST, A, B, C); break;
+        case HOP_NEG: INSTR_NEG(DST, A, B, C); break;
+        case HOP_SHOUP_PRECOMP: INSTR_SHOUP_PRECOMP(DST, A, B, C); break;
+        case HOP_POW: INSTR_POW(DST, A, B, C); break;
+        case HOP_ADD: INSTR_ADD(DST, A, B, C); break;
+        case HOP_SUB: INSTR_SUB(DST, A, B, C); break;
+        case HOP_MUL: INSTR_MUL(DST, A, B, C); break;
+        case HOP_SHOUP_MUL: INSTR_SHOUP_MUL(DST, A, B, C); break;
+        case HOP_ADDMUL: INSTR_ADDMUL(DST, A, B, C); break;
+        case HOP_ASSERT_INT: INSTR_ASSERT_INT(DST, A, B, C); break;
+        case HOP_ASSERT_NEGINT: INSTR_ASSERT_NEGINT(DST, A, B, C); break;
+        case HOP_NOP: INSTR_NOP(DST, A, B, C); break;
+        }
+        DST++;
+    CODE_ITER_END()
+    return 0;
+}
+
+API int
+code_evaluate_lo_mem(const uint8_t *restrict code, size_t size, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    if (size == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    // Note that this implementation assumes that there is at
+    // least a LoOp4-sized zero padding past the end of the page
+    // buffer. This is why CODE_PAGELUFT exists. This padding
+    // will be read as the LOP_HALT instruction, which is the
+    // only way the cycle below terminates.
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(code, 4);
+    const uint8_t *pend = pi + size;
+#define INSTR(opname, nargs, code) \
+        do_ ## opname:; { \
+            uint32_t A = ((LoOp4*)pi)->a; \
+            uint32_t B = ((LoOp4*)pi)->b; \
+            uint32_t C = ((LoOp4*)pi)->c; \
+            uint32_t D = ((LoOp4*)pi)->d; \
+            (void)A; (void)B; (void)C; (void)D; \
+            pi += sizeof(LoOp ## nargs); \
+            code; \
+            goto *jumptable[((LoOp4*)pi)->op]; \
+        }
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        INSTR(HALT, 0, if (pi >= pend) break);
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    return 0;
+}
+
+API int
+code_evaluate_lo(const Code &restrict code, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    if (code_size(code) == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    CODE_PAGEITER_BEGIN(code, 0)
+    // Note that this implementation assumes that there is at
+    // least a LoOp4-sized zero padding past the end of the page
+    // buffer. This is why CODE_PAGELUFT exists. This padding
+    // will be read as the LOP_HALT instruction, which is the
+    // only way the cycle below terminates.
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(PAGE, 4);
+#define INSTR(opname, nargs, code) \
+        do_ ## opname:; { \
+            uint32_t A = ((LoOp4*)pi)->a; \
+            uint32_t B = ((LoOp4*)pi)->b; \
+            uint32_t C = ((LoOp4*)pi)->c; \
+            uint32_t D = ((LoOp4*)pi)->d; \
+            (void)A; (void)B; (void)C; (void)D; \
+            pi += sizeof(LoOp ## nargs); \
+            code; \
+            goto *jumptable[((LoOp4*)pi)->op]; \
+        }
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        INSTR(HALT, 0, break);
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    CODE_PAGEITER_END()
+    return 0;
+}
+
+/* Lane-interleaved evaluation of N probes at once.
+ *
+ * The input and the data are laid out N-wide: the value of
+ * location i for the probe l lives in data[i*N + l]. Each
+ * instruction is decoded and dispatched once per N probes,
+ * and then applied to all the lanes in a fixed-length loop
+ * that the compiler can unroll and vectorize (the additive
+ * instructions vectorize well; the multiplications map onto
+ * the scalar 64x64->128 multiplier per lane anyway).
+ */
+
+template <int N, typename T>
+struct LaneView {
+    T *restrict ptr;
+    inline T &operator[](size_t i) const { return ptr[i*N]; }
+};
+
+#define LANE_INSTR(opname, nargs, code, locals) \
+        do_ ## opname:; { \
+            uint32_t A = ((LoOp4*)pi)->a; \
+            uint32_t B = ((LoOp4*)pi)->b; \
+            uint32_t C = ((LoOp4*)pi)->c; \
+            uint32_t D = ((LoOp4*)pi)->d; \
+            (void)A; (void)B; (void)C; (void)D; \
+            pi += sizeof(LoOp ## nargs); \
+            for (int lane = 0; lane < N; lane++) { \
+                LaneView<N, ncoef_t> data = {vdata + lane}; \
+                LaneView<N, const ncoef_t> input = {vinput + lane}; \
+                mp_limb_t &acc_hi = vacc_hi[lane], &acc_lo = vacc_lo[lane]; \
+                (void)data; (void)input; (void)acc_hi; (void)acc_lo; \
+                locals \
+                code; \
+            } \
+            goto *jumptable[((LoOp4*)pi)->op]; \
+        }
+
+template <int N> int
+code_evaluate_lo_mem_lanes(const uint8_t *restrict code, size_t size, const ncoef_t *restrict vinput, const ncoef_t *restrict constants, ncoef_t *restrict vdata, nmod_t mod)
+{
+    if (size == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t vacc_hi[N] = {}, vacc_lo[N] = {};
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    vdata = (ncoef_t*)ASSUME_ALIGNED(vdata, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(code, 4);
+    const uint8_t *pend = pi + size;
+#define INSTR(opname, nargs, code) LANE_INSTR(opname, nargs, code, )
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        do_HALT:
+            pi += sizeof(LoOp0);
+            if (pi >= pend) break;
+            goto *jumptable[((LoOp4*)pi)->op];
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    return 0;
+}
+
+template <int N> int
+code_evaluate_lo_lanes(const Code &restrict code, const ncoef_t *restrict vinput, const ncoef_t *restrict constants, ncoef_t *restrict vdata, nmod_t mod)
+{
+    if (code_size(code) == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t vacc_hi[N] = {}, vacc_lo[N] = {};
+    CODE_PAGEITER_BEGIN(code, 0)
+    // See the note about the zero padding in code_evaluate_lo().
+    vdata = (ncoef_t*)ASSUME_ALIGNED(vdata, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(PAGE, 4);
+#define INSTR(opname, nargs, code) LANE_INSTR(opname, nargs, code, )
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        do_HALT:
+            break;
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    CODE_PAGEITER_END()
+    return 0;
+}
+
+/* Lock-step evaluation in N primes at once.
+ *
+ * This is the same lane-interleaved layout as above, but each
+ * lane has its own prime: vmod[l] is the modulus of the lane
+ * l, and the constants are interleaved too (see
+ * tr_reduce_constants_lanes()). One pass over the code then
+ * gives N residues of each output, which is what the rational
+ * reconstruction needs.
+ */
+
+#define PRIME_LANE_LOCALS \
+    nmod_t mod = vmod[lane]; \
+    LaneView<N, const ncoef_t> constants = {vconstants + lane}; \
+    (void)mod; (void)constants;
+
+template <int N> int
+code_evaluate_lo_mem_primes(const uint8_t *restrict code, size_t size, const ncoef_t *restrict vinput, const ncoef_t *restrict vconstants, ncoef_t *restrict vdata, const nmod_t *restrict vmod)
+{
+    if (size == 0) return 0;
+    for (int lane = 0; lane < N; lane++) {
+        if (vmod[lane].norm <= 0) return -1;
+    }
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t vacc_hi[N] = {}, vacc_lo[N] = {};
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    vdata = (ncoef_t*)ASSUME_ALIGNED(vdata, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(code, 4);
+    const uint8_t *pend = pi + size;
+#define INSTR(opname, nargs, code) LANE_INSTR(opname, nargs, code, PRIME_LANE_LOCALS)
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        do_HALT:
+            pi += sizeof(LoOp0);
+            if (pi >= pend) break;
+            goto *jumptable[((LoOp4*)pi)->op];
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    return 0;
+}
+
+template <int N> int
+code_evaluate_lo_primes(const Code &restrict code, const ncoef_t *restrict vinput, const ncoef_t *restrict vconstants, ncoef_t *restrict vdata, const nmod_t *restrict vmod)
+{
+    if (code_size(code) == 0) return 0;
+    for (int lane = 0; lane < N; lane++) {
+        if (vmod[lane].norm <= 0) return -1;
+    }
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t vacc_hi[N] = {}, vacc_lo[N] = {};
+    CODE_PAGEITER_BEGIN(code, 0)
+    // See the note about the zero padding in code_evaluate_lo().
+    vdata = (ncoef_t*)ASSUME_ALIGNED(vdata, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(PAGE, 4);
+#define INSTR(opname, nargs, code) LANE_INSTR(opname, nargs, code, PRIME_LANE_LOCALS)
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        do_HALT:
+            break;
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    CODE_PAGEITER_END()
+    return 0;
+}
+
+// Reduce the BIGINT constants modulo the prime. This only
+// needs to be done once per prime, and the result can be
+// shared between the threads evaluating in the same prime.
+API void
+tr_reduce_constants(std::vector<ncoef_t> &res, const Trace &tr, nmod_t mod)
+{
+    res.resize(tr.constants.size());
+    for (size_t i = 0; i < tr.constants.size(); i++) {
+        res[i] = fmpz_get_nmod(&tr.constants[i], mod);
+    }
+}
+
+// The same, but for n primes at once, interleaved as
+// code_evaluate_lo_primes() expects them.
+API void
+tr_reduce_constants_lanes(std::vector<ncoef_t> &res, const Trace &tr, const nmod_t *mods, int n)
+{
+    res.resize(tr.constants.size()*n);
+    for (size_t i = 0; i < tr.constants.size(); i++) {
+        for (int lane = 0; lane < n; lane++) {
+            res[i*n + lane] = fmpz_get_nmod(&tr.constants[i], mods[lane]);
+        }
+    }
+}
+
+API int
+tr_evaluate(const Trace &restrict tr, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, const ncoef_t *restrict constants, nmod_t mod, void *pagebuf)
+{
+    Code fincode = tr.fincode;
+    if (pagebuf != NULL) fincode.buf = (uint8_t*)pagebuf;
+    int r1 = code_evaluate_lo(fincode, input, constants, data, mod);
+    if (unlikely(r1 != 0)) return r1;
+    Code code = tr.code;
+    if (pagebuf != NULL) code.buf = (uint8_t*)pagebuf;
+    int r2 = code_evaluate_hi(code, tr.nfinlocations, input, constants, data, mod);
+    if (unlikely(r2 != 0)) return r2;
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        output[i] = data[tr.outputs[i]];
+    }
+    return 0;
+}
+
+// The same, but reduce the constants anew on each call; when
+// evaluating many times in the same prime, reduce them once
+// with tr_reduce_constants() and use the variant above.
+API int
+tr_evaluate(const Trace &restrict tr, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, nmod_t mod, void *pagebuf)
+{
+    std::vector<ncoef_t> constants;
+    tr_reduce_constants(constants, tr, mod);
+    return tr_evaluate(tr, input, output, data, constants.data(), mod, pagebuf);
+}
+
+/* Evaluation of the compact code (see compact_encode_op()).
+ */
+
+struct CompactCode {
+    // The instructions, followed by CODE_PAGELUFT zero bytes.
+    std::vector<uint8_t> code;
+    size_t size;
+};
+
+// The same, but for an opcode known at compile time, for the
+// interpreter below.
+template <int OP, int K> static inline void
+compact_decode_arg(const uint8_t *p, uint32_t &prev, uint32_t &base, uint32_t &arg)
+{
+    constexpr char role = LoOpArgs[OP][K];
+    uint32_t x = compact_field(p, p[1], K);
+    if (role == 'i') {
+        arg = x;
+    } else if ((K == 0) && (role != 's')) {
+        arg = prev = base = prev + compact_unzigzag(x);
+    } else {
+        arg = base + compact_unzigzag(x);
+    }
+}
+
+template <int OP> static inline const uint8_t *
+compact_decode(const uint8_t *p, uint32_t &prev, uint32_t &A, uint32_t &B, uint32_t &C, uint32_t &D)
+{
+    constexpr int n = std::char_traits<char>::length(LoOpArgs[OP]);
+    uint32_t base = prev;
+    if constexpr (n > 0) compact_decode_arg<OP, 0>(p, prev, base, A);
+    if constexpr (n > 1) compact_decode_arg<OP, 1>(p, prev, base, B);
+    if constexpr (n > 2) compact_decode_arg<OP, 2>(p, prev, base, C);
+    if constexpr (n > 3) compact_decode_arg<OP, 3>(p, prev, base, D);
+    return p + compact_layout.offset[p[1]][n];
+}
+
+API void
+code_compact(CompactCode &cc, const Code &fincode)
+{
+    cc.code.clear();
+    cc.size = code_compact_foreach(fincode, [&](const uint8_t *p, size_t n) {
+        cc.code.insert(cc.code.end(), p, p + n);
+    });
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    cc.code.resize(cc.size + CODE_PAGELUFT, 0);
+    cc.code.shrink_to_fit();
+}
+
+API int
+code_evaluate_compact(const CompactCode &cc, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    if (cc.size == 0) return 0;
+    if (mod.norm <= 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    uint32_t prev = 0;
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    const uint8_t *pi = &cc.code[0];
+    const uint8_t *pend = pi + cc.size;
+#define INSTR(opname, nargs, code) \
+        do_ ## opname:; { \
+            uint32_t A = 0, B = 0, C = 0, D = 0; \
+            pi = compact_decode<LOP_ ## opname>(pi, prev, A, B, C, D); \
+            (void)A; (void)B; (void)C; (void)D; \
+            code; \
+            goto *jumptable[*pi]; \
+        }
+    goto *jumptable[*pi];
+    for (;;) {
+        INSTR(HALT, 0, if (pi >= pend) break);
+        LOOP_INSTRUCTIONS(INSTR)
+    }
+#undef INSTR
+    return 0;
+}
+
+// Same as tr_evaluate(), but with the finalized code taken from
+// the compact form; the trace must be fully finalized.
+API int
+tr_evaluate_compact(const Trace &restrict tr, const CompactCode &cc, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, const ncoef_t *restrict constants, nmod_t mod)
+{
+    int r = code_evaluate_compact(cc, input, constants, data, mod);
+    if (unlikely(r != 0)) return r;
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        output[i] = data[tr.outputs[i]];
+    }
+    return 0;
+}
+
+/* Montgomery-form evaluation.
+ *
+ * Here each value x is kept as x*R mod n with R=2^64, so that
+ * a multiplication is a single REDC: two 64x64->128 multiplies
+ * and a conditional correction, without the normalization
+ * shifts of NMOD_RED2. Additive instructions are unchanged.
+ *
+ * The inputs must be converted into the Montgomery form with
+ * mont_to() before the evaluation (once per probe), and the
+ * outputs converted back with mont_from(). The BIGINT constants
+ * are converted once per prime with mont_convert_constants();
+ * the INT immediates live in the code itself, so they are
+ * converted on the fly with one REDC each.
+ *
+ * Only the finalized code can be evaluated this way; the
+ * modulus must be odd.
+ */
+
+struct MontMod {
+    nmod_t mod;
+    // n^-1 mod R.
+    ncoef_t ninv;
+    // R, R^2, and R^3 mod n.
+    ncoef_t one, r2, r3;
+};
+
+API int
+mont_init(MontMod &mont, nmod_t mod)
+{
+    if ((mod.n & 1) == 0) return 1;
+    mont.mod = mod;
+    // Newton iteration: each step doubles the number of the
+    // correct low bits; n*n = 1 mod 8 gives the first 3.
+    ncoef_t inv = mod.n;
+    for (int i = 0; i < 5; i++) inv *= 2 - mod.n*inv;
+    mont.ninv = inv;
+    mont.one = (-mod.n) % mod.n;
+    mont.r2 = nmod_mul(mont.one, mont.one, mod);
+    mont.r3 = nmod_mul(mont.r2, mont.one, mod);
+    return 0;
+}
+
+static inline ncoef_t
+mont_redc(mp_limb_t hi, mp_limb_t lo, const MontMod &mont)
+{
+    // (hi*R + lo)/R mod n, for hi < n. Because m*n has the
+    // same low limb as lo, only the high limbs are subtracted.
+    mp_limb_t m = lo*mont.ninv, mnhi, mnlo;
+    umul_ppmm(mnhi, mnlo, m, mont.mod.n);
+    (void)mnlo;
+    mp_limb_t res = hi - mnhi;
+    return (hi < mnhi) ? res + mont.mod.n : res;
+}
+
+static inline ncoef_t
+mont_mul(ncoef_t a, ncoef_t b, const MontMod &mont)
+{
+    mp_limb_t hi, lo;
+    umul_ppmm(hi, lo, a, b);
+    return mont_redc(hi, lo, mont);
+}
+
+static inline ncoef_t
+mont_to(ncoef_t a, const MontMod &mont)
+{
+    // Works for any a < R, not only for a < n.
+    return mont_mul(a, mont.r2, mont);
+}
+
+static inline ncoef_t
+mont_from(ncoef_t a, const MontMod &mont)
+{
+    return mont_redc(0, a, mont);
+}
+
+static inline ncoef_t
+mont_pow(ncoef_t a, uint64_t e, const MontMod &mont)
+{
+    ncoef_t res = mont.one;
+    for (; e != 0; e >>= 1) {
+        if (e & 1) res = mont_mul(res, a, mont);
+        a = mont_mul(a, a, mont);
+    }
+    return res;
+}
+
+API void
+mont_convert_constants(std::vector<ncoef_t> &res, const Trace &tr, const MontMod &mont)
+{
+    res.resize(tr.constants.size());
+    for (size_t i = 0; i < tr.constants.size(); i++) {
+        res[i] = mont_to(fmpz_get_nmod(&tr.constants[i], mont.mod), mont);
+    }
+}
+
+// Here the constants are the ones from mont_convert_constants().
+#define MONT_VAR(dst, a, b, c) data[dst] = input[a];
+#define MONT_INT(dst, a, b, c) data[dst] = mont_to(a, mont);
+#define MONT_NEGINT(dst, a, b, c) data[dst] = nmod_neg(mont_to(a, mont), mont.mod);
+#define MONT_BIGINT(dst, a, b, c) data[dst] = constants[a];
+#define MONT_COPY(dst, a, b, c) data[dst] = data[a];
+// (x*R)^-1 = x^-1*R^-1, so multiply by R^3 to get x^-1*R.
+#define MONT_INV(dst, a, b, c) { ncoef_t t; if (unlikely(n_gcdinv(&t, data[a], mont.mod.n) != 1)) return 2; data[dst] = mont_mul(t, mont.r3, mont); }
+#define MONT_NEGINV(dst, a, b, c) { ncoef_t t; if (unlikely(n_gcdinv(&t, nmod_neg(data[a], mont.mod), mont.mod.n) != 1)) return 3; data[dst] = mont_mul(t, mont.r3, mont); }
+#define MONT_NEG(dst, a, b, c) data[dst] = nmod_neg(data[a], mont.mod);
+// There is nothing to precompute for a Montgomery multiplication.
+#define MONT_SHOUP_PRECOMP(dst, a, b, c) data[dst] = data[a];
+#define MONT_POW(dst, a, b, c) data[dst] = mont_pow(data[a], b, mont);
+#define MONT_ADD(dst, a, b, c) data[dst] = _nmod_add(data[a], data[b], mont.mod);
+#define MONT_SUB(dst, a, b, c) data[dst] = _nmod_sub(data[a], data[b], mont.mod);
+#define MONT_MUL(dst, a, b, c) data[dst] = mont_mul(data[a], data[b], mont);
+#define MONT_SHOUP_MUL(dst, a, b, c) data[dst] = mont_mul(data[a], data[b], mont);
+#define MONT_ADDMUL(dst, a, b, c) data[dst] = _nmod_add(data[a], mont_mul(data[b], data[c], mont), mont.mod);
+#define MONT_ASSERT_INT(dst, a, b, c) if (unlikely(data[a] != mont_to(b, mont))) return 4;
+#define MONT_ASSERT_NEGINT(dst, a, b, c) if (unlikely(data[a] != nmod_neg(mont_to(b, mont), mont.mod))) return 5;
+#define MONT_NOP(dst, a, b, c)
+#define MONT_ADD3(dst, a, b, c) data[dst] = _nmod_add(_nmod_add(data[a], data[b], mont.mod), data[c], mont.mod);
+#define MONT_SUBMUL(dst, a, b, c) data[dst] = _nmod_sub(data[a], mont_mul(data[b], data[c], mont), mont.mod);
+#define MONT_DIFFMUL(dst, a, b, c) data[dst] = mont_mul(_nmod_sub(data[a], data[b], mont.mod), data[c], mont);
+#define MONT_NEGMUL(dst, a, b, c) data[dst] = nmod_neg(mont_mul(data[a], data[b], mont), mont.mod);
+#define MONT_BATCHINV(dst, a, b, c) { ncoef_t t; if (unlikely(n_gcdinv(&t, data[a], mont.mod.n) != 1)) return 6; data[dst] = mont_mul(t, mont.r3, mont); }
+#define MONT_ACC1(dst, a, b, c) add_ssaaaa(acc_hi, acc_lo, acc_hi, acc_lo, 0, data[a]);
+#define MONT_ACC3(dst, a, b, c) MONT_ACC1(0, a, 0, 0) MONT_ACC1(0, b, 0, 0) MONT_ACC1(0, c, 0, 0)
+#define MONT_NACC1(dst, a, b, c) add_ssaaaa(acc_hi, acc_lo, acc_hi, acc_lo, 0, mont.mod.n - data[a]);
+#define MONT_NACC3(dst, a, b, c) MONT_NACC1(0, a, 0, 0) MONT_NACC1(0, b, 0, 0) MONT_NACC1(0, c, 0, 0)
+#define MONT_ACCEND(dst, a, b, c) NMOD_RED2(data[dst], acc_hi, acc_lo, mont.mod); acc_hi = acc_lo = 0;
+
+API int
+code_evaluate_lo_mem_mont(const uint8_t *restrict code, size_t size, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, const MontMod &mont)
+{
+    if (size == 0) return 0;
+    if ((mont.mod.n & 1) == 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(code, 4);
+    const uint8_t *pend = pi + size;
+#define INSTR(opname, nargs, code) \
+        do_ ## opname:; { \
+            uint32_t A = ((LoOp4*)pi)->a; \
+            uint32_t B = ((LoOp4*)pi)->b; \
+            uint32_t C = ((LoOp4*)pi)->c; \
+            uint32_t D = ((LoOp4*)pi)->d; \
+            (void)A; (void)B; (void)C; (void)D; \
+            pi += sizeof(LoOp ## nargs); \
+            code; \
+            goto *jumptable[((LoOp4*)pi)->op]; \
+        }
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        INSTR(HALT, 0, if (pi >= pend) break);
+        LOOP_INSTRUCTIONS(MONT)
+    }
+#undef INSTR
+    return 0;
+}
+
+API int
+code_evaluate_lo_mont(const Code &restrict code, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, const MontMod &mont)
+{
+    if (code_size(code) == 0) return 0;
+    if ((mont.mod.n & 1) == 0) return -1;
+    static void *jumptable[LOP_COUNT] = LOOP_JUMPTABLE;
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    CODE_PAGEITER_BEGIN(code, 0)
+    // See the note about the zero padding in code_evaluate_lo().
+    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
+    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(PAGE, 4);
+#define INSTR(opname, nargs, code) \
+        do_ ## opname:; { \
+            uint32_t A = ((LoOp4*)pi)->a; \
+            uint32_t B = ((LoOp4*)pi)->b; \
+            uint32_t C = ((LoOp4*)pi)->c; \
+            uint32_t D = ((LoOp4*)pi)->d; \
+            (void)A; (void)B; (void)C; (void)D; \
+            pi += sizeof(LoOp ## nargs); \
+            code; \
+            goto *jumptable[((LoOp4*)pi)->op]; \
+        }
+    goto *jumptable[((LoOp4*)pi)->op];
+    for (;;) {
+        INSTR(HALT, 0, break);
+        LOOP_INSTRUCTIONS(MONT)
+    }
+#undef INSTR
+    CODE_PAGEITER_END()
+    return 0;
+}
+
+API int
+tr_evaluate_mont(const Trace &restrict tr, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, const ncoef_t *restrict constants, const MontMod &mont, void *pagebuf)
+{
+    if (code_size(tr.code) != 0) return -1;
+    Code fincode = tr.fincode;
+    if (pagebuf != NULL) fincode.buf = (uint8_t*)pagebuf;
+    int r = code_evaluate_lo_mont(fincode, input, constants, data, mont);
+    if (unlikely(r != 0)) return r;
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        output[i] = mont_from(data[tr.outputs[i]], mont);
+    }
+    return 0;
+}
+
+/* Parallel evaluation of a single probe.
+ *
+ * tr_split() reads the finalized code as a dependency graph:
+ * each instruction (or each whole accumulation, from its first
+ * ACC to its ACCEND) is a node, and its edges go to the nodes
+ * that last wrote its operands. The nodes are then spread
+ * over the threads by list scheduling: taken in the code
+ * order, each goes to the thread where it can start the
+ * earliest, considering when that thread becomes free, when
+ * the operands become ready, and penalties for the operands
+ * that come from other threads.
+ *
+ * Each thread gets its own code, and its own region of the
+ * data: the values used by other threads (and the outputs)
+ * get a location each, while the rest reuse the locations
+ * as in tr_finalize(). The code of each thread is cut into
+ * segments; before a segment the thread waits until the other
+ * threads have finished the segments it needs values from,
+ * and after it publishes the number of its own finished
+ * segments. A new segment is started before each node that
+ * needs such a wait, so no waiting happens in the middle of
+ * a segment; together with the waits only ever going back in
+ * the code order, this means that there are no deadlocks.
+ *
+ * To evaluate, call par_evaluate_thread() for each thread
+ * index from that many threads at once.
+ */
+
+// The delay of an operand coming from a different thread,
+// and the cost of each new wait for the waiting thread, in
+// the same units as par_opcost().
+#define PAR_COMM_COST 64
+#define PAR_WAIT_COST 16
+// A segment that other threads wait on is cut off once it
+// has at least this many nodes; any segment is cut off at
+// the maximal size.
+#define PAR_MIN_SEGMENT 16
+#define PAR_MAX_SEGMENT 4096
+#define PAR_NONE (~(size_t)0)
+
+struct ParWait { uint32_t thread; uint32_t nsegments; };
+
+struct ParSegment {
+    size_t offset;
+    size_t size;
+    // The range of the waits before the segment.
+    size_t waits;
+    size_t nwaits;
+};
+
+struct ParThreadCode {
+    // The segments, each terminated by a HALT, plus padding.
+    std::vector<uint8_t> code;
+    std::vector<ParSegment> segments;
+    std::vector<ParWait> waits;
+};
+
+struct ParCode {
+    size_t nthreads;
+    nloc_t nlocations;
+    // The estimated total cost of the code, and the estimated
+    // time until all the threads finish, in par_opcost() units.
+    uint64_t work;
+    uint64_t span;
+    std::vector<nloc_t> outputs;
+    std::vector<ParThreadCode> threads;
+};
+
+struct ParState {
+    struct alignas(64) Progress { std::atomic<size_t> nsegments; };
+    std::vector<Progress> progress;
+    std::atomic<int> error;
+};
+
+// The rough cost of an instruction, in nanoseconds.
+static inline uint64_t
+par_opcost(uint32_t op)
+{
+    switch (op) {
+    case LOP_INV: case LOP_NEGINV: case LOP_BATCHINV: return 300;
+    case LOP_POW: return 100;
+    case LOP_ADD: case LOP_SUB: case LOP_NEG: case LOP_COPY:
+    case LOP_ACC1: case LOP_NACC1: case LOP_VAR: case LOP_INT: case LOP_NEGINT:
+        return 1;
+    default: return 3;
+    }
+}
+
+API int
+tr_split(ParCode &pc, const Trace &tr, size_t nthreads)
+{
+    if (code_size(tr.code) != 0) return 1;
+    if (nthreads < 1) nthreads = 1;
+    struct Node {
+        // The instructions, in ops[offset .. offset+size].
+        size_t offset;
+        uint32_t size;
+        uint32_t thread;
+        // The nodes of the operands, in srcs[src .. next node's src].
+        size_t src;
+        uint64_t finish;
+        uint32_t segment;
+        uint32_t loc;
+        bool hasdst;
+        bool shared;
+    };
+    struct Thread {
+        uint64_t free;
+        // The nodes, in order; the first node of each segment;
+        // the size of the last segment, and whether other
+        // threads wait on it.
+        std::vector<size_t> nodes;
+        std::vector<size_t> segstart;
+        size_t segsize;
+        bool waitedon;
+        size_t nshared;
+        size_t nlocal;
+        nloc_t base;
+    };
+    std::vector<Node> nodes;
+    std::vector<size_t> srcs;
+    std::vector<uint8_t> ops;
+    std::vector<Thread> th(nthreads, Thread{0, {}, {}, 0, false, 0, 0, 0});
+    std::vector<ParThreadCode> tc(nthreads);
+    // waited[t*nthreads + p] is how many segments of thread p
+    // thread t has already waited for.
+    std::vector<uint32_t> waited(nthreads*nthreads, 0);
+    std::vector<size_t> locdef(tr.nfinlocations, PAR_NONE);
+    std::vector<ParWait> pending;
+    size_t minthread = 0;
+    bool open = false;
+    uint64_t cost = 0, work = 0;
+    Code fincode = tr.fincode;
+    CODE_PAGEITER_BEGIN(fincode, 0)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        if ((OP != LOP_HALT) && (OP != LOP_NOP)) {
+            if (!open) {
+                nodes.push_back(Node{ops.size(), 0, 0, srcs.size(), 0, 0, UINT32_MAX, false, false});
+                open = true;
+                cost = 0;
+            }
+            Node &n = nodes.back();
+            ops.insert(ops.end(), INSTR, INSTR + LoOpSize[OP]);
+            n.size += LoOpSize[OP];
+            cost += par_opcost(OP);
+            work += par_opcost(OP);
+            const uint32_t *args = &((LoOp4*)INSTR)->a;
+            for (const char *r = LoOpArgs[OP]; *r; r++, args++) {
+                if ((*r == 's') || (*r == 'x')) {
+                    if (*args >= locdef.size() || locdef[*args] == PAR_NONE) return 2;
+                    srcs.push_back(locdef[*args]);
+                }
+            }
+            // An accumulation continues until its ACCEND.
+            if ((OP != LOP_ACC1) && (OP != LOP_ACC3) && (OP != LOP_NACC1) && (OP != LOP_NACC3)) {
+                open = false;
+                size_t ni = nodes.size() - 1;
+                args = &((LoOp4*)INSTR)->a;
+                if ((LoOpArgs[OP][0] == 'd') || (LoOpArgs[OP][0] == 'x')) {
+                    n.hasdst = true;
+                    locdef[args[0]] = ni;
+                }
+                // Choose the thread: one of those that computed the
+                // operands, or the least busy one.
+                size_t nsrcs = srcs.size() - n.src;
+                size_t best = minthread;
+                uint64_t beststart = UINT64_MAX;
+                for (size_t k = 0; k <= nsrcs; k++) {
+                    size_t t = (k < nsrcs) ? nodes[srcs[n.src + k]].thread : minthread;
+                    uint64_t start = th[t].free, nwaits = 0;
+                    for (size_t j = n.src; j < srcs.size(); j++) {
+                        const Node &m = nodes[srcs[j]];
+                        uint64_t ready = m.finish;
+                        if (m.thread != t) {
+                            ready += PAR_COMM_COST;
+                            if (waited[t*nthreads + m.thread] < m.segment + 1) nwaits++;
+                        }
+                        if (ready > start) start = ready;
+                    }
+                    start += nwaits*PAR_WAIT_COST;
+                    if (start < beststart) { best = t; beststart = start; }
+                }
+                Thread &t = th[best];
+                n.thread = best;
+                n.finish = beststart + cost;
+                t.free = n.finish;
+                if (best == minthread) {
+                    for (size_t i = 0; i < nthreads; i++) {
+                        if (th[i].free < th[minthread].free) minthread = i;
+                    }
+                }
+                // Wait for the segments of the other threads that
+                // computed the operands, unless already waited for.
+                pending.clear();
+                for (size_t j = n.src; j < srcs.size(); j++) {
+                    Node &m = nodes[srcs[j]];
+                    if (m.thread == best) continue;
+                    m.shared = true;
+                    uint32_t need = m.segment + 1;
+                    if (waited[best*nthreads + m.thread] >= need) continue;
+                    waited[best*nthreads + m.thread] = need;
+                    bool merged = false;
+                    for (auto &&w : pending) {
+                        if (w.thread == m.thread) { w.nsegments = need; merged = true; }
+                    }
+                    if (!merged) pending.push_back(ParWait{m.thread, need});
+                    if (m.segment + 1 == th[m.thread].segstart.size()) {
+                        th[m.thread].waitedon = true;
+                    }
+                }
+                bool cut = !pending.empty() ||
+                    (t.waitedon && (t.segsize >= PAR_MIN_SEGMENT)) ||
+                    (t.segsize >= PAR_MAX_SEGMENT);
+                if (t.segstart.empty() || (cut && (t.segsize > 0))) {
+                    ParSegment seg = {0, 0, tc[best].waits.size(), 0};
+                    tc[best].segments.push_back(seg);
+                    t.segstart.push_back(t.nodes.size());
+                    t.segsize = 0;
+                    t.waitedon = false;
+                }
+                tc[best].waits.insert(tc[best].waits.end(), pending.begin(), pending.end());
+                tc[best].segments.back().nwaits += pending.size();
+                n.segment = t.segstart.size() - 1;
+                t.nodes.push_back(ni);
+                t.segsize++;
+            }
+        }
+    LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    if (open) return 2;
+    pc.outputs.resize(tr.noutputs);
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        if ((tr.outputs[i] >= locdef.size()) || (locdef[tr.outputs[i]] == PAR_NONE)) return 2;
+        nodes[locdef[tr.outputs[i]]].shared = true;
+    }
+    // Allocate the locations, separately within each thread,
+    // going backwards as in tr_finalize(); the shared values
+    // are numbered going forward.
+    std::vector<uint32_t> freelocs;
+    nloc_t nlocations = 0;
+    for (size_t ti = 0; ti < nthreads; ti++) {
+        Thread &t = th[ti];
+        for (size_t ni : t.nodes) {
+            if (nodes[ni].hasdst && nodes[ni].shared) nodes[ni].loc = t.nshared++;
+        }
+        freelocs.clear();
+#define allocate(m) \
+            if (nodes[m].loc == UINT32_MAX) { \
+                if (freelocs.empty()) { nodes[m].loc = t.nshared + t.nlocal++; } \
+                else { nodes[m].loc = freelocs.back(); freelocs.pop_back(); } \
+            }
+        for (size_t k = t.nodes.size(); k-- > 0;) {
+            Node &n = nodes[t.nodes[k]];
+            if (n.hasdst && !n.shared) {
+                // A value that is never used still needs a place.
+                allocate(t.nodes[k]);
+                freelocs.push_back(n.loc);
+            }
+            size_t srcend = (t.nodes[k] + 1 < nodes.size()) ? nodes[t.nodes[k] + 1].src : srcs.size();
+            for (size_t j = n.src; j < srcend; j++) {
+                size_t m = srcs[j];
+                if ((nodes[m].thread == ti) && !nodes[m].shared) {
+                    allocate(m);
+                }
+            }
+        }
+#undef allocate
+        t.base = nlocations;
+        // Keep the regions of the threads in separate cache lines.
+        nlocations += (t.nshared + t.nlocal + 7) & ~(nloc_t)7;
+    }
+    if (nlocations >= ((nloc_t)1 << 32)) return 3;
+    // Emit the code of each thread, with the new locations.
+    for (size_t ti = 0; ti < nthreads; ti++) {
+        Thread &t = th[ti];
+        ParThreadCode &c = tc[ti];
+        size_t seg = 0;
+        for (size_t k = 0; k < t.nodes.size(); k++) {
+            if ((seg < t.segstart.size()) && (t.segstart[seg] == k)) {
+                if (seg > 0) {
+                    c.code.resize(c.code.size() + sizeof(LoOp0), 0);
+                    c.segments[seg-1].size = c.code.size() - c.segments[seg-1].offset;
+                }
+                c.segments[seg].offset = c.code.size();
+                seg++;
+            }
+            const Node &n = nodes[t.nodes[k]];
+            const size_t *src = &srcs[n.src];
+            uint32_t dst = t.base + n.loc;
+            for (size_t i = 0; i < n.size; ) {
+                LoOp4 op = {};
+                memcpy(&op, &ops[n.offset + i], LoOpSize[((LoOp4*)&ops[n.offset + i])->op]);
+                i += LoOpSize[op.op];
+                uint32_t *args = &op.a;
+                for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+                    if ((*r == 's') || (*r == 'x')) {
+                        const Node &m = nodes[*src++];
+                        *args = th[m.thread].base + m.loc;
+                    }
+                }
+                if (LoOpArgs[op.op][0] == 'd') op.a = dst;
+                // The in-place instructions stay in-place only
+                // if the new locations allow it.
+                if ((op.op == LOP_SETMUL) && (op.a != dst)) {
+                    op = LoOp4{LOP_MUL, dst, op.a, op.b, 0};
+                } else if ((op.op == LOP_SETADDMUL) && (op.a != dst)) {
+                    op = LoOp4{LOP_ADDMUL, dst, op.a, op.b, op.c};
+                }
+                const uint8_t *p = (const uint8_t*)&op;
+                c.code.insert(c.code.end(), p, p + LoOpSize[op.op]);
+            }
+        }
+        if (seg > 0) {
+            c.code.resize(c.code.size() + sizeof(LoOp0), 0);
+            c.segments[seg-1].size = c.code.size() - c.segments[seg-1].offset;
+        }
+        // See the note about the zero padding in code_evaluate_lo_mem().
+        c.code.resize(c.code.size() + CODE_PAGELUFT, 0);
+    }
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        const Node &n = nodes[locdef[tr.outputs[i]]];
+        pc.outputs[i] = th[n.thread].base + n.loc;
+    }
+    pc.nthreads = nthreads;
+    pc.nlocations = nlocations;
+    pc.work = work;
+    pc.span = 0;
+    for (auto &&t : th) pc.span = std::max(pc.span, t.free);
+    pc.threads.swap(tc);
+    return 0;
+}
+
+API void
+par_reset(ParState &ps, size_t nthreads)
+{
+    if (ps.progress.size() != nthreads) ps.progress = std::vector<ParState::Progress>(nthreads);
+    for (auto &&p : ps.progress) p.nsegments.store(0, std::memory_order_relaxed);
+    ps.error.store(0, std::memory_order_relaxed);
+}
+
+API void
+par_evaluate_thread(const ParCode &pc, size_t t, ParState &ps, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    const ParThreadCode &tc = pc.threads[t];
+    for (size_t s = 0; s < tc.segments.size(); s++) {
+        const ParSegment &seg = tc.segments[s];
+        for (size_t w = seg.waits; w < seg.waits + seg.nwaits; w++) {
+            const ParWait &pw = tc.waits[w];
+            const std::atomic<size_t> &n = ps.progress[pw.thread].nsegments;
+            for (unsigned i = 0; n.load(std::memory_order_acquire) < pw.nsegments; i++) {
+                if (ps.error.load(std::memory_order_relaxed) != 0) return;
+#if defined(__x86_64__) || defined(__i386__)
+                if (i < 1024) { __builtin_ia32_pause(); continue; }
+#endif
+                sched_yield();
+            }
+        }
+        int r = code_evaluate_lo_mem(&tc.code[seg.offset], seg.size, input, constants, data, mod);
+        if (unlikely(r != 0)) {
+            int zero = 0;
+            ps.error.compare_exchange_strong(zero, r);
+            return;
+        }
+        ps.progress[t].nsegments.store(s + 1, std::memory_order_release);
+    }
+}
+
+/* Slices of the finalized code.
+ *
+ * Once some of the outputs are no longer needed, only the
+ * instructions in the dependency cones of the rest need to be
+ * evaluated. code_slice() finds these cones by a backward pass
+ * over the code that tracks which data locations are live,
+ * and collects the instructions that write the live locations
+ * (keeping the assertions only if their operand is live
+ * anyway). Because the cones of fewer outputs are always a
+ * subset, a slice can be sliced again as the set of needed
+ * outputs shrinks, so each pass is cheaper than the previous.
+ *
+ * The code is walked backward in chunks: each chunk starts
+ * at a known instruction boundary, and is decoded forward
+ * first. For the whole finalized code these are its pages.
+ */
+
+#define SLICE_CHUNK 4096
+
+struct CodeSlice {
+    // The instructions, followed by CODE_PAGELUFT of padding.
+    std::vector<uint8_t> code;
+    size_t size;
+    // The offsets of every SLICE_CHUNK-th instruction.
+    std::vector<size_t> chunks;
+};
+
+API int
+code_slice(CodeSlice &slice, const uint8_t *code, size_t size, const size_t *chunks, size_t nchunks, nloc_t nlocations, size_t nroots, const nloc_t *roots)
+{
+    std::vector<uint8_t> live(nlocations, 0);
+    for (size_t i = 0; i < nroots; i++) {
+        if (roots[i] >= nlocations) return 2;
+        live[roots[i]] = 1;
+    }
+    // Whether each instruction is kept, from the last one
+    // to the first.
+    std::vector<uint8_t> keep;
+    std::vector<size_t> offsets;
+    bool inacc = false;
+    for (size_t c = nchunks; c > 0; c--) {
+        offsets.clear();
+        uint8_t *from = (uint8_t*)code + chunks[c-1];
+        uint8_t *to = (uint8_t*)code + ((c < nchunks) ? chunks[c] : size);
+        LOOP_ITER_BEGIN(from, to)
+            offsets.push_back(INSTR - code);
+        LOOP_ITER_END(from, to)
+        for (size_t i = offsets.size(); i > 0; i--) {
+            const LoOp4 &op = *(const LoOp4*)(code + offsets[i-1]);
+            const char *roles = LoOpArgs[op.op];
+            const uint32_t *args = &op.a;
+            bool k = false;
+            if ((op.op == LOP_ACC1) || (op.op == LOP_ACC3) || (op.op == LOP_NACC1) || (op.op == LOP_NACC3)) {
+                k = inacc;
+            } else if ((op.op == LOP_ASSERT_INT) || (op.op == LOP_ASSERT_NEGINT)) {
+                if (args[0] >= nlocations) return 2;
+                k = live[args[0]];
+                inacc = false;
+            } else if ((roles[0] == 'd') || (roles[0] == 'x')) {
+                if (args[0] >= nlocations) return 2;
+                k = live[args[0]];
+                if (roles[0] == 'd') live[args[0]] = 0;
+                inacc = k && (op.op == LOP_ACCEND);
+            }
+            if (k) {
+                for (const char *r = roles; *r; r++, args++) {
+                    if ((*r == 's') || (*r == 'x')) {
+                        if (*args >= nlocations) return 2;
+                        live[*args] = 1;
+                    }
+                }
+            }
+            keep.push_back(k);
+        }
+    }
+    CodeSlice s;
+    s.code.reserve(size + CODE_PAGELUFT);
+    size_t idx = keep.size(), nkept = 0;
+    for (size_t c = 0; c < nchunks; c++) {
+        uint8_t *from = (uint8_t*)code + chunks[c];
+        uint8_t *to = (uint8_t*)code + ((c + 1 < nchunks) ? chunks[c+1] : size);
+        LOOP_ITER_BEGIN(from, to)
+            if (keep[--idx]) {
+                if (nkept++ % SLICE_CHUNK == 0) s.chunks.push_back(s.code.size());
+                s.code.insert(s.code.end(), INSTR, INSTR + LoOpSize[OP]);
+            }
+        LOOP_ITER_END(from, to)
+    }
+    s.size = s.code.size();
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    s.code.resize(s.size + CODE_PAGELUFT, 0);
+    s.code.shrink_to_fit();
+    std::swap(slice, s);
+    return 0;
+}
+
+// Slice the in-memory copy of the whole finalized code, as
+// loaded by TR_EVAL_BEGIN().
+API int
+tr_slice(CodeSlice &slice, const Trace &tr, const uint8_t *code, size_t nroots, const nloc_t *roots)
+{
+    if (code_size(tr.code) != 0) return 1;
+    std::vector<size_t> pages;
+    for (size_t ofs = 0; ofs < tr.fincode.filesize; ofs += CODE_PAGESIZE) pages.push_back(ofs);
+    return code_slice(slice, code, tr.fincode.filesize, pages.data(), pages.size(), tr.nfinlocations, nroots, roots);
+}
+
+/* Hoisting of the input-independent code.
+ *
+ * Large parts of a typical trace depend only on the constants,
+ * and so only change with the prime. tr_hoist() moves all the
+ * instructions that do not depend on the inputs (directly or
+ * through their operands) into a prologue, to be evaluated
+ * once per prime, and leaves the rest as the body, evaluated
+ * once per probe after it.
+ *
+ * Because the finalized code reuses the data locations, the
+ * values that the body (or an output) reads from the prologue
+ * are moved into locations of their own, past all the others,
+ * where the body never writes; SETMUL and SETADDMUL on such
+ * values become MUL and ADDMUL. The rest of the prologue
+ * values are temporaries, and reuse the ordinary locations,
+ * which the body overwrites anyway. An accumulation is only
+ * moved as a whole.
+ */
+
+#define HOIST_NONE (~(uint32_t)0)
+
+struct HoistedCode {
+    // The instructions of each part, followed by CODE_PAGELUFT
+    // of padding.
+    std::vector<uint8_t> prologue, body;
+    size_t prologuesize, bodysize;
+    nloc_t nlocations;
+    std::vector<nloc_t> outputs;
+};
+
+API int
+tr_hoist(HoistedCode &hc, const Trace &tr)
+{
+    if (code_size(tr.code) != 0) return 1;
+    const nloc_t N = tr.nfinlocations;
+    // The prologue value that each location currently holds
+    // (if any); the values are numbered in the order of their
+    // definition, and the prologue refers to them by these
+    // numbers until the locations are allocated.
+    std::vector<uint32_t> cur(N, HOIST_NONE);
+    // Whether each prologue value is read by the body.
+    std::vector<uint8_t> pinned;
+    std::vector<size_t> offsets;
+    std::vector<LoOp4> acc;
+    HoistedCode h;
+    auto independent = [&](const LoOp4 &op) {
+        const uint32_t *args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if (((*r == 's') || (*r == 'x')) && (cur[*args] == HOIST_NONE)) return false;
+        }
+        return op.op != LOP_VAR;
+    };
+    auto place = [&](LoOp4 op, bool hoist) {
+        uint32_t *args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if ((*r == 's') && hoist) {
+                *args = cur[*args];
+            } else if ((*r == 's') && (cur[*args] != HOIST_NONE)) {
+                pinned[cur[*args]] = 1;
+                *args = N + cur[*args];
+            }
+        }
+        args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if ((*r == 'd') && hoist) {
+                cur[*args] = pinned.size();
+                *args = pinned.size();
+                pinned.push_back(0);
+            } else if ((*r == 'd') || (*r == 'x')) {
+                cur[*args] = HOIST_NONE;
+            }
+        }
+        std::vector<uint8_t> &code = hoist ? h.prologue : h.body;
+        if (hoist) offsets.push_back(code.size());
+        const uint8_t *p = (const uint8_t*)&op;
+        code.insert(code.end(), p, p + LoOpSize[op.op]);
+    };
+    Code fincode = tr.fincode;
+    CODE_PAGEITER_BEGIN(fincode, 0)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        if ((OP != LOP_HALT) && (OP != LOP_NOP)) {
+            LoOp4 op = {OP, A, B, C, D};
+            const uint32_t *args = &op.a;
+            for (const char *r = LoOpArgs[OP]; *r; r++, args++) {
+                if ((*r != 'i') && (*args >= N)) return 2;
+            }
+            // The in-place updates of the prologue values can not
+            // stay in place.
+            if ((OP == LOP_SETMUL) && (cur[A] != HOIST_NONE)) op = LoOp4{LOP_MUL, A, A, B, 0};
+            if ((OP == LOP_SETADDMUL) && (cur[A] != HOIST_NONE)) op = LoOp4{LOP_ADDMUL, A, A, B, C};
+            if ((OP == LOP_ACC1) || (OP == LOP_ACC3) || (OP == LOP_NACC1) || (OP == LOP_NACC3)) {
+                acc.push_back(op);
+            } else if (OP == LOP_ACCEND) {
+                bool hoist = true;
+                for (auto &&o : acc) hoist = hoist && independent(o);
+                for (auto &&o : acc) place(o, hoist);
+                place(op, hoist);
+                acc.clear();
+            } else {
+                place(op, independent(op));
+            }
+        }
+    LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    for (size_t i = 0; i < tr.noutputs; i++) {
+        nloc_t x = tr.outputs[i];
+        if (x >= N) return 2;
+        if (cur[x] != HOIST_NONE) {
+            pinned[cur[x]] = 1;
+            x = N + cur[x];
+        }
+        h.outputs.push_back(x);
+    }
+    // Allocate the temporaries going backwards, as in
+    // tr_finalize(), and then put the pinned values past them.
+    std::vector<uint32_t> loc(pinned.size(), HOIST_NONE);
+    LocPool pool;
+    locpool_init(pool, 0, false);
+    for (size_t i = offsets.size(); i > 0; i--) {
+        const LoOp4 &op = *(const LoOp4*)&h.prologue[offsets[i-1]];
+        const uint32_t *args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if ((*r == 'd') && !pinned[*args]) {
+                if (loc[*args] == HOIST_NONE) loc[*args] = locpool_take(pool, false, LOCPOOL_NOHINT);
+                locpool_release(pool, loc[*args]);
+            }
+        }
+        args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if ((*r == 's') && !pinned[*args] && (loc[*args] == HOIST_NONE)) {
+                loc[*args] = locpool_take(pool, false, LOCPOOL_NOHINT);
+            }
+        }
+    }
+    nloc_t base = std::max((size_t)N, pool.maxused);
+    h.nlocations = base;
+    for (size_t i = 0; i < pinned.size(); i++) {
+        if (pinned[i]) loc[i] = h.nlocations++;
+    }
+    for (size_t i = 0; i < offsets.size(); i++) {
+        LoOp4 &op = *(LoOp4*)&h.prologue[offsets[i]];
+        uint32_t *args = &op.a;
+        for (const char *r = LoOpArgs[op.op]; *r; r++, args++) {
+            if (*r != 'i') *args = loc[*args];
+        }
+    }
+    h.bodysize = h.body.size();
+    h.body.resize(h.bodysize + CODE_PAGELUFT, 0);
+    LOOP_ITER_BEGIN(&h.body[0], &h.body[h.bodysize])
+        uint32_t *args = &((LoOp4*)INSTR)->a;
+        for (const char *r = LoOpArgs[OP]; *r; r++, args++) {
+            if ((*r == 's') && (*args >= N)) *args = loc[*args - N];
+        }
+    LOOP_ITER_END(&h.body[0], &h.body[h.bodysize])
+    for (auto &&x : h.outputs) {
+        if (x >= N) x = loc[x - N];
+    }
+    h.prologuesize = h.prologue.size();
+    // See the note about the zero padding in code_evaluate_lo_mem().
+    h.prologue.resize(h.prologuesize + CODE_PAGELUFT, 0);
+    h.prologue.shrink_to_fit();
+    h.body.shrink_to_fit();
+    std::swap(hc, h);
+    return 0;
+}
+
+// Evaluate the prologue, once per prime.
+API int
+hoisted_evaluate_prologue(const HoistedCode &hc, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
+{
+    return code_evaluate_lo_mem(&hc.prologue[0], hc.prologuesize, NULL, constants, data, mod);
+}
+
+// Evaluate the body, once per probe; the data must already
+// hold the results of hoisted_evaluate_prologue().
+API int
+tr_evaluate_hoisted(const HoistedCode &hc, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, const ncoef_t *restrict constants, nmod_t mod)
+{
+    int r = code_evaluate_lo_mem(&hc.body[0], hc.bodysize, input, constants, data, mod);
+    if (unlikely(r != 0)) return r;
+    for (size_t i = 0; i < hc.outputs.size(); i++) {
+        output[i] = data[hc.outputs[i]];
+    }
+    return 0;
+}
+
+/* JIT compilation of the finalized code into x86-64 machine
+ * code.
+ *
+ * Each LoOp is translated into a straight-line sequence of
+ * instructions with the data offsets baked in as immediates,
+ * so there is no dispatch and no operand decoding left. The
+ * arithmetic instructions (COPY, VAR, INT, NEGINT, BIGINT, NEG,
+ * ADD, SUB, MUL, ADDMUL, SETMUL, SETADDMUL, and the fused ADD3,
+ * SUBMUL, DIFFMUL, NEGMUL) are emitted inline;
+ * the rest call jit_step(), which runs a single instruction
+ * through the usual INSTR_* macros.
+ *
+ * The accumulations (ACC1, ACC3, NACC1, NACC3, ACCEND) are
+ * also inline, with the accumulator in rdi:rsi; tr_finalize()
+ * emits each accumulation as one contiguous run, so it is
+ * never interrupted by a jit_step() call.
+ *
+ * The generated function follows the SysV calling convention:
+ *
+ *     int fn(const ncoef_t *input, const ncoef_t *constants,
+ *            ncoef_t *data, const nmod_t *mod);
+ *
+ * It keeps rbx=data, rbp=input, r12=constants, r13=mod,
+ * r15=mod.n, r14=mod.n<<mod.norm, and cl=mod.norm.
+ */
+
+typedef int (*JitFunction)(const ncoef_t *input, const ncoef_t *constants, ncoef_t *data, const nmod_t *mod);
+
+struct JitCode {
+    JitFunction fn;
+    uint8_t *mem;
+    size_t memsize;
+    size_t size;
+    uint8_t *ops;
+};
+
+static int
+jit_step(const uint8_t *restrict pi, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, const nmod_t *restrict pmod)
+{
+    nmod_t mod = *pmod;
+    // The accumulations are always compiled inline, so this
+    // accumulator is only here to make the macros compile.
+    mp_limb_t acc_hi = 0, acc_lo = 0;
+    (void)acc_hi; (void)acc_lo;
+    uint32_t A = ((LoOp4*)pi)->a;
+    uint32_t B = ((LoOp4*)pi)->b;
+    uint32_t C = ((LoOp4*)pi)->c;
+    uint32_t D = ((LoOp4*)pi)->d;
+    (void)A; (void)B; (void)C; (void)D;
+#define INSTR(opname, nargs, code) case LOP_ ## opname: { code; } break;
+    switch (((LoOp4*)pi)->op) {
+        case LOP_HALT: break;
+        LOOP_INSTRUCTIONS(INSTR)
+        default: return 1;
+    }
+#undef INSTR
+    return 0;
+}
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+static inline void
+jit_bytes(uint8_t *&p, const char *bytes, size_t n)
 {
-    CODE_PAGEITER_BEGIN(tr.fincode, 0)
-    LOOP_ITER_BEGIN(PAGE, PAGEEND)
-        switch (OP) {
-        case LOP_HALT: goto halt;
-        case LOP_VAR: fprintf(f, "%" PRIu32 " = var #%" PRIu32 "\n", A, B); break;
-        case LOP_INT: fprintf(f, "%" PRIu32 " = int #%" PRIu64 "\n", A, (uint64_t)B | ((uint64_t)C << 32)); break;
-        case LOP_NEGINT: fprintf(f, "%" PRIu32 " = negint #%" PRIu32 "\n", A, B); break;
-        case LOP_BIGINT: fprintf(f, "%" PRIu32 " = bigint #%" PRIu32 "\n", A, B); break;
-        case LOP_COPY: fprintf(f, "%" PRIu32 " = copy %" PRIu32 "\n", A, B); break;
-        case LOP_INV: fprintf(f, "%" PRIu32 " = inv %" PRIu32 "\n", A, B); break;
-        case LOP_NEGINV: fprintf(f, "%" PRIu32 " = neginv %" PRIu32 "\n", A, B); break;
-        case LOP_NEG: fprintf(f, "%" PRIu32 " = neg %" PRIu32 "\n", A, B); break;
-        case LOP_SHOUP_PRECOMP: fprintf(f, "%" PRIu32 " = shoup_precomp %" PRIu32 "\n", A, B); break;
-        case LOP_POW: fprintf(f, "%" PRIu32 " = pow %" PRIu32 " #%" PRIu32 "\n", A, B, C); break;
-        case LOP_ADD: fprintf(f, "%" PRIu32 " = add %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
-        case LOP_SUB: fprintf(f, "%" PRIu32 " = sub %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
-        case LOP_MUL: fprintf(f, "%" PRIu32 " = mul %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
-        case LOP_SHOUP_MUL: fprintf(f, "%" PRIu32 " = shoup_mul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
-        case LOP_ADDMUL: fprintf(f, "%" PRIu32 " = addmul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C, D); break;
-        case LOP_ASSERT_INT: fprintf(f, "assert_int %" PRIu32 " #%" PRIu32 "\n", A, B); break;
-        case LOP_ASSERT_NEGINT: fprintf(f, "assert_negint %" PRIu32 " #%" PRIu32 "\n", A, B); break;
-        case LOP_NOP: fprintf(f, "nop\n"); break;
-        case LOP_SETMUL: fprintf(f, "setmul %" PRIu32 " %" PRIu32 "\n", A, B); break;
-        case LOP_SETADDMUL: fprintf(f, "setaddmul %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", A, B, C); break;
-        default: fprintf(f, "op_%d %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", OP, A, B, C, D); break;
-        }
-    LOOP_ITER_END(PAGE, PAGEEND)
-halt:;
-    CODE_PAGEITER_END()
-    for (size_t i = 0; i < tr.noutputs; i++) {
-        nloc_t loc = tr.outputs[i];
-        fprintf(f, "output %zu #%zu '%s'\n", loc, i, tr.output_names[i].c_str());
-    }
+    memcpy(p, bytes, n);
+    p += n;
 }
 
-API void
-tr_print_disasm(FILE *f, Trace &tr)
+static inline void
+jit_u32(uint8_t *&p, uint32_t x)
 {
-    tr_flush(tr);
-    fprintf(f, "# low-level code (%zuB)\n", code_size(tr.fincode));
-    tr_print_disasm_fin(f, tr);
-    fprintf(f, "# high-level code (%zuB)\n", code_size(tr.code));
-    tr_print_disasm_tmp(f, tr);
+    memcpy(p, &x, 4);
+    p += 4;
 }
 
-/* Trace evaluation
+/* op reg, [base + disp32]; base must not be rsp or r12.
  */
+static inline void
+jit_rm(uint8_t *&p, uint8_t opcode, int reg, int base, uint32_t disp)
+{
+    *p++ = 0x48 | ((reg & 8) >> 1) | ((base & 8) >> 3);
+    *p++ = opcode;
+    *p++ = 0x80 | ((reg & 7) << 3) | (base & 7);
+    jit_u32(p, disp);
+}
 
-NMOD_VEC_INLINE
-mp_limb_t _nmod_mul(mp_limb_t a, mp_limb_t b, nmod_t mod)
+/* op rm, reg (or op reg, rm, depending on the opcode).
+ */
+static inline void
+jit_rr(uint8_t *&p, uint8_t opcode, int reg, int rm)
 {
-    mp_limb_t res, hi, lo;
-    umul_ppmm(hi, lo, a, b);
-    NMOD_RED2(res, hi, lo, mod);
-    return res;
+    *p++ = 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    *p++ = opcode;
+    *p++ = 0xC0 | ((reg & 7) << 3) | (rm & 7);
 }
 
-#define INSTR_VAR(dst, a, b, c) data[dst] = input[a];
-#define INSTR_INT(dst, a, b, c) data[dst] = a;
-#define INSTR_NEGINT(dst, a, b, c) data[dst] = nmod_neg(a, mod);
-#define INSTR_BIGINT(dst, a, b, c) data[dst] = fmpz_get_nmod(&constants[a], mod);
-#define INSTR_COPY(dst, a, b, c) data[dst] = data[a];
-#define INSTR_INV(dst, a, b, c) if (unlikely(n_gcdinv(&data[dst], data[a], mod.n) != 1)) return 2;
-#define INSTR_NEGINV(dst, a, b, c) if (unlikely(n_gcdinv(&data[dst], nmod_neg(data[a], mod), mod.n) != 1)) return 3;
-#define INSTR_NEG(dst, a, b, c) data[dst] = nmod_neg(data[a], mod);
-#define INSTR_SHOUP_PRECOMP(dst, a, b, c) data[dst] = n_mulmod_precomp_shoup(data[a], mod.n);
-#define INSTR_POW(dst, a, b, c) data[dst] = nmod_pow_ui(data[a], b, mod);
-#define INSTR_ADD(dst, a, b, c) data[dst] = _nmod_add(data[a], data[b], mod);
-#define INSTR_SUB(dst, a, b, c) data[dst] = _nmod_sub(data[a], data[b], mod);
-#define INSTR_MUL(dst, a, b, c) data[dst] = nmod_mul(data[a], data[b], mod);
-#define INSTR_SHOUP_MUL(dst, a, b, c) data[dst] = n_mulmod_shoup(data[a], data[b], data[c], mod.n);
-#define INSTR_ADDMUL(dst, a, b, c) data[dst] = nmod_addmul(data[a], data[b], data[c], mod);
-#define INSTR_ASSERT_INT(dst, a, b, c) if (unlikely(data[a] != b)) return 4;
-#define INSTR_ASSERT_NEGINT(dst, a, b, c) if (unlikely(data[a] != nmod_neg(b, mod))) return 5;
-#define INSTR_NOP(dst, a, b, c)
+static inline void
+jit_rr2(uint8_t *&p, uint8_t opcode, int reg, int rm)
+{
+    *p++ = 0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+    *p++ = 0x0F;
+    *p++ = opcode;
+    *p++ = 0xC0 | ((reg & 7) << 3) | (rm & 7);
+}
 
-static const char * code_error_strings[] = {
-    /* 0 */ "success",
-    /* 1 */ "unsupported opcode",
-    /* 2 */ "modular invert does not exist (in INV)",
-    /* 3 */ "modular invert does not exist (in NEGINV)",
-    /* 4 */ "asserted value does not match (in INT)",
-    /* 5 */ "asserted value does not match (in NEGINT)",
-};
+static inline void
+jit_mov_imm64(uint8_t *&p, int reg, uint64_t imm)
+{
+    *p++ = 0x48 | ((reg & 8) >> 3);
+    *p++ = 0xB8 + (reg & 7);
+    memcpy(p, &imm, 8);
+    p += 8;
+}
 
-API const char *
-code_strerror(int code)
+#define JIT_LOAD(reg, loc) jit_rm(p, 0x8B, reg, RBX, (loc)*sizeof(ncoef_t))
+#define JIT_STORE(loc, reg) jit_rm(p, 0x89, reg, RBX, (loc)*sizeof(ncoef_t))
+#define JIT_MOV(dst, src) jit_rr(p, 0x89, src, dst)
+#define JIT_ADD(dst, src) jit_rr(p, 0x01, src, dst)
+#define JIT_SUB(dst, src) jit_rr(p, 0x29, src, dst)
+#define JIT_CMP(a, b) jit_rr(p, 0x39, b, a)
+#define JIT_CMOVA(dst, src) jit_rr2(p, 0x47, dst, src)
+#define JIT_CMOVAE(dst, src) jit_rr2(p, 0x43, dst, src)
+#define JIT_CMOVB(dst, src) jit_rr2(p, 0x42, dst, src)
+#define JIT_CMOVZ(dst, src) jit_rr2(p, 0x44, dst, src)
+
+/* rax = (rax + src) mod n, using rdx as a temporary.
+ */
+static inline void
+jit_addmod_rax(uint8_t *&p, int src)
 {
-    if ((code < 0) || (code >= countof(code_error_strings)))
-        return "unknown error";
-    return code_error_strings[code];
+    JIT_ADD(RAX, src);
+    JIT_MOV(RDX, RAX);
+    JIT_SUB(RDX, R15);
+    JIT_CMOVAE(RAX, RDX);
 }
 
-API int
-code_evaluate_hi(const Code &restrict code, uint64_t index0, const ncoef_t *restrict input, const fmpz *restrict constants, ncoef_t *restrict data, nmod_t mod)
+/* rax = (rax - src) mod n, using r8 as a temporary.
+ */
+static inline void
+jit_submod_rax(uint8_t *&p, int src)
 {
-    if (code_size(code) == 0) return 0;
-    if (mod.norm <= 0) return -1;
-    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
-    uint64_t DST = index0;
-    CODE_ITER_BEGIN(code, 0)
-        switch(OP) {
-        case HOP_VAR: INSTR_VAR(DST, A, B, C); break;
-        case HOP_INT: INSTR_INT(DST, A, B, C); break;
-        case HOP_NEGINT: INSTR_NEGINT(DST, A, B, C); break;
-        case HOP_BIGINT: INSTR_BIGINT(DST, A, B, C); break;
-        case HOP_COPY: INSTR_COPY(DST, A, B, C); break;
-        case HOP_INV: INSTR_INV(DST, A, B, C); break;
-        case HOP_NEGINV: INSTR_NEGINV(DST, A, B, C); break;
-        case HOP_NEG: INSTR_NEG(DST, A, B, C); break;
-        case HOP_SHOUP_PRECOMP: INSTR_SHOUP_PRECOMP(DST, A, B, C); break;
-        case HOP_POW: INSTR_POW(DST, A, B, C); break;
-        case HOP_ADD: INSTR_ADD(DST, A, B, C); break;
-        case HOP_SUB: INSTR_SUB(DST, A, B, C); break;
-        case HOP_MUL: INSTR_MUL(DST, A, B, C); break;
-        case HOP_SHOUP_MUL: INSTR_SHOUP_MUL(DST, A, B, C); break;
-        case HOP_ADDMUL: INSTR_ADDMUL(DST, A, B, C); break;
-        case HOP_ASSERT_INT: INSTR_ASSERT_INT(DST, A, B, C); break;
-        case HOP_ASSERT_NEGINT: INSTR_ASSERT_NEGINT(DST, A, B, C); break;
-        case HOP_NOP: INSTR_NOP(DST, A, B, C); break;
-        }
-        DST++;
-    CODE_ITER_END()
-    return 0;
+    jit_bytes(p, "\x45\x31\xC0", 3); // xor r8d, r8d
+    JIT_SUB(RAX, src);
+    JIT_CMOVB(R8, R15);
+    JIT_ADD(RAX, R8);
 }
 
-API int
-code_evaluate_lo_mem(const uint8_t *restrict code, size_t size, const ncoef_t *restrict input, const fmpz *restrict constants, ncoef_t *restrict data, nmod_t mod)
+/* rax = -rdx mod n.
+ */
+static inline void
+jit_negmod_rdx(uint8_t *&p)
 {
-    if (size == 0) return 0;
-    if (mod.norm <= 0) return -1;
-    static void *jumptable[LOP_COUNT] = {
-        &&do_HALT,
-        &&do_VAR,
-        &&do_INT,
-        &&do_NEGINT,
-        &&do_BIGINT,
-        &&do_COPY,
-        &&do_INV,
-        &&do_NEGINV,
-        &&do_NEG,
-        &&do_SHOUP_PRECOMP,
-        &&do_POW,
-        &&do_ADD,
-        &&do_SUB,
-        &&do_MUL,
-        &&do_SHOUP_MUL,
-        &&do_ADDMUL,
-        &&do_ASSERT_INT,
-        &&do_ASSERT_NEGINT,
-        &&do_NOP,
-        &&do_SETMUL,
-        &&do_SETADDMUL,
-    };
-    // Note that this implementation assumes that there is at
-    // least a LoOp4-sized zero padding past the end of the page
-    // buffer. This is why CODE_PAGELUFT exists. This padding
-    // will be read as the LOP_HALT instruction, which is the
-    // only way the cycle below terminates.
-    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
-    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(code, 4);
-    const uint8_t *pend = pi + size;
-#define INSTR(opname, nargs, code) \
-        do_ ## opname:; { \
-            uint32_t A = ((LoOp4*)pi)->a; \
-            uint32_t B = ((LoOp4*)pi)->b; \
-            uint32_t C = ((LoOp4*)pi)->c; \
-            uint32_t D = ((LoOp4*)pi)->d; \
-            (void)A; (void)B; (void)C; (void)D; \
-            pi += sizeof(LoOp ## nargs); \
-            code; \
-            goto *jumptable[((LoOp4*)pi)->op]; \
-        }
-    goto *jumptable[((LoOp4*)pi)->op];
-    for (;;) {
-        INSTR(HALT, 0, if (pi >= pend) break);
-        INSTR(VAR, 2, INSTR_VAR(A, B, C, D))
-        INSTR(INT, 3, INSTR_INT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0))
-        INSTR(NEGINT, 3, INSTR_NEGINT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0))
-        INSTR(BIGINT, 2, INSTR_BIGINT(A, B, C, D))
-        INSTR(COPY, 2, INSTR_COPY(A, B, C, D))
-        INSTR(INV, 2, INSTR_INV(A, B, C, D))
-        INSTR(NEGINV, 2, INSTR_NEGINV(A, B, C, D))
-        INSTR(NEG, 2, INSTR_NEG(A, B, C, D))
-        INSTR(SHOUP_PRECOMP, 2, INSTR_SHOUP_PRECOMP(A, B, C, D))
-        INSTR(POW, 3, INSTR_POW(A, B, C, D))
-        INSTR(ADD, 3, INSTR_ADD(A, B, C, D))
-        INSTR(SUB, 3, INSTR_SUB(A, B, C, D))
-        INSTR(MUL, 3, INSTR_MUL(A, B, C, D))
-        INSTR(SHOUP_MUL, 4, INSTR_SHOUP_MUL(A, B, C, D))
-        INSTR(ADDMUL, 4, INSTR_ADDMUL(A, B, C, D))
-        INSTR(ASSERT_INT, 2, INSTR_ASSERT_INT(0, A, B, C))
-        INSTR(ASSERT_NEGINT, 2, INSTR_ASSERT_NEGINT(0, A, B, C))
-        INSTR(NOP, 0, )
-        INSTR(SETMUL, 2, INSTR_MUL(A, A, B, C))
-        INSTR(SETADDMUL, 3, INSTR_ADDMUL(A, A, B, C))
-    }
-#undef INSTR
-    return 0;
+    JIT_MOV(RAX, R15);
+    JIT_SUB(RAX, RDX);
+    jit_rr(p, 0x85, RDX, RDX); // test rdx, rdx
+    JIT_CMOVZ(RAX, RDX);
+}
+
+/* r10 = rdx:rax mod n, via NMOD_RED2; rdx must be below n.
+ */
+static inline void
+jit_red2_r10(uint8_t *&p)
+{
+    jit_rr2(p, 0xA5, RAX, RDX); // shld rdx, rax, cl
+    jit_rr(p, 0xD3, 4, RAX); // shl rax, cl
+    JIT_MOV(R8, RAX);
+    JIT_MOV(R9, RDX);
+    jit_rm(p, 0x8B, RAX, R13, offsetof(nmod_t, ninv));
+    jit_rr(p, 0xF7, 4, R9); // mul r9
+    JIT_ADD(RAX, R8);
+    jit_rr(p, 0x11, R9, RDX); // adc rdx, r9
+    jit_rr(p, 0xFF, 0, RDX); // inc rdx
+    jit_rr2(p, 0xAF, RDX, R14); // imul rdx, r14
+    JIT_MOV(R10, R8);
+    JIT_SUB(R10, RDX);
+    JIT_MOV(R11, R10);
+    JIT_ADD(R11, R14);
+    JIT_CMP(R10, RAX);
+    JIT_CMOVA(R10, R11);
+    JIT_MOV(R11, R10);
+    JIT_SUB(R11, R14);
+    JIT_CMP(R10, R14);
+    JIT_CMOVAE(R10, R11);
+    jit_rr(p, 0xD3, 5, R10); // shr r10, cl
+}
+
+/* r10 = rax*data[b] mod n.
+ */
+static inline void
+jit_mulmod_rax_r10(uint8_t *&p, uint32_t b)
+{
+    jit_rm(p, 0xF7, 4, RBX, b*sizeof(ncoef_t)); // mul qword [b]
+    jit_red2_r10(p);
+}
+
+/* rdi:rsi += src (the accumulator).
+ */
+static inline void
+jit_acc(uint8_t *&p, int src)
+{
+    JIT_ADD(RSI, src);
+    jit_bytes(p, "\x48\x83\xD7\x00", 4); // adc rdi, 0
+}
+
+/* r10 = data[a]*data[b] mod n.
+ */
+static inline void
+jit_mulmod_r10(uint8_t *&p, uint32_t a, uint32_t b)
+{
+    JIT_LOAD(RAX, a);
+    jit_mulmod_rax_r10(p, b);
+}
+
+// The longest inline sequence (ADDMUL) is about 120 bytes.
+#define JIT_MAX_INSTR_SIZE 192
+
+API void
+jit_free(JitCode &jit)
+{
+    if (jit.mem != NULL) munmap(jit.mem, jit.memsize);
+    free(jit.ops);
+    jit.fn = NULL;
+    jit.mem = NULL;
+    jit.ops = NULL;
+    jit.memsize = 0;
 }
 
+/* Compile the finalized code of a trace; return 0 on success,
+ * and a non-zero value if the code can not be compiled (in
+ * which case the interpreter should be used instead).
+ */
 API int
-code_evaluate_lo(const Code &restrict code, const ncoef_t *restrict input, const fmpz *restrict constants, ncoef_t *restrict data, nmod_t mod)
+jit_compile(JitCode &jit, const Trace &tr)
 {
-    if (code_size(code) == 0) return 0;
-    if (mod.norm <= 0) return -1;
-    static void *jumptable[LOP_COUNT] = {
-        &&do_HALT,
-        &&do_VAR,
-        &&do_INT,
-        &&do_NEGINT,
-        &&do_BIGINT,
-        &&do_COPY,
-        &&do_INV,
-        &&do_NEGINV,
-        &&do_NEG,
-        &&do_SHOUP_PRECOMP,
-        &&do_POW,
-        &&do_ADD,
-        &&do_SUB,
-        &&do_MUL,
-        &&do_SHOUP_MUL,
-        &&do_ADDMUL,
-        &&do_ASSERT_INT,
-        &&do_ASSERT_NEGINT,
-        &&do_NOP,
-        &&do_SETMUL,
-        &&do_SETADDMUL,
-    };
-    CODE_PAGEITER_BEGIN(code, 0)
-    // Note that this implementation assumes that there is at
-    // least a LoOp4-sized zero padding past the end of the page
-    // buffer. This is why CODE_PAGELUFT exists. This padding
-    // will be read as the LOP_HALT instruction, which is the
-    // only way the cycle below terminates.
-    data = (ncoef_t*)ASSUME_ALIGNED(data, sizeof(ncoef_t));
-    const uint8_t *pi = (const uint8_t*)ASSUME_ALIGNED(PAGE, 4);
-#define INSTR(opname, nargs, code) \
-        do_ ## opname:; { \
-            uint32_t A = ((LoOp4*)pi)->a; \
-            uint32_t B = ((LoOp4*)pi)->b; \
-            uint32_t C = ((LoOp4*)pi)->c; \
-            uint32_t D = ((LoOp4*)pi)->d; \
-            (void)A; (void)B; (void)C; (void)D; \
-            pi += sizeof(LoOp ## nargs); \
-            code; \
-            goto *jumptable[((LoOp4*)pi)->op]; \
-        }
-    goto *jumptable[((LoOp4*)pi)->op];
-    for (;;) {
-        INSTR(HALT, 0, break);
-        INSTR(VAR, 2, INSTR_VAR(A, B, C, D))
-        INSTR(INT, 3, INSTR_INT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0))
-        INSTR(NEGINT, 3, INSTR_NEGINT(A, (uint64_t)B | ((uint64_t)C << 32), 0, 0))
-        INSTR(BIGINT, 2, INSTR_BIGINT(A, B, C, D))
-        INSTR(COPY, 2, INSTR_COPY(A, B, C, D))
-        INSTR(INV, 2, INSTR_INV(A, B, C, D))
-        INSTR(NEGINV, 2, INSTR_NEGINV(A, B, C, D))
-        INSTR(NEG, 2, INSTR_NEG(A, B, C, D))
-        INSTR(SHOUP_PRECOMP, 2, INSTR_SHOUP_PRECOMP(A, B, C, D))
-        INSTR(POW, 3, INSTR_POW(A, B, C, D))
-        INSTR(ADD, 3, INSTR_ADD(A, B, C, D))
-        INSTR(SUB, 3, INSTR_SUB(A, B, C, D))
-        INSTR(MUL, 3, INSTR_MUL(A, B, C, D))
-        INSTR(SHOUP_MUL, 4, INSTR_SHOUP_MUL(A, B, C, D))
-        INSTR(ADDMUL, 4, INSTR_ADDMUL(A, B, C, D))
-        INSTR(ASSERT_INT, 2, INSTR_ASSERT_INT(0, A, B, C))
-        INSTR(ASSERT_NEGINT, 2, INSTR_ASSERT_NEGINT(0, A, B, C))
-        INSTR(NOP, 0, )
-        INSTR(SETMUL, 2, INSTR_MUL(A, A, B, C))
-        INSTR(SETADDMUL, 3, INSTR_ADDMUL(A, A, B, C))
-    }
-#undef INSTR
+    jit.fn = NULL;
+    jit.mem = NULL;
+    jit.memsize = 0;
+    jit.size = 0;
+    jit.ops = NULL;
+#if defined(__x86_64__)
+    static_assert(offsetof(nmod_t, n) == 0, "unexpected nmod_t layout");
+    static_assert(offsetof(nmod_t, norm) == 16, "unexpected nmod_t layout");
+    if (code_size(tr.code) != 0) return 1;
+    // All the data offsets must fit into a signed 32-bit displacement.
+    if (tr.nfinlocations >= ((size_t)1 << 31)/sizeof(ncoef_t)) return 2;
+    if (tr.ninputs >= ((size_t)1 << 31)/sizeof(ncoef_t)) return 2;
+    size_t ninstr = 0;
+    CODE_PAGEITER_BEGIN(tr.fincode, 0)
+        LOOP_ITER_BEGIN(PAGE, PAGEEND)
+            ninstr++;
+        LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    jit.memsize = ((ninstr + 2)*JIT_MAX_INSTR_SIZE + pagesize - 1)/pagesize*pagesize;
+    void *mem = mmap(NULL, jit.memsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) { jit.memsize = 0; return 3; }
+    jit.mem = (uint8_t*)mem;
+    // The fallback instructions are copied here, each padded
+    // to a full LoOp4.
+    jit.ops = (uint8_t*)safe_malloc((ninstr + 1)*sizeof(LoOp4));
+    uint8_t *ops = jit.ops;
+    uint8_t *p = jit.mem;
+    std::vector<uint32_t> exits;
+    bool accactive = false;
+    // Prologue: push rbx, rbp, r12-r15; align the stack.
+    jit_bytes(p, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57\x48\x83\xEC\x08", 14);
+    JIT_MOV(RBP, RDI);
+    JIT_MOV(R12, RSI);
+    JIT_MOV(RBX, RDX);
+    JIT_MOV(R13, RCX);
+    jit_rm(p, 0x8B, R15, R13, offsetof(nmod_t, n));
+    jit_rm(p, 0x8B, RCX, R13, offsetof(nmod_t, norm));
+    JIT_MOV(R14, R15);
+    jit_rr(p, 0xD3, 4, R14); // shl r14, cl
+    CODE_PAGEITER_BEGIN(tr.fincode, 0)
+        LOOP_ITER_BEGIN(PAGE, PAGEEND)
+            if (!accactive && ((OP == LOP_ACC1) || (OP == LOP_ACC3) || (OP == LOP_NACC1) || (OP == LOP_NACC3))) {
+                jit_bytes(p, "\x31\xF6\x31\xFF", 4); // xor esi, esi; xor edi, edi
+                accactive = true;
+            }
+            switch (OP) {
+            case LOP_HALT: case LOP_NOP: break;
+            case LOP_ACC1: case LOP_ACC3:
+                for (int i = 0; i < ((OP == LOP_ACC1) ? 1 : 3); i++) {
+                    JIT_LOAD(RAX, (i == 0) ? A : (i == 1) ? B : C);
+                    jit_acc(p, RAX);
+                }
+                break;
+            case LOP_NACC1: case LOP_NACC3:
+                for (int i = 0; i < ((OP == LOP_NACC1) ? 1 : 3); i++) {
+                    JIT_MOV(RAX, R15);
+                    jit_rm(p, 0x2B, RAX, RBX, ((i == 0) ? A : (i == 1) ? B : C)*sizeof(ncoef_t)); // sub rax, [x]
+                    jit_acc(p, RAX);
+                }
+                break;
+            case LOP_ACCEND:
+                if (!accactive) {
+                    jit_bytes(p, "\x31\xF6\x31\xFF", 4); // xor esi, esi; xor edi, edi
+                }
+                JIT_MOV(RAX, RSI);
+                JIT_MOV(RDX, RDI);
+                jit_red2_r10(p);
+                JIT_STORE(A, R10);
+                accactive = false;
+                break;
+            case LOP_VAR:
+                jit_rm(p, 0x8B, RAX, RBP, B*sizeof(ncoef_t));
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_INT:
+                jit_mov_imm64(p, RAX, (uint64_t)B | ((uint64_t)C << 32));
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_NEGINT:
+                jit_mov_imm64(p, RDX, (uint64_t)B | ((uint64_t)C << 32));
+                jit_negmod_rdx(p);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_BIGINT:
+                // r12 can not be a base in jit_rm().
+                JIT_MOV(RDX, R12);
+                jit_rm(p, 0x8B, RAX, RDX, B*sizeof(ncoef_t));
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_COPY:
+                JIT_LOAD(RAX, B);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_NEG:
+                JIT_LOAD(RDX, B);
+                jit_negmod_rdx(p);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_ADD:
+                JIT_LOAD(RAX, B);
+                jit_rm(p, 0x03, RAX, RBX, C*sizeof(ncoef_t)); // add rax, [c]
+                JIT_MOV(RDX, RAX);
+                JIT_SUB(RDX, R15);
+                JIT_CMOVAE(RAX, RDX);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_SUB:
+                JIT_LOAD(R10, C);
+                JIT_LOAD(RAX, B);
+                jit_submod_rax(p, R10);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_ADD3:
+                JIT_LOAD(R10, C);
+                JIT_LOAD(RAX, B);
+                jit_addmod_rax(p, R10);
+                JIT_LOAD(R10, D);
+                jit_addmod_rax(p, R10);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_SUBMUL:
+                jit_mulmod_r10(p, C, D);
+                JIT_LOAD(RAX, B);
+                jit_submod_rax(p, R10);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_DIFFMUL:
+                JIT_LOAD(R10, C);
+                JIT_LOAD(RAX, B);
+                jit_submod_rax(p, R10);
+                jit_mulmod_rax_r10(p, D);
+                JIT_STORE(A, R10);
+                break;
+            case LOP_NEGMUL:
+                jit_mulmod_r10(p, B, C);
+                JIT_MOV(RDX, R10);
+                jit_negmod_rdx(p);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_MUL:
+                jit_mulmod_r10(p, B, C);
+                JIT_STORE(A, R10);
+                break;
+            case LOP_SETMUL:
+                jit_mulmod_r10(p, A, B);
+                JIT_STORE(A, R10);
+                break;
+            case LOP_ADDMUL:
+                jit_mulmod_r10(p, C, D);
+                JIT_LOAD(RAX, B);
+                jit_addmod_rax(p, R10);
+                JIT_STORE(A, RAX);
+                break;
+            case LOP_SETADDMUL:
+                jit_mulmod_r10(p, B, C);
+                JIT_LOAD(RAX, A);
+                jit_addmod_rax(p, R10);
+                JIT_STORE(A, RAX);
+                break;
+            default:
+                memset(ops, 0, sizeof(LoOp4));
+                memcpy(ops, INSTR, LoOpSize[OP]);
+                jit_mov_imm64(p, RDI, (uint64_t)ops);
+                ops += sizeof(LoOp4);
+                JIT_MOV(RSI, RBP);
+                JIT_MOV(RDX, R12);
+                JIT_MOV(RCX, RBX);
+                JIT_MOV(R8, R13);
+                jit_mov_imm64(p, RAX, (uint64_t)&jit_step);
+                jit_bytes(p, "\xFF\xD0\x85\xC0\x0F\x85", 6); // call rax; test eax, eax; jnz
+                exits.push_back(p - jit.mem);
+                jit_u32(p, 0);
+                jit_rm(p, 0x8B, RCX, R13, offsetof(nmod_t, norm));
+                break;
+            }
+        LOOP_ITER_END(PAGE, PAGEEND)
     CODE_PAGEITER_END()
+    // Epilogue: xor eax, eax; then restore the registers.
+    jit_bytes(p, "\x31\xC0", 2);
+    for (uint32_t exit : exits) {
+        int32_t rel = (p - jit.mem) - (exit + 4);
+        memcpy(jit.mem + exit, &rel, 4);
+    }
+    jit_bytes(p, "\x48\x83\xC4\x08\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B\xC3", 15);
+    jit.size = p - jit.mem;
+    assert(jit.size <= jit.memsize);
+    if (mprotect(jit.mem, jit.memsize, PROT_READ | PROT_EXEC) != 0) {
+        jit_free(jit);
+        return 3;
+    }
+    jit.fn = (JitFunction)(void*)jit.mem;
     return 0;
+#else
+    (void)tr;
+    return 4;
+#endif
 }
 
 API int
-tr_evaluate(const Trace &restrict tr, const ncoef_t *restrict input, ncoef_t *restrict output, ncoef_t *restrict data, nmod_t mod, void *pagebuf)
+jit_evaluate(const JitCode &jit, const ncoef_t *restrict input, const ncoef_t *restrict constants, ncoef_t *restrict data, nmod_t mod)
 {
-    Code fincode = tr.fincode;
-    if (pagebuf != NULL) fincode.buf = (uint8_t*)pagebuf;
-    int r1 = code_evaluate_lo(fincode, input, &tr.constants[0], data, mod);
-    if (unlikely(r1 != 0)) return r1;
-    Code code = tr.code;
-    if (pagebuf != NULL) code.buf = (uint8_t*)pagebuf;
-    int r2 = code_evaluate_hi(code, tr.nfinlocations, input, &tr.constants[0], data, mod);
-    if (unlikely(r2 != 0)) return r2;
-    for (size_t i = 0; i < tr.noutputs; i++) {
-        output[i] = data[tr.outputs[i]];
-    }
-    return 0;
+    if (mod.norm <= 0) return -1;
+    return jit.fn(input, constants, data, &mod);
 }
 
 API int
@@ -1222,6 +4063,8 @@ tr_evaluate_fmpq(const Trace &restrict tr, fmpq *restrict output, fmpq *restrict
     }
     fmpz_t one;
     fmpz_init_set_ui(one, 1);
+    fmpq_t acc;
+    fmpq_init(acc);
     CODE_PAGEITER_BEGIN(tr.fincode, 0)
     LOOP_ITER_BEGIN(PAGE, PAGEEND)
         switch(OP) {
@@ -1232,6 +4075,12 @@ tr_evaluate_fmpq(const Trace &restrict tr, fmpq *restrict output, fmpq *restrict
         case LOP_COPY: fmpq_set(data+A, data+B); break;
         case LOP_INV: if (unlikely(fmpq_is_zero(data+B))) return 2; fmpq_inv(data+A, data+B); break;
         case LOP_NEGINV: if (unlikely(fmpq_is_zero(data+B))) return 3; fmpq_inv(data+A, data+B); fmpq_neg(data+A, data+A); break;
+        case LOP_BATCHINV: if (unlikely(fmpq_is_zero(data+B))) return 6; fmpq_inv(data+A, data+B); break;
+        case LOP_ACC1: fmpq_add(acc, acc, data+A); break;
+        case LOP_ACC3: fmpq_add(acc, acc, data+A); fmpq_add(acc, acc, data+B); fmpq_add(acc, acc, data+C); break;
+        case LOP_NACC1: fmpq_sub(acc, acc, data+A); break;
+        case LOP_NACC3: fmpq_sub(acc, acc, data+A); fmpq_sub(acc, acc, data+B); fmpq_sub(acc, acc, data+C); break;
+        case LOP_ACCEND: fmpq_swap(data+A, acc); fmpq_zero(acc); break;
         case LOP_NEG: fmpq_neg(data+A, data+B); break;
         case LOP_SHOUP_PRECOMP: return 1;
         case LOP_POW: fmpq_pow_si(data+A, data+B, C); break;
@@ -1256,12 +4105,25 @@ tr_evaluate_fmpq(const Trace &restrict tr, fmpq *restrict output, fmpq *restrict
         case LOP_NOP: break;
         case LOP_SETMUL: fmpq_mul(data+A, data+A, data+B); break;
         case LOP_SETADDMUL: fmpq_addmul(data+A, data+B, data+C); break;
+        case LOP_ADD3: case LOP_SUBMUL: case LOP_DIFFMUL: case LOP_NEGMUL: {
+                fmpq_t t;
+                fmpq_init(t);
+                switch (OP) {
+                case LOP_ADD3: fmpq_add(t, data+B, data+C); fmpq_add(data+A, t, data+D); break;
+                case LOP_SUBMUL: fmpq_mul(t, data+C, data+D); fmpq_sub(data+A, data+B, t); break;
+                case LOP_DIFFMUL: fmpq_sub(t, data+B, data+C); fmpq_mul(data+A, t, data+D); break;
+                case LOP_NEGMUL: fmpq_mul(t, data+B, data+C); fmpq_neg(data+A, t); break;
+                }
+                fmpq_clear(t);
+            }
+            break;
         case LOP_HALT: goto halt;
         }
     LOOP_ITER_END(PAGE, PAGEEND)
     halt:;
     CODE_PAGEITER_END()
     fmpz_clear(one);
+    fmpq_clear(acc);
     for (size_t i = 0; i < tr.noutputs; i++) {
         fmpq_set(output + i, data + tr.outputs[i]);
     }
@@ -2368,15 +5230,18 @@ stracer_init(size_t varidx, int maxorder)
  */
 
 API Trace
-tr_to_series(Trace &tr, size_t varidx, int maxorder)
+tr_to_series(Trace &tr, size_t varidx, int maxorder, size_t hashcons_limit)
 {
     assert(code_size(tr.code) == 0);
     STracer otr = stracer_init(varidx, maxorder);
+    otr.tr.hashcons_limit = hashcons_limit;
     for (size_t i = 0; i < tr.ninputs; i++) {
         otr.input(tr.input_names[i].c_str());
     }
     std::vector<SValue> data;
     data.resize(tr.nfinlocations);
+    SValue acc = {};
+    bool accempty = true;
     CODE_PAGEITER_BEGIN(tr.fincode, 0)
     LOOP_ITER_BEGIN(PAGE, PAGEEND)
         switch(OP) {
@@ -2389,6 +5254,19 @@ tr_to_series(Trace &tr, size_t varidx, int maxorder)
         case HOP_NEGINV: data[A] = otr.neginv(data[B]); break;
         case HOP_NEG: data[A] = otr.neg(data[B]); break;
         case HOP_SHOUP_PRECOMP: data[A] = otr.shoup_precomp(data[B]); break;
+        case LOP_BATCHINV: data[A] = otr.inv(data[B]); break;
+        case LOP_ACC1: case LOP_ACC3: case LOP_NACC1: case LOP_NACC3: {
+                uint32_t terms[3] = {A, B, C};
+                int nterms = ((OP == LOP_ACC1) || (OP == LOP_NACC1)) ? 1 : 3;
+                bool neg = (OP == LOP_NACC1) || (OP == LOP_NACC3);
+                for (int i = 0; i < nterms; i++) {
+                    const SValue &x = data[terms[i]];
+                    acc = accempty ? (neg ? otr.neg(x) : x) : (neg ? otr.sub(acc, x) : otr.add(acc, x));
+                    accempty = false;
+                }
+            }
+            break;
+        case LOP_ACCEND: data[A] = accempty ? otr.of_int(0) : acc; accempty = true; break;
         case LOP_POW: data[A] = otr.pow(data[B], C); break;
         case LOP_ADD: data[A] = otr.add(data[B], data[C]); break;
         case LOP_SUB: data[A] = otr.sub(data[B], data[C]); break;
@@ -2400,6 +5278,10 @@ tr_to_series(Trace &tr, size_t varidx, int maxorder)
         case LOP_NOP: break;
         case LOP_SETMUL: data[A] = otr.mul(data[A], data[B]); break;
         case LOP_SETADDMUL: data[A] = otr.addmul(data[A], data[B], data[C]); break;
+        case LOP_ADD3: data[A] = otr.add(otr.add(data[B], data[C]), data[D]); break;
+        case LOP_SUBMUL: data[A] = otr.sub(data[B], otr.mul(data[C], data[D])); break;
+        case LOP_DIFFMUL: data[A] = otr.mul(otr.sub(data[B], data[C]), data[D]); break;
+        case LOP_NEGMUL: data[A] = otr.neg(otr.mul(data[B], data[C])); break;
         case LOP_HALT: goto halt;
         }
     LOOP_ITER_END(PAGE, PAGEEND)
@@ -53,9 +53,14 @@ Ss{COMMANDS}
         considerable compression. Please install the Ql{zstd}
         tool to use it.
 
-    Cm{save-trace} Ar{filename}
+    Cm{save-trace} [Fl{--compact}] Ar{filename}
         Save the current trace to a file.
 
+        If the Fl{--compact} flag is set, save the finalized
+        code in the compact form (see Cm{measure}), which is
+        typically half the size. Such files can only be read
+        by the versions of Nm{ratracer} that support it.
+
     Cm{show}
         Show a short summary of the current trace.
 
@@ -78,9 +83,30 @@ Ss{COMMANDS}
     Cm{disasm} [Fl{--to}=Ar{filename}]
         Print a disassembly of the current trace.
 
-    Cm{measure}
+    Cm{measure} [Fl{--jit}] [Fl{--montgomery}] [Fl{--compact}] [Fl{--hoist}] \
+            [Fl{--split}=Ar{n}] [Fl{--code-cache}=Ar{size}]
         Measure the evaluation speed of the current trace.
 
+        If the Fl{--jit} flag is set, compile the trace into
+        native code first; if Fl{--montgomery} is set, evaluate
+        it in the Montgomery form; with Fl{--split}, evaluate
+        each probe using Ar{n} threads (see Cm{reconstruct0});
+        with Fl{--code-cache}, keep that much of the code in
+        memory (see Cm{reconstruct}).
+
+        If the Fl{--compact} flag is set, keep the (finalized)
+        code in memory in the compact form, and evaluate it
+        from there. In this form each instruction is an opcode,
+        a layout byte, and the fields stored in 1 to 4 bytes
+        each, with the locations as the differences from the
+        destination; this is typically half the size of the
+        usual form, but somewhat slower to evaluate when both
+        fit into memory.
+
+        If the Fl{--hoist} flag is set, evaluate the part of the
+        code that does not depend on the inputs only once (see
+        Cm{reconstruct}), and measure the rest.
+
     Cm{set} Ar{name} Ar{expression}
         Set the given variable to the given expression in
         the further traces created by Cm{trace-expression},
@@ -90,17 +116,33 @@ Ss{COMMANDS}
         Remove the mapping specified by Cm{set}.
 
     Cm{configure-tracing} \
-            [Fl{--modulus}=Ar{n}] [Fl{--set} Ar{name} Ar{n}] ...
+            [Fl{--modulus}=Ar{n}] [Fl{--set} Ar{name} Ar{n}] \
+            [Fl{--hash-cons}=Ar{size}] ...
         Set the variable values and the modulus of the field used
         during trace recording. These values are then used to
         detect zero expressions during tracing. Changing tracing
         configuration only makes sense before the tracing has
         begun, and is normally not needed.
 
+        The Fl{--hash-cons} option makes the tracing look up each
+        new instruction among the ones already recorded, and reuse
+        the earlier result instead of recording a duplicate. The
+        table of the recorded instructions is limited to about
+        Ar{size} bytes of memory (e.g. Ql{64M}); once full, it
+        is cleared. This helps to keep the traces of Cm{solve-equations}
+        and Cm{to-series} small from the start, instead of relying
+        on Cm{optimize} later.
+
     Cm{trace-expression} Ar{filename}
         Load a rational expression from a file and trace its
         evaluation.
 
+    Cm{trace-expressions} [Fl{--threads}=Ar{n}] Ar{filelist}
+        Same as Cm{trace-expression} for each of the files listed
+        in Ar{filelist}, one per line, but trace the expressions
+        with Ar{n} threads in parallel (default: Ql{1}), each into
+        a separate trace, and then merge these together.
+
     Cm{keep-outputs} Ar{filename}
         Read a list of output name patterns from a file, one
         pattern per line; keep all the outputs that match any
@@ -115,16 +157,51 @@ Ss{COMMANDS}
         pattern per line; erase all outputs contained in the list.
         The pattern syntax is the same as in Cm{keep-outputs}.
 
-    Cm{optimize}
+    Cm{optimize} [Fl{--memory}=Ar{size}] [Fl{--accumulators}=Ar{n}]
         Optimize the current trace by propagating constants,
-        merging duplicate expressions, and erasing dead code.
-
-    Cm{finalize}
+        simplifying algebraic identities (such as Ql{-(-x)} or
+        Ql{x+(-y)}), merging duplicate expressions, and erasing
+        dead code and unused constants.
+
+        Duplicate expressions are found across the whole trace
+        using a hash table of at most Ar{size} bytes (default:
+        Ql{1G}). If the trace needs a bigger table, it is split
+        into parts by hash, and processed one part at a time;
+        this takes longer, and misses some duplicates.
+
+        Long chains of additions (or multiplications), where each
+        step needs the result of the previous one, are split
+        between Ar{n} accumulators (default: Ql{4}) that are
+        combined at the end, so that the steps can be evaluated
+        in parallel. Use Ql{1} to keep the chains as they are.
+
+    Cm{finalize} [Fl{--fuse}=Ar{kind},...] [Fl{--inv-batch}=Ar{n}] [Fl{--cache}=Ar{size}]
         Convert the (not yet finalized) code into a final low-level
         representation that is smaller, and has drastically
         lower memory usage. Automatically eliminate the dead
         code while finalizing.
 
+        Adjacent pairs of instructions where the first result
+        is only used by the second one are fused into single
+        superinstructions. The Fl{--fuse} option selects which
+        kinds of pairs to fuse: Ql{addmul} (a+b*c), Ql{submul}
+        (a-b*c), Ql{diffmul} ((a-b)*c), Ql{negmul} (-a*b),
+        Ql{add3} (a+b+c), Ql{sum} (sums and differences of 4 or
+        more terms, accumulated with a single modular reduction),
+        or Ql{all} (the default), or Ql{none}.
+
+        Groups of up to Ar{n} (default: 64) modular inversions
+        whose arguments are ready at the same point are computed
+        together, using one inversion and 3(Ar{n}-1)
+        multiplications. Set Fl{--inv-batch}=1 to disable this.
+
+        The data locations are laid out for a cache of Ar{size}
+        bytes (default: Ql{256K}): the operands of each instruction
+        are placed in the same cache lines where possible, and
+        the values that stay unused for too long to remain in
+        the cache are kept in separate lines. Set Fl{--cache}=0
+        to minimize the memory usage instead.
+
     Cm{unfinalize}
         The reverse of Cm{finalize} (i.e. convert low-level code
         into high-level code), except that the eliminated code
@@ -137,7 +214,8 @@ Ss{COMMANDS}
 
     Cm{reconstruct} \
             [Fl{--to}=Ar{filename}] [Fl{--multiply-by}=Ar{filename}] \
-            [Fl{--threads}=Ar{n}] [Fl{--inmem}] \
+            [Fl{--threads}=Ar{n}] [Fl{--inmem}] [Fl{--code-cache}=Ar{size}] \
+            [Fl{--jit}] [Fl{--montgomery}] [Fl{--compact}] [Fl{--hoist}] \
             [Fl{--factor-scan}] [Fl{--shift-scan}] [Fl{--bunches}=Ar{n}]
         Reconstruct the rational form of the current trace using
         the FireFly library.
@@ -154,6 +232,43 @@ Ss{COMMANDS}
         performance especially with many threads, but comes at
         the price of higher memory usage.
 
+        If the Fl{--code-cache} option is given, keep at most
+        Ar{size} bytes (e.g. Ql{512M} or Ql{40G}) of the code
+        in memory, shared between the threads, and read the rest
+        from the disk as usual. This is a middle ground between
+        the default and Fl{--inmem} for the traces that do not
+        quite fit into memory.
+
+        If the Fl{--jit} flag is set, compile the (finalized)
+        code into native x86-64 machine code, and evaluate that
+        instead of interpreting the code. The machine code is
+        kept in memory, and is typically several times larger
+        than the code itself.
+
+        If the Fl{--montgomery} flag is set, keep the values in
+        the Montgomery form during the evaluation, so that the
+        multiplications need no normalization; the inputs and
+        the outputs are converted once per probe. This can not
+        be combined with Fl{--jit}.
+
+        If the Fl{--compact} flag is set, keep the code in
+        memory in the compact form (see Cm{measure}), which
+        needs about half the memory of Fl{--inmem}, but is
+        slower to evaluate. This can not be combined with
+        Fl{--jit} or Fl{--montgomery}, and disables Fl{--bunches}
+        for the evaluation.
+
+        If the Fl{--hoist} flag is set, split the (finalized)
+        code into a prologue of the instructions that do not
+        depend on the inputs, which is evaluated by each thread
+        only when the prime changes, and the rest, which is
+        evaluated for each probe. This helps with the traces
+        that compute many rational constants, as those loaded
+        with Cm{load-equations} often do. Both parts are kept
+        in memory (as with Fl{--inmem}). This can not be
+        combined with Fl{--jit}, Fl{--montgomery}, or
+        Fl{--compact}.
+
         This command uses the FireFly library for the reconstruction.
         Flags Fl{--factor-scan} and Fl{--shift-scan} enable
         enable FireFly's factor scan and/or shift scan (which are
@@ -162,13 +277,33 @@ Ss{COMMANDS}
 
     Cm{reconstruct0} \
             [Fl{--to}=Ar{filename}] [Fl{--multiply-by}=Ar{filename}] \
-            [Fl{--threads}=Ar{n}]
+            [Fl{--threads}=Ar{n}] [Fl{--split}=Ar{m}] [Fl{--primes}=Ar{k}] \
+            [Fl{--jit}] [Fl{--montgomery}] [Fl{--compact}]
         Same as Cm{reconstruct}, but assumes that there are 0
         input variables needed, and is therefore faster.
 
         This command does not use the FireFly library. The code
         is always loaded into memory (as with the Fl{--inmem}
-        option of Cm{reconstruct}).
+        option of Cm{reconstruct}, or Fl{--compact} if given).
+        As more of the outputs are reconstructed, the code is cut
+        down to the instructions that the remaining outputs
+        depend on (except with Fl{--jit}, Fl{--split}, or
+        Fl{--compact}).
+
+        If the Fl{--split} option is given, split the code
+        between Ar{m} threads, so that each of the Ar{n} probes
+        running at the same time is evaluated by Ar{m} threads
+        of its own. This lowers the time per probe if there are
+        more cores than probes worth running, at the cost of
+        some synchronization between the threads, and of a
+        larger copy of the code and data in memory. This can not be
+        combined with Fl{--jit} or Fl{--montgomery}.
+
+        If the Fl{--primes} option is given, each thread evaluates
+        Ar{k} primes at once (Ar{k} must be 1, 2, 4, or 8), going
+        through the code once per Ar{k} primes instead of once per
+        prime. This can not be combined with Fl{--jit},
+        Fl{--montgomery}, Fl{--compact}, or Fl{--split}.
 
     Cm{evaluate}
         Evaluate the trace in terms of rational numbers.
@@ -268,6 +403,12 @@ Ss{ENVIRONMENT}
         have no names, so they will not be visible to Ql{ls},
         but they will take disk space.
 
+    Ev{RATRACER_MEMLIMIT}
+        If set to a size (e.g. Ql{4G}), keep the temporary files
+        in memory instead of in Ev{TMPDIR}, as long as their total
+        size stays under this limit; once it is exceeded, the
+        file that has grown past it is moved into Ev{TMPDIR}.
+
 Ss{AUTHORS}
     Vitaly Magerya <vitaly.magerya@tx97.net>
 )";
@@ -689,14 +830,23 @@ cmd_configure_tracing(int argc, char *argv[])
     int na = 0;
     std::unordered_map<std::string_view, const char*> variables;
     const char *modulus = NULL;
+    const char *hashcons = NULL;
     for (; na < argc; na++) {
         if (equalto(argv[na], "--set") && (na + 2 < argc)) {
             variables[argv[na + 1]] = argv[na + 2];
             na += 2;
         }
         else if (startswith(argv[na], "--modulus=")) { modulus = argv[na] + 10; }
+        else if (startswith(argv[na], "--hash-cons=")) { hashcons = argv[na] + 12; }
         else break;
     }
+    if (hashcons != NULL) {
+        size_t size = parse_bytes(hashcons);
+        char buf[16];
+        tr.hashcons_limit = size/HASHCONS_ENTRY_SIZE;
+        tr.hashcons_clear();
+        logd("Will hash-cons the instructions using up to %s (%zu entries)", fmt_bytes(buf, 16, size), tr.hashcons_limit);
+    }
     // Parse the new modulus.
     if (modulus != NULL) {
         char *end = NULL;
@@ -789,6 +939,76 @@ cmd_trace_expression(int argc, char *argv[])
     return 1;
 }
 
+static int
+cmd_trace_expressions(int argc, char *argv[])
+{
+    LOGBLOCK("trace-expressions");
+    int nthreads = 1;
+    int na = 0;
+    for (; na < argc; na++) {
+        if (startswith(argv[na], "--threads=")) { nthreads = atoi(argv[na] + 10); }
+        else break;
+    }
+    if (na >= argc) crash("ratracer: trace-expressions [--threads=n] filelist\n");
+    if (nthreads < 1) crash("trace-expressions: the number of threads must be positive\n");
+    std::vector<std::string> filenames;
+    {
+        OPEN_FILE_R(f, argv[na]);
+        char *line = NULL;
+        size_t linesize = 0;
+        for (;;) {
+            ssize_t len = getline(&line, &linesize, f);
+            while ((len > 0) && (isspace(line[len-1]))) line[--len] = 0;
+            if (len < 0) break;
+            if (len > 0) filenames.push_back(std::string(line, len));
+        }
+        if (line != NULL) free(line);
+        CLOSE_FILE(f);
+    }
+    std::vector<char*> texts;
+    for (auto &&filename : filenames) {
+        OPEN_FILE_R(f, filename.c_str());
+        texts.push_back(fgetall(f));
+        CLOSE_FILE(f);
+        char buf[16];
+        logd("Read %s from '%s'", fmt_bytes(buf, 16, strlen(texts.back())), filename.c_str());
+    }
+    // Each thread traces its share of the expressions into a
+    // shard of its own; the shards are then merged in order.
+    std::vector<Tracer> shards;
+    for (int i = 0; i < nthreads; i++) shards.push_back(tracer_init_shard(tr));
+    struct ShardValue { size_t shard; Value v; };
+    std::vector<ShardValue> values(filenames.size());
+    #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+    for (size_t i = 0; i < filenames.size(); i++) {
+        size_t t = omp_get_thread_num();
+        Parser p = {shards[t], texts[i], texts[i], {}};
+        values[i] = ShardValue{t, parse_complete_expr(p)};
+    }
+    TRACE_MOD_BEGIN()
+    std::vector<nloc_t> locshift(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        if (tr_merge(tr.t, shards[i].t, locshift[i]) != 0)
+            crash("trace-expressions: failed to merge the traces\n");
+    }
+    for (size_t i = 0; i < filenames.size(); i++) {
+        const ShardValue &sv = values[i];
+        tr.add_output(Value{sv.v.loc + locshift[sv.shard], sv.v.n}, filenames[i].c_str());
+    }
+    nt_clear(tr.var_names);
+    for (size_t i = 0; i < tr.t.ninputs; i++) {
+        nt_append(tr.var_names, tr.t.input_names[i].data(), tr.t.input_names[i].size());
+    }
+    TRACE_MOD_END()
+    for (auto &&shard : shards) {
+        shard.clear();
+        for (auto &&c : shard.t.constants) fmpz_clear(&c);
+        nt_clear(shard.var_names);
+    }
+    for (char *text : texts) free(text);
+    return na + 1;
+}
+
 static int
 regcomp_filelist(regex_t *pregex, FILE *f)
 {
@@ -928,27 +1148,205 @@ static int
 cmd_save_trace(int argc, char *argv[])
 {
     LOGBLOCK("save-trace");
-    if (argc < 1) crash("ratracer: save-trace filename\n");
-    if (tr_export(tr.t, argv[0]) != 0)
+    bool compact = (argc >= 1) && (strcmp(argv[0], "--compact") == 0);
+    if (compact) { argc--; argv++; }
+    if (argc < 1) crash("ratracer: save-trace [--compact] filename\n");
+    if ((compact ? tr_export_compact(tr.t, argv[0]) : tr_export(tr.t, argv[0])) != 0)
         crash("save-trace: failed to save '%s'\n", argv[0]);
     logd("Saved the trace into '%s'", argv[0]);
-    return 1;
+    return compact ? 2 : 1;
+}
+
+#define TR_EVAL_BEGIN(tr, codeptr, jit, inmem, usejit) \
+    jit = JitCode(); \
+    if (usejit) { \
+        int r = jit_compile(jit, tr); \
+        if (r == 0) { \
+            char buf[16]; \
+            logd("Compiled the code into %s of machine code", fmt_bytes(buf, 16, jit.size)); \
+        } else { \
+            logd("Failed to JIT-compile the code (error %d), will interpret it instead", r); \
+        } \
+    } \
+    if (inmem && (jit.fn == NULL)) { \
+        assert(code_size((tr).code) == 0); \
+        int r = ftruncate((tr).fincode.fd, (tr).fincode.filesize + CODE_PAGELUFT); \
+        if (unlikely(r != 0)) { \
+            crash("failed to ftruncate() the code file: %s", strerror(errno)); \
+        } \
+        codeptr = (uint8_t*)mmap(NULL, (tr).fincode.filesize + CODE_PAGELUFT, PROT_READ, MAP_PRIVATE, (tr).fincode.fd, 0); \
+        if (unlikely((codeptr) == NULL)) { \
+            crash("failed to mmap() the code file: %s", strerror(errno)); \
+        } \
+    } else { \
+        codeptr = NULL; \
+    }
+
+#define TR_EVAL(res, tr, input, output, data, mod, constants, codeptr, jit, buf) \
+    if (jit.fn != NULL) { \
+        res = jit_evaluate(jit, &(input)[0], &(constants)[0], &(data)[0], mod); \
+        for (size_t i = 0; i < (tr).noutputs; i++) { (output)[i] = (data)[(tr).outputs[i]]; } \
+    } else if (codeptr == NULL) { \
+        res = tr_evaluate(tr, input, output, data, &(constants)[0], mod, buf); \
+    } else { \
+        res = code_evaluate_lo_mem(codeptr, (tr).fincode.filesize, &(input)[0], &(constants)[0], &(data)[0], mod); \
+        for (size_t i = 0; i < (tr).noutputs; i++) { (output)[i] = (data)[(tr).outputs[i]]; } \
+    }
+
+// Same as TR_EVAL, but in the Montgomery form: the input
+// must already be converted with mont_to(), the constants
+// must come from mont_convert_constants(), and the output is
+// converted back into the normal form.
+#define TR_EVAL_MONT(res, tr, input, output, data, mont, constants, codeptr, buf) \
+    if (codeptr == NULL) { \
+        res = tr_evaluate_mont(tr, input, output, data, &(constants)[0], mont, buf); \
+    } else { \
+        res = code_evaluate_lo_mem_mont(codeptr, (tr).fincode.filesize, &(input)[0], &(constants)[0], &(data)[0], mont); \
+        for (size_t i = 0; i < (tr).noutputs; i++) { (output)[i] = mont_from((data)[(tr).outputs[i]], mont); } \
+    }
+
+#define TR_EVAL_END(tr, codeptr, jit) \
+    jit_free(jit); \
+    if (codeptr != NULL) { \
+        munmap(codeptr, (tr).fincode.filesize + CODE_PAGELUFT); \
+        int r = ftruncate((tr).fincode.fd, (tr).fincode.filesize); \
+        if (unlikely(r != 0)) { \
+            crash("failed to ftruncate() the code file: %s", strerror(errno)); \
+        } \
+    }
+
+// Keep the finalized code in memory in the compact form.
+static void
+load_compact_code(CompactCode &cc, const Trace &t)
+{
+    char buf1[16], buf2[16];
+    code_compact(cc, t.fincode);
+    logd("Compacted %s of the code into %s",
+            fmt_bytes(buf1, 16, t.fincode.filesize),
+            fmt_bytes(buf2, 16, cc.size));
+}
+
+// Split the finalized code into the per-prime prologue and
+// the per-probe body.
+static void
+load_hoisted_code(HoistedCode &hc, const Trace &t)
+{
+    char buf1[16], buf2[16], buf3[16];
+    int r = tr_hoist(hc, t);
+    if (r != 0) crash("failed to hoist the code (error %d)\n", r);
+    logd("Hoisted %s out of %s of the code into the prologue, leaving %s",
+            fmt_bytes(buf1, 16, hc.prologuesize),
+            fmt_bytes(buf2, 16, t.fincode.filesize),
+            fmt_bytes(buf3, 16, hc.bodysize));
+}
+
+// Keep up to the given number of bytes of the finalized code
+// in memory; free with code_cache_free().
+static void
+load_code_cache(Code &code, size_t budget)
+{
+    char buf1[16], buf2[16], buf3[16];
+    size_t size = code_cache_load(code, budget);
+    logd("Cached %s out of %s of the code, using %s of memory",
+            fmt_bytes(buf1, 16, code.cachesize),
+            fmt_bytes(buf2, 16, code.filesize),
+            fmt_bytes(buf3, 16, size));
+}
+
+// Split the finalized code between nthreads threads for
+// par_evaluate().
+static void
+par_split(ParCode &pc, const Trace &t, size_t nthreads)
+{
+    int r = tr_split(pc, t, nthreads);
+    if (r != 0) crash("failed to split the code between the threads (error %d)\n", r);
+    size_t nsegments = 0, nwaits = 0, codesize = 0;
+    for (auto &&tc : pc.threads) {
+        nsegments += tc.segments.size();
+        nwaits += tc.waits.size();
+        codesize += tc.code.size();
+    }
+    char buf1[16], buf2[16];
+    logd("Split the code between %zu threads: %zu segments, %zu waits, %s of code, %s of data",
+            pc.nthreads, nsegments, nwaits,
+            fmt_bytes(buf1, 16, codesize),
+            fmt_bytes(buf2, 16, pc.nlocations*sizeof(ncoef_t)));
+    logd("Expected speedup: %.3g", (double)pc.work/std::max(pc.span, (uint64_t)1));
+}
+
+// Evaluate a single probe with pc.nthreads threads at once.
+static int
+par_evaluate(const ParCode &pc, ParState &ps, const Trace &t, const ncoef_t *input, ncoef_t *output, ncoef_t *data, const ncoef_t *constants, nmod_t mod)
+{
+    par_reset(ps, pc.nthreads);
+    #pragma omp parallel num_threads(pc.nthreads)
+    {
+        // All the threads must run at the same time, or they
+        // will wait for each other forever.
+        if ((size_t)omp_get_num_threads() != pc.nthreads) {
+            ps.error.store(7);
+        } else {
+            par_evaluate_thread(pc, omp_get_thread_num(), ps, input, constants, data, mod);
+        }
+    }
+    int r = ps.error.load();
+    if (r != 0) return r;
+    for (size_t i = 0; i < t.noutputs; i++) {
+        output[i] = data[pc.outputs[i]];
+    }
+    return 0;
 }
 
 int
 cmd_measure(int argc, char *argv[])
 {
     LOGBLOCK("measure");
-    (void)argc; (void)argv;
+    int usejit = 0, usemont = 0, usecompact = 0, usehoist = 0, nsplit = 1;
+    size_t codecache = 0;
+    int na = 0;
+    for (; na < argc; na++) {
+        if (strcmp(argv[na], "--jit") == 0) { usejit = 1; }
+        else if (strcmp(argv[na], "--montgomery") == 0) { usemont = 1; }
+        else if (startswith(argv[na], "--split=")) { nsplit = atoi(argv[na] + 8); }
+        else if (startswith(argv[na], "--code-cache=")) { codecache = parse_bytes(argv[na] + 13); }
+        else if (strcmp(argv[na], "--compact") == 0) { usecompact = 1; }
+        else if (strcmp(argv[na], "--hoist") == 0) { usehoist = 1; }
+        else break;
+    }
+    if (usejit && usemont) crash("measure: --jit and --montgomery can not be used together\n");
+    if ((nsplit > 1) && (usejit || usemont)) crash("measure: --split can not be used with --jit or --montgomery\n");
+    if (usecompact && (usejit || usemont || (nsplit > 1))) crash("measure: --compact can not be used with --jit, --montgomery, or --split\n");
+    if (usehoist && (usejit || usemont || usecompact || (nsplit > 1))) crash("measure: --hoist can not be used with --jit, --montgomery, --compact, or --split\n");
     tr_flush(tr.t);
+    if ((usejit || usemont || usecompact || usehoist || (nsplit > 1)) && (code_size(tr.t.code) != 0)) {
+        logd("The --jit, --montgomery, --compact, --hoist, and --split options need the trace to be finalized; lets do it now");
+        cmd_finalize(0, NULL);
+    }
+    CompactCode cc;
+    if (usecompact) load_compact_code(cc, tr.t);
+    HoistedCode hc;
+    if (usehoist) load_hoisted_code(hc, tr.t);
+    uint8_t *code = NULL;
+    JitCode jit;
+    TR_EVAL_BEGIN(tr.t, code, jit, false, usejit)
+    if ((codecache > 0) && (jit.fn == NULL) && !usecompact && !usehoist) load_code_cache(tr.t.fincode, codecache);
+    ParCode pc;
+    ParState ps;
+    if (nsplit > 1) par_split(pc, tr.t, nsplit);
     std::vector<ncoef_t> inputs;
     std::vector<ncoef_t> outputs;
     std::vector<ncoef_t> data;
     inputs.resize(tr.t.ninputs);
     outputs.resize(tr.t.noutputs);
-    data.resize(tr.t.nextloc);
+    data.resize((nsplit > 1) ? pc.nlocations : usehoist ? hc.nlocations : tr.t.nextloc);
     nmod_t mod;
     nmod_init(&mod, 0x7FFFFFFFFFFFFFE7ull); // 2^63-25
+    std::vector<ncoef_t> constants;
+    tr_reduce_constants(constants, tr.t, mod);
+    if (usehoist) {
+        int r = hoisted_evaluate_prologue(hc, &constants[0], &data[0], mod);
+        if (r != 0) crash("measure: evaluation failed with code %d: %s\n", r, code_strerror(r));
+    }
     logd("Raw read time: %.4gs + %.4gs", code_readtime(tr.t.fincode), code_readtime(tr.t.code));
     logd("Prime: 0x%016zx", mod.n);
     for (size_t i = 0; i < inputs.size(); i++) {
@@ -958,11 +1356,33 @@ cmd_measure(int argc, char *argv[])
     for (size_t i = 0; (i < inputs.size()) && (i < 10); i++) {
         logd("%zu) 0x%016zx", i, inputs[i]);
     }
+    MontMod mont;
+    std::vector<ncoef_t> montinputs;
+    std::vector<ncoef_t> montconstants;
+    if (usemont) {
+        mont_init(mont, mod);
+        mont_convert_constants(montconstants, tr.t, mont);
+        montinputs.resize(inputs.size());
+    }
     long n = 0;
     double t1 = timestamp(), t2;
     for (long k = 1; k < 1000000000; k *= 2) {
         for (int i = 0; i < k; i++) {
-            int r = tr_evaluate(tr.t, &inputs[0], &outputs[0], &data[0], mod, NULL);
+            int r;
+            if (usemont) {
+                for (size_t j = 0; j < inputs.size(); j++) {
+                    montinputs[j] = mont_to(inputs[j], mont);
+                }
+                TR_EVAL_MONT(r, tr.t, &montinputs[0], &outputs[0], &data[0], mont, montconstants, code, NULL);
+            } else if (nsplit > 1) {
+                r = par_evaluate(pc, ps, tr.t, &inputs[0], &outputs[0], &data[0], &constants[0], mod);
+            } else if (usecompact) {
+                r = tr_evaluate_compact(tr.t, cc, &inputs[0], &outputs[0], &data[0], &constants[0], mod);
+            } else if (usehoist) {
+                r = tr_evaluate_hoisted(hc, &inputs[0], &outputs[0], &data[0], &constants[0], mod);
+            } else {
+                TR_EVAL(r, tr.t, &inputs[0], &outputs[0], &data[0], mod, constants, code, jit, NULL);
+            }
             if (r != 0) crash("measure: evaluation failed with code %d: %s\n", r, code_strerror(r));
         }
         n += k;
@@ -975,7 +1395,9 @@ cmd_measure(int argc, char *argv[])
     }
     logd("Average time: %.4gs after %ld evals", (t2-t1)/n, n);
     logd("Raw read time: %.4gs + %.4gs", code_readtime(tr.t.fincode), code_readtime(tr.t.code));
-    return 0;
+    code_cache_free(tr.t.fincode);
+    TR_EVAL_END(tr.t, code, jit)
+    return na;
 }
 
 int
@@ -1000,7 +1422,9 @@ cmd_check(int argc, char *argv[])
         logd("- input[%zu]  = 0x%016zx", i, inputs[i]);
     }
     if (inputs.size() > 10) logd("- ...");
-    int r = tr_evaluate(tr.t, &inputs[0], &outputs[0], &data[0], mod, NULL);
+    std::vector<ncoef_t> constants;
+    tr_reduce_constants(constants, tr.t, mod);
+    int r = tr_evaluate(tr.t, &inputs[0], &outputs[0], &data[0], &constants[0], mod, NULL);
     if (r != 0) crash("check: evaluation failed with code %d: %s\n", r, code_strerror(r));
     for (size_t i = 0; (i < data.size()) && (i < 10); i++) {
         logd("- data[%zu]   = 0x%016zx", i, data[i]);
@@ -1026,7 +1450,17 @@ static int
 cmd_optimize(int argc, char *argv[])
 {
     LOGBLOCK("optimize");
-    (void)argc; (void)argv;
+    size_t maxmem = DEDUP_MEMORY;
+    size_t nacc = REBALANCE_NACC;
+    int na = 0;
+    for (; na < argc; na++) {
+        if (startswith(argv[na], "--memory=")) { maxmem = parse_bytes(argv[na] + 9); }
+        else if (startswith(argv[na], "--accumulators=")) { nacc = atol(argv[na] + 15); }
+        else break;
+    }
+    if ((nacc < 1) || (nacc > REBALANCE_MAXACC)) {
+        crash("optimize: the number of accumulators must be between 1 and %d\n", REBALANCE_MAXACC);
+    }
     char buf1[16], buf2[16], buf3[16], buf4[16];
     logd("Starting with %s+%s instructions and the memory requirement of %s+%s",
             fmt_bytes(buf1, 16, code_size(tr.t.fincode)),
@@ -1037,17 +1471,73 @@ cmd_optimize(int argc, char *argv[])
     std::vector<Value> roots;
     for (auto &&kv : the_varmap) roots.push_back(kv.second);
     { size_t n = tr_opt_erase_dead_code(tr.t, roots.size(), &roots[0]); logd("Erased %zu dead instruction", n); }
-    { size_t n = tr_opt_propagate_constants(tr.t); logd("Propagated %zu constants", n); }
-    { size_t n = tr_opt_deduplicate(tr.t); logd("Identified %zu duplicated instructions", n); }
+    std::vector<Value*> rootptrs;
+    for (auto &&kv : the_varmap) rootptrs.push_back(&kv.second);
+    { size_t n = tr_opt_propagate_constants(tr.t, rootptrs.size(), rootptrs.data()); logd("Propagated %zu constants", n); }
+    {
+        size_t nhits[SIMP_NRULES];
+        size_t n = tr_opt_simplify(tr.t, rootptrs.size(), rootptrs.data(), nhits);
+        logd("Simplified %zu instructions", n);
+        for (size_t i = 0; i < SIMP_NRULES; i++) {
+            if (nhits[i] != 0) logd("- %s: %zu", simp_rules[i].name, nhits[i]);
+        }
+    }
+    { size_t n = tr_opt_deduplicate(tr.t, maxmem); logd("Identified %zu duplicated instructions", n); }
+    roots.clear();
+    for (auto &&kv : the_varmap) roots.push_back(kv.second);
     { size_t n = tr_opt_erase_dead_code(tr.t, roots.size(), &roots[0]); logd("Erased %zu dead instruction", n); }
-    return 0;
+    { size_t n = tr_opt_compact_constants(tr.t); logd("Dropped %zu unused constants", n); }
+    { size_t n = tr_opt_rebalance(tr.t, rootptrs.size(), rootptrs.data(), nacc); logd("Rebalanced %zu sum and product chains", n); }
+    tr.var_cache.clear();
+    tr.const_cache.clear();
+    tr.hashcons_clear();
+    return na;
+}
+
+static unsigned
+parse_fusion_kinds(const char *text)
+{
+    static const struct { const char *name; unsigned kind; } kinds[] = {
+        {"none", 0},
+        {"all", FUSE_ALL},
+        {"addmul", FUSE_ADDMUL},
+        {"submul", FUSE_SUBMUL},
+        {"diffmul", FUSE_DIFFMUL},
+        {"negmul", FUSE_NEGMUL},
+        {"add3", FUSE_ADD3},
+        {"sum", FUSE_SUM}
+    };
+    unsigned fusion = 0;
+    for (const char *p = text; *p != 0;) {
+        const char *end = strchr(p, ',');
+        if (end == NULL) end = p + strlen(p);
+        size_t i = 0;
+        for (; i < countof(kinds); i++) {
+            if ((strlen(kinds[i].name) == (size_t)(end - p)) && (strncmp(kinds[i].name, p, end - p) == 0)) {
+                fusion |= kinds[i].kind;
+                break;
+            }
+        }
+        if (i == countof(kinds)) crash("finalize: unknown fusion kind: %.*s\n", (int)(end - p), p);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return fusion;
 }
 
 static int
 cmd_finalize(int argc, char *argv[])
 {
     LOGBLOCK("finalize");
-    (void)argc; (void)argv;
+    unsigned fusion = FUSE_ALL;
+    size_t maxinvbatch = 64;
+    size_t cachebudget = 256*1024;
+    int na = 0;
+    for (; na < argc; na++) {
+        if (startswith(argv[na], "--fuse=")) { fusion = parse_fusion_kinds(argv[na] + 7); }
+        else if (startswith(argv[na], "--inv-batch=")) { maxinvbatch = atol(argv[na] + 12); }
+        else if (startswith(argv[na], "--cache=")) { cachebudget = parse_bytes(argv[na] + 8); }
+        else break;
+    }
     char buf1[16], buf2[16], buf3[16], buf4[16];
     logd("Starting with %s+%s instructions and the memory requirement of %s+%s",
             fmt_bytes(buf1, 16, code_size(tr.t.fincode)),
@@ -1056,15 +1546,22 @@ cmd_finalize(int argc, char *argv[])
             fmt_bytes(buf4, 16, code_size(tr.t.code)/sizeof(HiOp)*sizeof(ncoef_t)));
     std::vector<Value*> roots;
     for (auto &&kv : the_varmap) roots.push_back(&kv.second);
-    tr_finalize(tr.t, roots.size(), &roots[0]);
+    if (tr.hashcons_limit != 0) {
+        logd("Hash-consing has reused %zu instructions so far", tr.hashcons_hits);
+    }
+    FinalizeStats stats = tr_finalize(tr.t, roots.size(), &roots[0], fusion, maxinvbatch, cachebudget);
     tr.var_cache.clear();
     tr.const_cache.clear();
+    tr.hashcons_clear();
+    logd("Fused %zu instruction pairs", stats.nfused);
+    logd("Turned %zu sums of %zu terms into accumulations", stats.nsums, stats.nsumterms);
+    logd("Batched %zu inversions into %zu groups", stats.ninvbatched, stats.ninvbatches);
     logd("Ended with %s+%s instructions and the memory requirement of %s+%s",
             fmt_bytes(buf1, 16, code_size(tr.t.fincode)),
             fmt_bytes(buf2, 16, code_size(tr.t.code)),
             fmt_bytes(buf3, 16, tr.t.nfinlocations*sizeof(ncoef_t)),
             fmt_bytes(buf4, 16, code_size(tr.t.code)/sizeof(HiOp)*sizeof(ncoef_t)));
-    return 0;
+    return na;
 }
 
 static int
@@ -1087,6 +1584,7 @@ cmd_unfinalize(int argc, char *argv[])
     tr_unfinalize(tr.t, roots.size(), &roots[0]);
     tr.var_cache.clear();
     tr.const_cache.clear();
+    tr.hashcons_clear();
     logd("Ended with %s+%s instructions and the memory requirement of %s+%s",
             fmt_bytes(buf1, 16, code_size(tr.t.fincode)),
             fmt_bytes(buf2, 16, code_size(tr.t.code)),
@@ -1097,38 +1595,6 @@ cmd_unfinalize(int argc, char *argv[])
 
 #include <firefly/Reconstructor.hpp>
 
-#define TR_EVAL_BEGIN(tr, codeptr, inmem) \
-    if (inmem) { \
-        assert(code_size((tr).code) == 0); \
-        int r = ftruncate((tr).fincode.fd, (tr).fincode.filesize + CODE_PAGELUFT); \
-        if (unlikely(r != 0)) { \
-            crash("failed to ftruncate() the code file: %s", strerror(errno)); \
-        } \
-        codeptr = (uint8_t*)mmap(NULL, (tr).fincode.filesize + CODE_PAGELUFT, PROT_READ, MAP_PRIVATE, (tr).fincode.fd, 0); \
-        if (unlikely((codeptr) == NULL)) { \
-            crash("failed to mmap() the code file: %s", strerror(errno)); \
-        } \
-    } else { \
-        codeptr = NULL; \
-    }
-
-#define TR_EVAL(res, tr, input, output, data, mod, codeptr, buf) \
-    if (codeptr == NULL) { \
-        res = tr_evaluate(tr, input, output, data, mod, buf); \
-    } else { \
-        res = code_evaluate_lo_mem(codeptr, (tr).fincode.filesize, &(input)[0], &(tr).constants[0], &(data)[0], mod); \
-        for (size_t i = 0; i < (tr).noutputs; i++) { (output)[i] = (data)[(tr).outputs[i]]; } \
-    }
-
-#define TR_EVAL_END(tr, codeptr) \
-    if (codeptr != NULL) { \
-        munmap(codeptr, (tr).fincode.filesize + CODE_PAGELUFT); \
-        int r = ftruncate((tr).fincode.fd, (tr).fincode.filesize); \
-        if (unlikely(r != 0)) { \
-            crash("failed to ftruncate() the code file: %s", strerror(errno)); \
-        } \
-    }
-
 namespace firefly {
     class TraceBB : public BlackBoxBase<TraceBB> {
         const Trace &tr;
@@ -1137,23 +1603,47 @@ namespace firefly {
         std::vector<uint8_t*> bufs;
         nmod_t mod;
         uint8_t *code;
+        JitCode jit;
+        // The constants are reduced (or, with the Montgomery
+        // backend, converted) once per prime in prime_changed(),
+        // and shared between the threads.
+        std::vector<ncoef_t> constants;
+        bool usemont;
+        MontMod mont;
+        // With the compact code (if not NULL) the finalized
+        // code is evaluated from there, one probe at a time.
+        const CompactCode *cc;
+        // With the hoisted code (if not NULL) each thread
+        // evaluates the prologue into its data when the prime
+        // (or the number of lanes) changes; hoistprime[i] and
+        // hoistlanes[i] are what datas[i] currently holds.
+        const HoistedCode *hc;
+        std::vector<ncoef_t> hoistprime;
+        std::vector<int> hoistlanes;
+        // Bunches of up to this many probes are evaluated
+        // lane-interleaved, with datas[i] holding nlanes
+        // values per location; others go one probe at a time.
+        int nlanes;
     public:
-        TraceBB(const Trace &tr, const int *inputmap, size_t nthreads, bool inmem)
-        : tr(tr), inputmap(inputmap)
+        TraceBB(const Trace &tr, const int *inputmap, size_t nthreads, bool inmem, int nlanes, bool usejit, bool usemont, const CompactCode *cc, const HoistedCode *hc)
+        : tr(tr), inputmap(inputmap), usemont(usemont), cc(cc), hc(hc), nlanes((code_size(tr.code) == 0) && !usemont && (cc == NULL) ? nlanes : 1)
         {
             datas.resize(nthreads);
             bufs.resize(nthreads);
+            hoistprime.resize(nthreads, 0);
+            hoistlanes.resize(nthreads, 0);
+            size_t nlocations = (hc != NULL) ? std::max((size_t)tr.nextloc, (size_t)hc->nlocations) : tr.nextloc;
             for (size_t i = 0; i < nthreads; i++) {
                 datas[i] = (ncoef_t*)safe_memalign(sizeof(ncoef_t),
-                        (tr.ninputs + tr.nextloc)*sizeof(ncoef_t));
+                        this->nlanes*(tr.ninputs + nlocations)*sizeof(ncoef_t));
                 bufs[i] = (uint8_t*)safe_memalign(CODE_BUFALIGN,
                         CODE_PAGESIZE + CODE_PAGELUFT);
             }
-            TR_EVAL_BEGIN(this->tr, this->code, inmem)
+            TR_EVAL_BEGIN(this->tr, this->code, this->jit, inmem, usejit)
         }
         ~TraceBB()
         {
-            TR_EVAL_END(this->tr, this->code)
+            TR_EVAL_END(this->tr, this->code, this->jit)
             for (size_t i = 0; i < datas.size(); i++) free(datas[i]);
             for (size_t i = 0; i < bufs.size(); i++) free(bufs[i]);
         }
@@ -1161,19 +1651,57 @@ namespace firefly {
             this->mod.n = FFInt::p;
             this->mod.ninv = FFInt::p_inv;
             this->mod.norm = flint_clz(this->mod.n);
+            if (this->usemont) {
+                if (mont_init(this->mont, this->mod) != 0) {
+                    crash("reconstruct: the Montgomery form needs an odd prime, not %zu\n", this->mod.n);
+                }
+                mont_convert_constants(this->constants, this->tr, this->mont);
+            } else {
+                tr_reduce_constants(this->constants, this->tr, this->mod);
+            }
+        }
+        // Evaluate the prologue into the data of the given
+        // thread, unless it is already there.
+        template <int N> int
+        prepare_hoisted(uint32_t threadidx, ncoef_t *data) {
+            if ((this->hoistprime[threadidx] == this->mod.n) && (this->hoistlanes[threadidx] == N)) return 0;
+            int r;
+            if constexpr (N == 1) {
+                r = hoisted_evaluate_prologue(*this->hc, &this->constants[0], &data[tr.ninputs], this->mod);
+            } else {
+                r = code_evaluate_lo_mem_lanes<N>(&this->hc->prologue[0], this->hc->prologuesize, &data[0], &this->constants[0], &data[tr.ninputs*N], this->mod);
+            }
+            if (unlikely(r != 0)) return r;
+            this->hoistprime[threadidx] = this->mod.n;
+            this->hoistlanes[threadidx] = N;
+            return 0;
         }
         std::vector<FFInt>
         operator()(const std::vector<FFInt> &ffinputs, uint32_t threadidx) {
             assert(threadidx <= this->datas.size());
             auto data = this->datas[threadidx];
             auto buf = this->bufs[threadidx];
-            for (size_t i = 0; i < ffinputs.size(); i++) {
-                static_assert(sizeof(FFInt) == sizeof(ncoef_t));
-                data[this->inputmap[i]] = *(ncoef_t*)&ffinputs[i];
-            }
             std::vector<FFInt> outputs(tr.noutputs, 0);
             int r;
-            TR_EVAL(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mod, this->code, buf);
+            if (this->usemont) {
+                for (size_t i = 0; i < ffinputs.size(); i++) {
+                    data[this->inputmap[i]] = mont_to(*(ncoef_t*)&ffinputs[i], this->mont);
+                }
+                TR_EVAL_MONT(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mont, this->constants, this->code, buf);
+            } else {
+                for (size_t i = 0; i < ffinputs.size(); i++) {
+                    static_assert(sizeof(FFInt) == sizeof(ncoef_t));
+                    data[this->inputmap[i]] = *(ncoef_t*)&ffinputs[i];
+                }
+                if (this->cc != NULL) {
+                    r = tr_evaluate_compact(this->tr, *this->cc, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], &this->constants[0], this->mod);
+                } else if (this->hc != NULL) {
+                    r = this->prepare_hoisted<1>(threadidx, data);
+                    if (r == 0) r = tr_evaluate_hoisted(*this->hc, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], &this->constants[0], this->mod);
+                } else {
+                    TR_EVAL(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mod, this->constants, this->code, this->jit, buf);
+                }
+            }
             if (unlikely(r != 0)) crash("reconstruct: evaluation failed with code %d: %s\n", r, code_strerror(r));
             return outputs;
         }
@@ -1182,15 +1710,55 @@ namespace firefly {
             assert(threadidx <= this->datas.size());
             auto data = this->datas[threadidx];
             auto buf = this->bufs[threadidx];
-            std::vector<FFInt> outputs(tr.noutputs, 0);
             std::vector<FFIntVec<N>> vecoutputs(tr.noutputs);
-            for (int idx = 0; idx < N; idx++) {
+            if ((N <= this->nlanes) && (this->jit.fn == NULL)) {
                 for (size_t i = 0; i < ffinputs.size(); i++) {
-                    static_assert(sizeof(FFInt) == sizeof(ncoef_t));
-                    data[this->inputmap[i]] = *(ncoef_t*)&ffinputs[i].vec[idx];
+                    for (int idx = 0; idx < N; idx++) {
+                        data[this->inputmap[i]*N + idx] = *(ncoef_t*)&ffinputs[i].vec[idx];
+                    }
                 }
                 int r;
-                TR_EVAL(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mod, this->code, buf);
+                if (this->hc != NULL) {
+                    r = this->prepare_hoisted<N>(threadidx, data);
+                    if (r == 0) r = code_evaluate_lo_mem_lanes<N>(&this->hc->body[0], this->hc->bodysize, &data[0], &this->constants[0], &data[tr.ninputs*N], this->mod);
+                } else if (this->code != NULL) {
+                    r = code_evaluate_lo_mem_lanes<N>(this->code, tr.fincode.filesize, &data[0], &this->constants[0], &data[tr.ninputs*N], this->mod);
+                } else {
+                    Code fincode = tr.fincode;
+                    fincode.buf = buf;
+                    r = code_evaluate_lo_lanes<N>(fincode, &data[0], &this->constants[0], &data[tr.ninputs*N], this->mod);
+                }
+                if (unlikely(r != 0)) crash("reconstruct: evaluation failed with code %d: %s\n", r, code_strerror(r));
+                const nloc_t *outlocs = (this->hc != NULL) ? &this->hc->outputs[0] : &tr.outputs[0];
+                for (size_t i = 0; i < tr.noutputs; i++) {
+                    for (int idx = 0; idx < N; idx++) {
+                        vecoutputs[i].vec[idx] = data[(tr.ninputs + outlocs[i])*N + idx];
+                    }
+                }
+                return vecoutputs;
+            }
+            std::vector<FFInt> outputs(tr.noutputs, 0);
+            for (int idx = 0; idx < N; idx++) {
+                int r;
+                if (this->usemont) {
+                    for (size_t i = 0; i < ffinputs.size(); i++) {
+                        data[this->inputmap[i]] = mont_to(*(ncoef_t*)&ffinputs[i].vec[idx], this->mont);
+                    }
+                    TR_EVAL_MONT(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mont, this->constants, this->code, buf);
+                } else {
+                    for (size_t i = 0; i < ffinputs.size(); i++) {
+                        static_assert(sizeof(FFInt) == sizeof(ncoef_t));
+                        data[this->inputmap[i]] = *(ncoef_t*)&ffinputs[i].vec[idx];
+                    }
+                    if (this->cc != NULL) {
+                        r = tr_evaluate_compact(this->tr, *this->cc, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], &this->constants[0], this->mod);
+                    } else if (this->hc != NULL) {
+                        r = this->prepare_hoisted<1>(threadidx, data);
+                        if (r == 0) r = tr_evaluate_hoisted(*this->hc, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], &this->constants[0], this->mod);
+                    } else {
+                        TR_EVAL(r, this->tr, &data[0], (ncoef_t*)&outputs[0], &data[tr.ninputs], this->mod, this->constants, this->code, this->jit, buf);
+                    }
+                }
                 if (unlikely(r != 0)) crash("reconstruct: evaluation failed with code %d: %s\n", r, code_strerror(r));
                 for (size_t i = 0; i < tr.noutputs; i++) {
                     vecoutputs[i].vec[idx] = outputs[i];
@@ -1230,21 +1798,15 @@ load_factor_file(const char *text)
 static void
 parse_factor_file(Parser &p, std::unordered_map<size_t, Value> &invfactors, Tracer &tr)
 {
+    NameIndex outputs = name_index(tr.t.output_names);
     for (;;) {
         skip_whitespace(p);
         if (*p.ptr == 0) break;
         const char *name_start = p.ptr;
         skip_nonwhitespace(p);
         const char *name_end = p.ptr;
-        ssize_t idx = -1;
-        for (size_t i = 0; i < tr.t.noutputs; i++) {
-            if (tr.t.output_names[i].size() == name_end - name_start) {
-                if (memcmp(tr.t.output_names[i].data(), name_start, name_end - name_start) == 0) {
-                    idx = i;
-                    break;
-                }
-            }
-        }
+        auto it = outputs.find(std::string(name_start, name_end - name_start));
+        ssize_t idx = ((it != outputs.end()) && (it->second < tr.t.noutputs)) ? (ssize_t)it->second : -1;
         skip_whitespace_expect(p, '=');
         if (idx >= 0) {
             invfactors[idx] = parse_term_inverted(p);
@@ -1282,9 +1844,10 @@ static int
 cmd_reconstruct(int argc, char *argv[])
 {
     LOGBLOCK("reconstruct");
-    int nthreads = 1, nbunches = 4, factor_scan = 0, shift_scan = 0, inmem = 0;
+    int nthreads = 1, nbunches = 4, factor_scan = 0, shift_scan = 0, inmem = 0, usejit = 0, usemont = 0, usecompact = 0, usehoist = 0;
     const char *filename = NULL;
     const char *factorfile = NULL;
+    size_t codecache = 0;
     int na = 0;
     for (; na < argc; na++) {
         if (startswith(argv[na], "--threads=")) { nthreads = atoi(argv[na] + 10); }
@@ -1294,8 +1857,18 @@ cmd_reconstruct(int argc, char *argv[])
         else if (strcmp(argv[na], "--factor-scan") == 0) { factor_scan = 1; }
         else if (strcmp(argv[na], "--shift-scan") == 0) { shift_scan = 1; }
         else if (strcmp(argv[na], "--inmem") == 0) { inmem = 1; }
+        else if (startswith(argv[na], "--code-cache=")) { codecache = parse_bytes(argv[na] + 13); }
+        else if (strcmp(argv[na], "--jit") == 0) { usejit = 1; }
+        else if (strcmp(argv[na], "--montgomery") == 0) { usemont = 1; }
+        else if (strcmp(argv[na], "--compact") == 0) { usecompact = 1; }
+        else if (strcmp(argv[na], "--hoist") == 0) { usehoist = 1; }
         else break;
     }
+    if (usejit && usemont) crash("reconstruct: --jit and --montgomery can not be used together\n");
+    if (usecompact && (usejit || usemont)) crash("reconstruct: --compact can not be used with --jit or --montgomery\n");
+    if (usehoist && (usejit || usemont || usecompact)) crash("reconstruct: --hoist can not be used with --jit, --montgomery, or --compact\n");
+    if (usecompact || usehoist) inmem = 0;
+    if (inmem || usejit || usecompact || usehoist) codecache = 0;
     std::unordered_map<std::string, std::string> factors;
     if (factorfile) {
         logd("Loading factors from '%s'", factorfile);
@@ -1306,14 +1879,18 @@ cmd_reconstruct(int argc, char *argv[])
         free(text);
     }
     tr_flush(tr.t);
-    if (inmem && (code_size(tr.t.code) != 0)) {
-        logd("The --inmem options need the trace to be finalized; lets do it now");
+    if ((inmem || usejit || usemont || usecompact || usehoist || (codecache > 0)) && (code_size(tr.t.code) != 0)) {
+        logd("The --inmem, --code-cache, --jit, --montgomery, --compact, and --hoist options need the trace to be finalized; lets do it now");
         cmd_finalize(0, NULL);
     }
+    HoistedCode hc;
+    if (usehoist) load_hoisted_code(hc, tr.t);
     char buf1[16], buf2[16];
+    size_t nlanes = (code_size(tr.t.code) == 0) && !usemont && !usecompact ? nbunches : 1;
+    size_t nlocations = usehoist ? std::max((size_t)tr.t.nextloc, (size_t)hc.nlocations) : tr.t.nextloc;
     logd("Will use %d*%s=%s for the probe data", nthreads,
-            fmt_bytes(buf1, 16, tr.t.nextloc*sizeof(ncoef_t)),
-            fmt_bytes(buf2, 16, nthreads*tr.t.nextloc*sizeof(ncoef_t)));
+            fmt_bytes(buf1, 16, nlanes*nlocations*sizeof(ncoef_t)),
+            fmt_bytes(buf2, 16, nthreads*nlanes*nlocations*sizeof(ncoef_t)));
     if (inmem) {
         logd("Will also use %s for the code", fmt_bytes(buf1, 16, code_size(tr.t.fincode)));
     }
@@ -1331,13 +1908,17 @@ cmd_reconstruct(int argc, char *argv[])
     for (auto &&name : usedvarnames) {
         logd("- %s", name.c_str());
     }
-    firefly::TraceBB ffbb(tr.t, &usedvarmap[0], nthreads, inmem);
+    if (codecache > 0) load_code_cache(tr.t.fincode, codecache);
+    CompactCode cc;
+    if (usecompact) load_compact_code(cc, tr.t);
+    firefly::TraceBB ffbb(tr.t, &usedvarmap[0], nthreads, inmem, nbunches, usejit, usemont, usecompact ? &cc : NULL, usehoist ? &hc : NULL);
     firefly::Reconstructor<firefly::TraceBB> re(
             nusedinputs, nthreads, nbunches, ffbb, firefly::Reconstructor<firefly::TraceBB>::IMPORTANT);
     if (factor_scan) re.enable_factor_scan();
     if (shift_scan) re.enable_shift_scan();
     re.reconstruct();
     std::vector<firefly::RationalFunction> results = re.get_result();
+    code_cache_free(tr.t.fincode);
     OPEN_FILE_W(f, filename);
     for (size_t i = 0; i < results.size(); i++) {
         std::string fn = results[i].to_string(usedvarnames);
@@ -1438,7 +2019,9 @@ cmd_evaluate_modular(int argc, char *argv[])
         }
     }
     // Evaluate.
-    int r = tr_evaluate(tr.t, &inputs[0], &outputs[0], &data[0], mod, NULL);
+    std::vector<ncoef_t> constants;
+    tr_reduce_constants(constants, tr.t, mod);
+    int r = tr_evaluate(tr.t, &inputs[0], &outputs[0], &data[0], &constants[0], mod, NULL);
     if (r != 0) crash("evaluate-modular: evaluation failed with code %d: %s\n", r, code_strerror(r));
     // Report.
     OPEN_FILE_W(f, filename);
@@ -1458,14 +2041,24 @@ cmd_reconstruct0(int argc, char *argv[])
     LOGBLOCK("reconstruct0");
     const char *filename = NULL;
     const char *factorfile = NULL;
-    int nthreads = 1;
+    int nthreads = 1, nsplit = 1, nprimes = 1, usejit = 0, usemont = 0, usecompact = 0;
     int na = 0;
     for (; na < argc; na++) {
         if (startswith(argv[na], "--threads=")) { nthreads = atoi(argv[na] + 10); }
+        else if (startswith(argv[na], "--split=")) { nsplit = atoi(argv[na] + 8); }
+        else if (startswith(argv[na], "--primes=")) { nprimes = atoi(argv[na] + 9); }
         else if (startswith(argv[na], "--multiply-by=")) { factorfile = argv[na] + 14; }
         else if (startswith(argv[na], "--to=")) { filename = argv[na] + 5; }
+        else if (strcmp(argv[na], "--jit") == 0) { usejit = 1; }
+        else if (strcmp(argv[na], "--montgomery") == 0) { usemont = 1; }
+        else if (strcmp(argv[na], "--compact") == 0) { usecompact = 1; }
         else break;
     }
+    if (usejit && usemont) crash("reconstruct0: --jit and --montgomery can not be used together\n");
+    if ((nsplit > 1) && (usejit || usemont)) crash("reconstruct0: --split can not be used with --jit or --montgomery\n");
+    if (usecompact && (usejit || usemont || (nsplit > 1))) crash("reconstruct0: --compact can not be used with --jit, --montgomery, or --split\n");
+    if ((nprimes != 1) && (nprimes != 2) && (nprimes != 4) && (nprimes != 8)) crash("reconstruct0: --primes must be 1, 2, 4, or 8\n");
+    if ((nprimes > 1) && (usejit || usemont || usecompact || (nsplit > 1))) crash("reconstruct0: --primes can not be used with --jit, --montgomery, --compact, or --split\n");
     std::unordered_map<std::string, std::string> factors;
     if (factorfile) {
         logd("Loading factors from '%s'", factorfile);
@@ -1480,13 +2073,26 @@ cmd_reconstruct0(int argc, char *argv[])
         logd("The the trace needs to be finalized; lets do it now");
         cmd_finalize(0, NULL);
     }
+    ParCode pc;
+    size_t ndata = tr.t.nextloc;
+    if (nsplit > 1) {
+        par_split(pc, tr.t, nsplit);
+        ndata = pc.nlocations;
+        omp_set_max_active_levels(2);
+    }
     char buf1[16], buf2[16];
     logd("Will use %d*%s=%s for the probe data", nthreads,
-            fmt_bytes(buf1, 16, tr.t.nextloc*sizeof(ncoef_t)),
-            fmt_bytes(buf2, 16, nthreads*tr.t.nextloc*sizeof(ncoef_t)));
+            fmt_bytes(buf1, 16, nprimes*ndata*sizeof(ncoef_t)),
+            fmt_bytes(buf2, 16, nthreads*nprimes*ndata*sizeof(ncoef_t)));
     uint8_t *code = NULL;
-    logd("Will also use %s for the code", fmt_bytes(buf1, 16, code_size(tr.t.fincode)));
-    TR_EVAL_BEGIN(tr.t, code, true)
+    JitCode jit;
+    CompactCode cc;
+    if (usecompact) {
+        load_compact_code(cc, tr.t);
+    } else {
+        logd("Will also use %s for the code", fmt_bytes(buf1, 16, code_size(tr.t.fincode)));
+    }
+    TR_EVAL_BEGIN(tr.t, code, jit, !usecompact, usejit)
     double t1 = timestamp();
     std::vector<ncoef_t> inputs;
     inputs.resize(tr.t.ninputs, 0);
@@ -1495,20 +2101,40 @@ cmd_reconstruct0(int argc, char *argv[])
         fmpq_t q;
         bool done;
     };
+    // With --primes each thread evaluates nprimes primes at
+    // once; outputs[k*noutputs + i] is the output i in mods[k].
     struct PerThread {
         ncoef_t *outputs;
-        nmod_t mod;
+        nmod_t *mods;
         double eval_t;
     };
     PerOutput *os = (PerOutput*)safe_malloc(sizeof(PerOutput)*tr.t.noutputs);
     PerThread *ts = (PerThread*)safe_malloc(sizeof(PerThread)*nthreads);
     size_t nprobes = 0;
+    // Once enough outputs are done, only the cones of the rest
+    // are evaluated; slicedfor is the number of outputs that
+    // the current code is needed for.
+    CodeSlice slice;
+    bool sliced = false;
+    size_t slicedfor = tr.t.noutputs;
     #pragma omp parallel num_threads(nthreads)
     {
         int tid = omp_get_thread_num();
         PerThread &t = ts[tid];
-        t.outputs = (ncoef_t*)safe_malloc(sizeof(ncoef_t)*tr.t.noutputs);
-        ncoef_t *data = (ncoef_t*)safe_malloc(sizeof(ncoef_t)*tr.t.nextloc);
+        t.outputs = (ncoef_t*)safe_malloc(sizeof(ncoef_t)*nprimes*tr.t.noutputs);
+        t.mods = (nmod_t*)safe_malloc(sizeof(nmod_t)*nprimes);
+        ncoef_t *data = (ncoef_t*)safe_malloc(sizeof(ncoef_t)*nprimes*ndata);
+        ParState ps;
+        MontMod mont;
+        std::vector<ncoef_t> montinputs(usemont ? tr.t.ninputs : 0);
+        // The inputs interleaved for --primes.
+        std::vector<ncoef_t> vinputs(nprimes > 1 ? nprimes*tr.t.ninputs : 0);
+        for (size_t i = 0; i < vinputs.size(); i++) {
+            vinputs[i] = inputs[i/nprimes];
+        }
+        // The constants reduced (or converted) into this
+        // thread's prime, once per prime.
+        std::vector<ncoef_t> constants;
         for (size_t oid = tid; oid < tr.t.noutputs; oid += nthreads) {
             PerOutput &o = os[oid];
             fmpz_init2(o.r, 16);
@@ -1524,23 +2150,70 @@ cmd_reconstruct0(int argc, char *argv[])
         fmpq_init(q);
         size_t ndone = 0;
         for (;;) {
-            if (primeid + nthreads > (int)countof(primes)) {
+            if (primeid + nthreads*nprimes > (int)countof(primes)) {
                 crash("reconstruct0: don't know enough primes to continue\n");
             }
             if (tid == 0) {
-                logd("Reconstructing in primes %zu .. %zu; %zu done, %zu todo", primeid, primeid + nthreads - 1, ndone, tr.t.noutputs-ndone);
+                logd("Reconstructing in primes %zu .. %zu; %zu done, %zu todo", primeid, primeid + nthreads*nprimes - 1, ndone, tr.t.noutputs-ndone);
+            }
+            for (int k = 0; k < nprimes; k++) {
+                nmod_init(&t.mods[k], primes[primeid + tid*nprimes + k].n);
             }
-            nmod_init(&t.mod, primes[primeid + tid].n);
             double t1 = timestamp();
             int r;
-            TR_EVAL(r, tr.t, &inputs[0], &t.outputs[0], &data[0], t.mod, code, NULL);
+            if (nprimes > 1) {
+                tr_reduce_constants_lanes(constants, tr.t, t.mods, nprimes);
+                const uint8_t *c = sliced ? &slice.code[0] : code;
+                size_t csize = sliced ? slice.size : tr.t.fincode.filesize;
+                #define EVAL_PRIMES(K) \
+                    r = (c != NULL) ? \
+                        code_evaluate_lo_mem_primes<K>(c, csize, &vinputs[0], &constants[0], &data[0], t.mods) : \
+                        code_evaluate_lo_primes<K>(tr.t.fincode, &vinputs[0], &constants[0], &data[0], t.mods);
+                switch (nprimes) {
+                case 2: EVAL_PRIMES(2); break;
+                case 4: EVAL_PRIMES(4); break;
+                case 8: EVAL_PRIMES(8); break;
+                }
+                #undef EVAL_PRIMES
+                for (int k = 0; k < nprimes; k++) {
+                    for (size_t i = 0; i < tr.t.noutputs; i++) {
+                        t.outputs[k*tr.t.noutputs + i] = data[tr.t.outputs[i]*nprimes + k];
+                    }
+                }
+            } else if (usemont) {
+                if (mont_init(mont, t.mods[0]) != 0) crash("reconstruct0: the Montgomery form needs an odd prime\n");
+                mont_convert_constants(constants, tr.t, mont);
+                for (size_t i = 0; i < inputs.size(); i++) {
+                    montinputs[i] = mont_to(inputs[i], mont);
+                }
+                if (sliced) {
+                    r = code_evaluate_lo_mem_mont(&slice.code[0], slice.size, &montinputs[0], &constants[0], &data[0], mont);
+                    for (size_t i = 0; i < tr.t.noutputs; i++) { t.outputs[i] = mont_from(data[tr.t.outputs[i]], mont); }
+                } else {
+                    TR_EVAL_MONT(r, tr.t, &montinputs[0], &t.outputs[0], &data[0], mont, constants, code, NULL);
+                }
+            } else {
+                tr_reduce_constants(constants, tr.t, t.mods[0]);
+                if (nsplit > 1) {
+                    r = par_evaluate(pc, ps, tr.t, &inputs[0], &t.outputs[0], &data[0], &constants[0], t.mods[0]);
+                } else if (sliced) {
+                    r = code_evaluate_lo_mem(&slice.code[0], slice.size, &inputs[0], &constants[0], &data[0], t.mods[0]);
+                    for (size_t i = 0; i < tr.t.noutputs; i++) { t.outputs[i] = data[tr.t.outputs[i]]; }
+                } else if (usecompact) {
+                    r = tr_evaluate_compact(tr.t, cc, &inputs[0], &t.outputs[0], &data[0], &constants[0], t.mods[0]);
+                } else {
+                    TR_EVAL(r, tr.t, &inputs[0], &t.outputs[0], &data[0], t.mods[0], constants, code, jit, NULL);
+                }
+            }
             double t2 = timestamp();
             t.eval_t += t2-t1;
             if (r != 0) crash("reconstrunct0: evaluation failed with code %d: %s\n", r, code_strerror(r));
             #pragma omp barrier
             // For each new prime field evaluated before the barrier.
-            for (int p = 0; p < nthreads; p++, primeid++) {
-                PerThread &t = ts[p];
+            for (int p = 0; p < nthreads*nprimes; p++, primeid++) {
+                PerThread &t = ts[p/nprimes];
+                const ncoef_t *outputs = &t.outputs[(p%nprimes)*tr.t.noutputs];
+                const nmod_t &mod = t.mods[p%nprimes];
                 if (primeid == 0) {
                     fmpz_set_ui(next_m, primes[primeid].n);
                 } else {
@@ -1553,10 +2226,10 @@ cmd_reconstruct0(int argc, char *argv[])
                     if (o.done) continue;
                     // Chinese remaindering
                     if (primeid == 0) {
-                        fmpz_set_ui(o.r, t.outputs[oid]);
+                        fmpz_set_ui(o.r, outputs[oid]);
                     } else {
-                        mp_limb_t rmod = fmpz_get_nmod(o.r, t.mod);
-                        if (rmod == t.outputs[oid]) {
+                        mp_limb_t rmod = fmpz_get_nmod(o.r, mod);
+                        if (rmod == outputs[oid]) {
                             // Fast path for positive integers.
                             o.done = true;
                             fmpq_set_fmpz(o.q, o.r);
@@ -1564,8 +2237,8 @@ cmd_reconstruct0(int argc, char *argv[])
                         }
                         assert(fmpz_sgn(o.r) >= 0);
                         mp_limb_t s;
-                        s = _nmod_sub(t.outputs[oid], rmod, t.mod);
-                        s = n_mulmod_shoup(current_m_inv_mod, s, current_m_inv_mod_shoup, t.mod.n);
+                        s = _nmod_sub(outputs[oid], rmod, mod);
+                        s = n_mulmod_shoup(current_m_inv_mod, s, current_m_inv_mod_shoup, mod.n);
                         fmpz_addmul_ui(o.r, current_m, s);
                     }
                     // Rational number reconstruction
@@ -1590,12 +2263,35 @@ cmd_reconstruct0(int argc, char *argv[])
                 if (os[i].done) ndone++;
             }
             if (ndone >= tr.t.noutputs) break;
+            // All threads must agree on the re-slicing before
+            // any of them updates slicedfor inside the single,
+            // and none may touch the slice until it is done.
+            bool reslice = (code != NULL) && (nsplit <= 1) && (4*(tr.t.noutputs - ndone) <= 3*slicedfor);
+            #pragma omp barrier
+            if (reslice) {
+                #pragma omp single
+                {
+                    std::vector<nloc_t> roots;
+                    for (size_t i = 0; i < tr.t.noutputs; i++) {
+                        if (!os[i].done) roots.push_back(tr.t.outputs[i]);
+                    }
+                    int r = sliced ?
+                        code_slice(slice, &slice.code[0], slice.size, slice.chunks.data(), slice.chunks.size(), tr.t.nfinlocations, roots.size(), roots.data()) :
+                        tr_slice(slice, tr.t, code, roots.size(), roots.data());
+                    if (r != 0) crash("reconstruct0: failed to slice the code (error %d)\n", r);
+                    sliced = true;
+                    slicedfor = roots.size();
+                    char buf[16];
+                    logd("Sliced the code down to %s for the %zu remaining outputs", fmt_bytes(buf, 16, slice.size), slicedfor);
+                }
+            }
         }
         fmpq_clear(q);
         fmpz_clear(next_m);
         fmpz_clear(current_m);
         fmpz_clear(rneg);
         free(t.outputs);
+        free(t.mods);
         free(data);
         nprobes = primeid;
     }
@@ -1626,7 +2322,7 @@ cmd_reconstruct0(int argc, char *argv[])
     }
     free(os);
     free(ts);
-    TR_EVAL_END(tr.t, code)
+    TR_EVAL_END(tr.t, code, jit)
     return na;
 }
 
@@ -1746,8 +2442,10 @@ cmd_to_series(int argc, char *argv[])
     char buf[16];
     logd("Will use %s memory during the transformation",
             fmt_bytes(buf, 16, tr.t.nfinlocations*sizeof(SValue)));
-    Trace t = tr_to_series(tr.t, varidx, maxorder);
+    size_t hashcons_limit = tr.hashcons_limit;
+    Trace t = tr_to_series(tr.t, varidx, maxorder, hashcons_limit);
     tr = tracer_of_trace(t);
+    tr.hashcons_limit = hashcons_limit;
     the_varmap.clear();
     return 2;
 }
@@ -1952,6 +2650,7 @@ main(int argc, char *argv[])
         CMD("load-trace", cmd_load_trace)
         CMD("save-trace", cmd_save_trace)
         CMD("trace-expression", cmd_trace_expression)
+        CMD("trace-expressions", cmd_trace_expressions)
         CMD("keep-outputs", cmd_keep_outputs)
         CMD("drop-outputs", cmd_drop_outputs)
         CMD("rename-outputs", cmd_rename_outputs)
@@ -9,13 +9,22 @@
 #define RATRACER_H
 
 #include <assert.h>
+#include <fcntl.h>
 #include <flint/fmpz.h>
 #include <flint/nmod.h>
 #include <flint/nmod_vec.h>
+#include <math.h>
+#include <sched.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -193,6 +202,12 @@ file_close(FILE *file, File_Kind kind)
     if (f ## _err != 0) { crash("failed to close '%s'\n", f ## _name); }
 
 /* Name table
+ *
+ * The non-empty names are indexed by an open-addressing hash
+ * table (with linear probing), so that nt_lookup() does not
+ * need to scan all of them. Each slot holds a name index plus
+ * one, or zero if the slot is free; if a name occurs several
+ * times, only the first occurrence is indexed.
  */
 
 struct NameTable {
@@ -200,8 +215,80 @@ struct NameTable {
     size_t nalloc;
     char *names;
     unsigned exp;
+    size_t *index;
+    size_t indexsize;
+    size_t nindexed;
 };
 
+static inline size_t
+nt_hash(const char *name, size_t size)
+{
+    // FNV-1a
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (uint8_t)name[i])*0x100000001B3ull;
+    }
+    return h ^ (h >> 29);
+}
+
+static inline bool
+nt_equal(const NameTable &nt, size_t i, const char *name, size_t size)
+{
+    const char *s = &nt.names[i << nt.exp];
+    return (memcmp(s, name, size) == 0) && (s[size] == 0);
+}
+
+// Return the index slot holding the given name, or the free
+// slot where it would go.
+static size_t
+nt_index_find(const NameTable &nt, const char *name, size_t size)
+{
+    size_t mask = nt.indexsize - 1;
+    for (size_t slot = nt_hash(name, size) & mask;; slot = (slot + 1) & mask) {
+        size_t i = nt.index[slot];
+        if ((i == 0) || nt_equal(nt, i - 1, name, size)) return slot;
+    }
+}
+
+static void
+nt_index_add(NameTable &nt, size_t i)
+{
+    const char *name = &nt.names[i << nt.exp];
+    size_t size = strnlen(name, (size_t)1 << nt.exp);
+    if (size == 0) return;
+    if (2*(nt.nindexed + 1) > nt.indexsize) {
+        size_t *oldindex = nt.index;
+        size_t oldsize = nt.indexsize;
+        nt.indexsize = oldsize ? 2*oldsize : 16;
+        nt.index = (size_t*)safe_malloc(nt.indexsize*sizeof(size_t));
+        memset(nt.index, 0, nt.indexsize*sizeof(size_t));
+        for (size_t slot = 0; slot < oldsize; slot++) {
+            size_t k = oldindex[slot];
+            if (k == 0) continue;
+            const char *kname = &nt.names[(k - 1) << nt.exp];
+            nt.index[nt_index_find(nt, kname, strlen(kname))] = k;
+        }
+        free(oldindex);
+    }
+    size_t slot = nt_index_find(nt, name, size);
+    if (nt.index[slot] == 0) {
+        nt.index[slot] = i + 1;
+        nt.nindexed++;
+    } else if (nt.index[slot] > i + 1) {
+        nt.index[slot] = i + 1;
+    }
+}
+
+static void
+nt_index_rebuild(NameTable &nt)
+{
+    if (nt.index != NULL) memset(nt.index, 0, nt.indexsize*sizeof(size_t));
+    nt.nindexed = 0;
+    for (size_t i = 0; i < nt.nnames; i++) {
+        nt_index_add(nt, i);
+    }
+}
+
 static void
 _nt_resize(NameTable &nt, size_t nnames, size_t nbytes)
 {
@@ -216,14 +303,20 @@ _nt_resize(NameTable &nt, size_t nnames, size_t nbytes)
         }
         free(nt.names);
     }
-    nt = NameTable { nt.nnames, nalloc, names, exp };
+    nt = NameTable { nt.nnames, nalloc, names, exp, nt.index, nt.indexsize, nt.nindexed };
 }
 
 API void
 nt_resize(NameTable &nt, size_t nnames)
 {
     if (nnames >= nt.nalloc) _nt_resize(nt, nnames, (size_t)1 << nt.exp);
+    size_t oldnnames = nt.nnames;
     nt.nnames = nnames;
+    if (nnames > oldnnames) {
+        memset(&nt.names[oldnnames << nt.exp], 0, (nnames - oldnnames) << nt.exp);
+    } else if (nnames < oldnnames) {
+        nt_index_rebuild(nt);
+    }
 }
 
 API ssize_t
@@ -231,15 +324,8 @@ nt_lookup(const NameTable &nt, const char *name, size_t size)
 {
     if (size >= ((size_t)1 << nt.exp)) return -1;
     if (size <= 0) return -1;
-    size_t offs = 0;
-    size_t stride = (size_t)1 << nt.exp;
-    for (size_t i = 0; i < nt.nnames; i++, offs += stride) {
-        if ((nt.names[offs] == *name) &&
-                (memcmp(&nt.names[offs]+1, name+1, size-1) == 0) &&
-                (nt.names[offs + size] == 0))
-            return (ssize_t)i;
-    }
-    return -1;
+    if (nt.nindexed == 0) return -1;
+    return (ssize_t)nt.index[nt_index_find(nt, name, size)] - 1;
 }
 
 API const char *
@@ -258,6 +344,7 @@ nt_append(NameTable &nt, const char *name, size_t size)
     size_t index = nt.nnames++;
     memset(&nt.names[index << nt.exp], 0, (size_t)1 << nt.exp);
     memcpy(&nt.names[index << nt.exp], name, size);
+    nt_index_add(nt, index);
     return index;
 }
 
@@ -268,14 +355,22 @@ nt_set(NameTable &nt, size_t index, const char *name, size_t size)
     if (size >= ((size_t)1 << nt.exp)) {
         _nt_resize(nt, nt.nnames, size+1);
     }
+    bool wasempty = (nt.names[index << nt.exp] == 0);
     memset(&nt.names[index << nt.exp], 0, (size_t)1 << nt.exp);
     memcpy(&nt.names[index << nt.exp], name, size);
+    // Renaming is rare enough to just index everything anew.
+    if (wasempty) {
+        nt_index_add(nt, index);
+    } else {
+        nt_index_rebuild(nt);
+    }
 }
 
 API void
 nt_clear(NameTable &nt)
 {
     free(nt.names);
+    free(nt.index);
     nt = NameTable{};
 }
 
@@ -295,12 +390,18 @@ nt_clear(NameTable &nt)
  *
  * Thankfully the users of the Tracer interface below don't need
  * to know about these details.
+ *
+ * The files normally live in TMPDIR, but as long as the total
+ * size of the code stays under the RATRACER_MEMLIMIT budget,
+ * they are kept in memory instead (see code_membudget()).
  */
 
 #define CODE_PAGESIZE (16*1024)
 #define CODE_PAGELUFT 32
 #define CODE_BUFALIGN 64
 
+struct CodeWriter;
+
 struct Code {
     // Code buffer, should be at least CODE_PAGESIZE + CODE_PAGELUFT
     // bytes long, and aligned at CODE_BUFALIGN-byte boundary.
@@ -309,12 +410,71 @@ struct Code {
     size_t buflen;
     int fd;
     size_t filesize;
+    // The first cachesize bytes of the file, if loaded into
+    // memory with code_cache_load(); see there.
+    uint8_t *cache;
+    size_t cachesize;
+    // True if the file is a memfd counted in code_membudget().
+    bool inmem;
+    // The background writer of the flushed pages, started by
+    // the first code_flush(); see code_sync().
+    CodeWriter *writer;
 };
 
-API Code
-code_init()
+// Parse a size like "512M", "40G", or "1.5TB" into bytes.
+API size_t
+parse_bytes(const char *text)
+{
+    char *end;
+    double n = strtod(text, &end);
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if ((*end == 'B') || (*end == 'b')) end++;
+    if ((end == text) || (*end != 0) || !(n >= 0)) {
+        crash("ratracer: can't parse '%s' as a size\n", text);
+    }
+    return (size_t)ldexp(n, shift);
+}
+
+/* The memory budget for the code files.
+ *
+ * The limit comes from the RATRACER_MEMLIMIT environment
+ * variable, and is zero (i.e. all the code goes to TMPDIR) if
+ * it is not set. The in-memory files are created with
+ * memfd_create(), so all the usual file operations (and mmap)
+ * keep working on them, but they never touch the disk. Once
+ * the total size of the in-memory files would exceed the
+ * limit, the file that has grown is moved into TMPDIR by
+ * code_spill().
+ */
+
+struct CodeMemBudget {
+    size_t limit;
+    std::atomic<size_t> used;
+};
+
+static size_t
+code_memlimit()
+{
+    const char *limit = getenv("RATRACER_MEMLIMIT");
+    return ((limit == NULL) || (*limit == 0)) ? 0 : parse_bytes(limit);
+}
+
+API CodeMemBudget &
+code_membudget()
+{
+    static CodeMemBudget budget = {code_memlimit(), {0}};
+    return budget;
+}
+
+static int
+code_mktemp()
 {
-    uint8_t *buf = (uint8_t*)safe_memalign(CODE_BUFALIGN, CODE_PAGESIZE + CODE_PAGELUFT);
     const char *tmp = getenv("TMPDIR");
     if (tmp == NULL) tmp = "/tmp";
     char *path = (char*)safe_malloc(strlen(tmp) + 24);
@@ -325,12 +485,187 @@ code_init()
     }
     unlink(path);
     free(path);
-    return Code{buf, 0, fd, 0};
+    return fd;
+}
+
+/* Write-behind for the code files.
+ *
+ * Instead of calling write() on the tracing thread every time
+ * a page fills up, code_flush() and revcode_flush() copy the
+ * page into a ring of CODE_WRITEBEHIND page buffers, and a
+ * background thread writes the pages out in order. The ring
+ * has a single producer and a single consumer, so handing a
+ * page over takes no locks; the mutex is only there for the
+ * writer to sleep on while the ring is empty. A sleeping
+ * writer is only woken up once half of the ring is filled, so
+ * that it writes out several pages per system call.
+ *
+ * Whatever reads the file, or changes it by other means, must
+ * first wait for the pending writes with code_sync(). The code
+ * iterators, tr_flush(), and the code_* functions below all do
+ * this themselves.
+ */
+
+#define CODE_WRITEBEHIND 32
+
+struct CodeWriter {
+    int fd;
+    uint8_t *pages;
+    // The number of pages queued (head) and written (tail).
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<bool> sleeping;
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread thread;
+};
+
+static void
+code_writer_main(CodeWriter *w)
+{
+    for (;;) {
+        size_t tail = w->tail.load(std::memory_order_relaxed);
+        if (w->head.load() == tail) {
+            std::unique_lock<std::mutex> lock(w->mutex);
+            w->sleeping = true;
+            w->wakeup.wait(lock, [&]{ return w->stop || (w->head.load() != tail); });
+            w->sleeping = false;
+            if (w->head.load() == tail) return;
+            continue;
+        }
+        // Write out the pending pages up to the end of the ring.
+        size_t npages = w->head.load(std::memory_order_acquire) - tail;
+        size_t slot = tail % CODE_WRITEBEHIND;
+        if (npages > CODE_WRITEBEHIND - slot) npages = CODE_WRITEBEHIND - slot;
+        ssize_t n;
+        SYSCALL(n = write(w->fd, w->pages + slot*CODE_PAGESIZE, npages*CODE_PAGESIZE));
+        if (unlikely(n != (ssize_t)(npages*CODE_PAGESIZE))) {
+            if (n < 0) {
+                crash("code_writer(): write() failed: %s\n", strerror(errno));
+            } else {
+                crash("code_writer(): incomplete write(), only %zd of %zu bytes written\n", n, npages*CODE_PAGESIZE);
+            }
+        }
+        w->tail.store(tail + npages, std::memory_order_release);
+    }
+}
+
+// Return the ring buffer for the next page to be written,
+// waiting for a free one if needed; code_writer_push() then
+// queues it.
+static uint8_t *
+code_writer_slot(Code &code)
+{
+    CodeWriter *w = code.writer;
+    if (w == NULL) {
+        w = code.writer = new CodeWriter();
+        w->fd = code.fd;
+        w->pages = (uint8_t*)safe_memalign(CODE_BUFALIGN, CODE_WRITEBEHIND*CODE_PAGESIZE);
+        w->stop = false;
+        w->thread = std::thread(code_writer_main, w);
+    }
+    size_t head = w->head.load(std::memory_order_relaxed);
+    while (head - w->tail.load(std::memory_order_acquire) >= CODE_WRITEBEHIND) {
+        sched_yield();
+    }
+    return w->pages + head%CODE_WRITEBEHIND*CODE_PAGESIZE;
+}
+
+static void
+code_writer_wake(CodeWriter *w)
+{
+    if (w->sleeping.load()) {
+        { std::lock_guard<std::mutex> lock(w->mutex); }
+        w->wakeup.notify_one();
+    }
+}
+
+static void
+code_writer_push(Code &code)
+{
+    CodeWriter *w = code.writer;
+    size_t head = w->head.fetch_add(1) + 1;
+    if (head - w->tail.load(std::memory_order_relaxed) >= CODE_WRITEBEHIND/2) {
+        code_writer_wake(w);
+    }
+}
+
+// Wait until all the flushed pages are written to the file.
+API void
+code_sync(const Code &code)
+{
+    CodeWriter *w = code.writer;
+    if (w == NULL) return;
+    if (w->tail.load() != w->head.load(std::memory_order_relaxed)) code_writer_wake(w);
+    while (w->tail.load(std::memory_order_acquire) != w->head.load(std::memory_order_relaxed)) {
+        sched_yield();
+    }
+}
+
+API Code
+code_init()
+{
+    uint8_t *buf = (uint8_t*)safe_memalign(CODE_BUFALIGN, CODE_PAGESIZE + CODE_PAGELUFT);
+    if (code_membudget().limit > 0) {
+        int fd = memfd_create("ratracer", MFD_CLOEXEC);
+        if (fd >= 0) return Code{buf, 0, fd, 0, NULL, 0, true, NULL};
+    }
+    return Code{buf, 0, code_mktemp(), 0, NULL, 0, false, NULL};
+}
+
+// Move the in-memory file into TMPDIR, keeping the same file
+// descriptor (and thus the file offset) for it.
+API void
+code_spill(Code &code)
+{
+    if (!code.inmem) return;
+    code_sync(code);
+    int fd = code_mktemp();
+    off_t offset = 0;
+    while ((size_t)offset < code.filesize) {
+        ssize_t n;
+        SYSCALL(n = sendfile(fd, code.fd, &offset, code.filesize - offset));
+        if (unlikely(n <= 0)) crash("code_spill(): sendfile() failed: %s\n", strerror(errno));
+    }
+    if (unlikely(dup2(fd, code.fd) < 0)) {
+        crash("code_spill(): dup2() failed: %s\n", strerror(errno));
+    }
+    close(fd);
+    code_membudget().used -= code.filesize;
+    code.inmem = false;
+}
+
+// Account for the file size changing from oldsize to the
+// current filesize, spilling the file if over the budget.
+API void
+code_resized(Code &code, size_t oldsize)
+{
+    if (!code.inmem) return;
+    CodeMemBudget &budget = code_membudget();
+    size_t used = (budget.used += code.filesize - oldsize);
+    if ((code.filesize > oldsize) && (used > budget.limit)) {
+        code_spill(code);
+    }
 }
 
 API void
 code_clear(Code &code)
 {
+    if (code.writer != NULL) {
+        CodeWriter *w = code.writer;
+        code_sync(code);
+        {
+            std::lock_guard<std::mutex> lock(w->mutex);
+            w->stop = true;
+        }
+        w->wakeup.notify_one();
+        w->thread.join();
+        free(w->pages);
+        delete w;
+        code.writer = NULL;
+    }
+    if (code.inmem) code_membudget().used -= code.filesize;
     close(code.fd);
     free(code.buf);
 }
@@ -338,32 +673,30 @@ code_clear(Code &code)
 API void
 code_reset(Code &code)
 {
+    code_sync(code);
     lseek(code.fd, 0, SEEK_SET);
     int r = ftruncate(code.fd, 0);
     if (unlikely(r != 0)) {
         crash("code_reset(): ftruncate() failed: %s\n", strerror(errno));
     }
+    size_t oldsize = code.filesize;
     code.buflen = 0;
     code.filesize = 0;
+    code_resized(code, oldsize);
 }
 
 API void
 code_flush(Code &code)
 {
     if (code.buflen > 0) {
-        ssize_t n;
-        memset(code.buf + code.buflen, 0, CODE_PAGESIZE - code.buflen);
-        SYSCALL(n = write(code.fd, code.buf, CODE_PAGESIZE));
-        if (unlikely(n != CODE_PAGESIZE)) {
-            if (n < 0) {
-                crash("code_flush(): write() failed: %s\n", strerror(errno));
-            } else {
-                crash("code_flush(): incomplete write(), only %zd of %d bytes written\n", n, CODE_PAGESIZE);
-            }
-        }
+        uint8_t *page = code_writer_slot(code);
+        memcpy(page, code.buf, code.buflen);
+        memset(page + code.buflen, 0, CODE_PAGESIZE - code.buflen);
+        code_writer_push(code);
         memset(code.buf, 0, code.buflen);
         code.filesize += CODE_PAGESIZE;
         code.buflen = 0;
+        code_resized(code, code.filesize - CODE_PAGESIZE);
     }
 }
 
@@ -372,6 +705,7 @@ code_append_pages(Code &code, void *instructions, size_t size)
 {
     assert((size % CODE_PAGESIZE) == 0);
     assert(code.buflen == 0);
+    code_sync(code);
     ssize_t n;
     SYSCALL(n = write(code.fd, instructions, size));
     if (unlikely(n != (ssize_t)size)) {
@@ -382,6 +716,7 @@ code_append_pages(Code &code, void *instructions, size_t size)
         }
     }
     code.filesize += size;
+    code_resized(code, code.filesize - size);
 }
 
 API size_t
@@ -394,6 +729,7 @@ API void
 code_truncate(Code &code, size_t size)
 {
     assert(size <= code_size(code));
+    code_sync(code);
     if (size > code.filesize) {
         code.buflen = size - code.filesize;
     } else {
@@ -410,8 +746,10 @@ code_truncate(Code &code, size_t size)
         if (unlikely(r != 0)) {
             crash("code_truncate(): ftruncate() failed: %s\n", strerror(errno));
         }
-        code.filesize = size;
+        size_t oldsize = code.filesize;
+        code.filesize = page;
         code.buflen = buflen;
+        code_resized(code, oldsize);
     }
 }
 
@@ -424,23 +762,138 @@ code_truncate(Code &code, size_t size)
         (code).buflen += sizeof(type); \
     } while(0)
 
+/* Read-ahead for the code iterators.
+ *
+ * The iterators read one page at a time with pread(), which
+ * stalls on the disk whenever the code is not in the page
+ * cache. To avoid this, they ask the kernel to read the code
+ * in the background, CODE_READAHEAD bytes ahead of the page
+ * being processed, in whichever direction they go. Note that
+ * the kernel's own read-ahead does not help the reverse
+ * iteration at all.
+ */
+
+#define CODE_READAHEAD (64*CODE_PAGESIZE)
+
+static inline void
+code_readahead(int fd, ssize_t start, ssize_t end)
+{
+    if (start < 0) start = 0;
+    if (end > start) (void)posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+}
+
+// Called before reading the page at the given offset, going
+// forward until the end offset.
+static inline void
+code_readahead_forward(int fd, ssize_t start, ssize_t end, bool first)
+{
+    if (first) {
+        (void)posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+        ssize_t window = start - start % CODE_READAHEAD;
+        ssize_t next = window + 2*CODE_READAHEAD;
+        code_readahead(fd, start, (next < end) ? next : end);
+    } else if (start % CODE_READAHEAD == 0) {
+        ssize_t next = start + 2*CODE_READAHEAD;
+        code_readahead(fd, start + CODE_READAHEAD, (next < end) ? next : end);
+    }
+}
+
+// Same, but going backward until the beginning of the file.
+static inline void
+code_readahead_backward(int fd, ssize_t start, ssize_t end, bool first)
+{
+    if (first) {
+        ssize_t window = start - start % CODE_READAHEAD;
+        code_readahead(fd, window - CODE_READAHEAD, end);
+    } else if (start % CODE_READAHEAD == 0) {
+        code_readahead(fd, start - 2*CODE_READAHEAD, start - CODE_READAHEAD);
+    }
+}
+
+/* Code cache.
+ *
+ * code_cache_load() keeps as many of the first pages of the
+ * code in memory as fit into the given budget, and from then
+ * on the forward iteration (without writing) takes these pages
+ * from memory instead of reading them from the file. Copies of
+ * the Code structure share the cache, so all the threads that
+ * evaluate the same code can use it at once.
+ *
+ * The pages are CODE_CACHESTRIDE bytes apart, so that each is
+ * followed by zero padding, as the evaluators expect; the
+ * memory is asked to be backed by huge pages where possible.
+ * The cache must be freed before the code is modified.
+ */
+
+#define CODE_CACHESTRIDE (CODE_PAGESIZE + CODE_BUFALIGN)
+
+API size_t
+code_cache_load(Code &code, size_t budget)
+{
+    assert(code.cache == NULL);
+    assert(code.buflen == 0);
+    code_sync(code);
+    size_t npages = budget/CODE_CACHESTRIDE;
+    if (npages > code.filesize/CODE_PAGESIZE) npages = code.filesize/CODE_PAGESIZE;
+    if (npages == 0) return 0;
+    void *cache = mmap(NULL, npages*CODE_CACHESTRIDE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unlikely(cache == MAP_FAILED)) {
+        crash("code_cache_load(): mmap() failed: %s\n", strerror(errno));
+    }
+#ifdef MADV_HUGEPAGE
+    (void)madvise(cache, npages*CODE_CACHESTRIDE, MADV_HUGEPAGE);
+#endif
+    code.cache = (uint8_t*)cache;
+    for (size_t i = 0; i < npages; i++) {
+        code_readahead_forward(code.fd, i*CODE_PAGESIZE, npages*CODE_PAGESIZE, i == 0);
+        ssize_t n;
+        SYSCALL(n = pread(code.fd, code.cache + i*CODE_CACHESTRIDE, CODE_PAGESIZE, i*CODE_PAGESIZE));
+        if (unlikely(n != CODE_PAGESIZE)) crash("code_cache_load(): read() failed\n");
+    }
+    code.cachesize = npages*CODE_PAGESIZE;
+    return npages*CODE_CACHESTRIDE;
+}
+
+API void
+code_cache_free(Code &code)
+{
+    if (code.cache == NULL) return;
+    munmap(code.cache, code.cachesize/CODE_PAGESIZE*CODE_CACHESTRIDE);
+    code.cache = NULL;
+    code.cachesize = 0;
+}
+
 /* Forward code iteration
  */
 
 #define CODE_PAGESUBITER_BEGIN(fd, buf, i1, i2, wr) \
+    CODE_CACHEDPAGESUBITER_BEGIN(fd, buf, NULL, 0, i1, i2, wr)
+
+// Same, but the pages below cachesize are taken from the cache
+// (when not writing), instead of being read from the file.
+#define CODE_CACHEDPAGESUBITER_BEGIN(fd, buf, cache, cachesize, i1, i2, wr) \
 { \
     int _fd = (fd); \
     void *_buf = (buf); \
+    uint8_t *_cache = (cache); \
     ssize_t _start = (i1); \
     ssize_t _end = (i2); \
     assert((_start % CODE_PAGESIZE) == 0); \
     assert((_end % CODE_PAGESIZE) == 0); \
     bool PAGEWRITE = (wr); \
-    for (; _start < _end; _start += CODE_PAGESIZE) { \
-        ssize_t _n; \
-        SYSCALL(_n = pread(_fd, _buf, CODE_PAGESIZE, _start)); \
-        if (unlikely(_n != CODE_PAGESIZE)) crash("code_pageiter: read() failed\n"); \
-        uint8_t *PAGE = (uint8_t*)ASSUME_ALIGNED(_buf, CODE_BUFALIGN); \
+    ssize_t _cached = PAGEWRITE ? 0 : (ssize_t)(cachesize); \
+    for (ssize_t _first = (_start > _cached) ? _start : _cached; _start < _end; _start += CODE_PAGESIZE) { \
+        uint8_t *PAGE; \
+        if (_start < _cached) { \
+            PAGE = _cache + _start/CODE_PAGESIZE*CODE_CACHESTRIDE; \
+        } else { \
+            ssize_t _n; \
+            code_readahead_forward(_fd, _start, _end, _start == _first); \
+            SYSCALL(_n = pread(_fd, _buf, CODE_PAGESIZE, _start)); \
+            if (unlikely(_n != CODE_PAGESIZE)) crash("code_pageiter: read() failed\n"); \
+            PAGE = (uint8_t*)_buf; \
+        } \
+        PAGE = (uint8_t*)ASSUME_ALIGNED(PAGE, CODE_BUFALIGN); \
         uint8_t *PAGEEND = PAGE + CODE_PAGESIZE; (void)PAGEEND; \
         { \
 
@@ -456,7 +909,8 @@ code_truncate(Code &code, size_t size)
 
 #define CODE_PAGEITER_BEGIN(code, rw) \
     assert(code.buflen == 0); \
-    CODE_PAGESUBITER_BEGIN(code.fd, code.buf, 0, (code).filesize, rw)
+    code_sync(code); \
+    CODE_CACHEDPAGESUBITER_BEGIN(code.fd, code.buf, (code).cache, (code).cachesize, 0, (code).filesize, rw)
 
 #define CODE_PAGEITER_END() CODE_PAGESUBITER_END()
 
@@ -475,10 +929,12 @@ code_truncate(Code &code, size_t size)
 { \
     assert(code.buflen == 0); \
     const Code &_code = (code); \
+    code_sync(_code); \
     bool _wr = (wr); \
     for (ssize_t _end = _code.filesize; _end > 0; _end -= CODE_PAGESIZE) { \
         ssize_t _start = _end - CODE_PAGESIZE; \
         ssize_t _n; \
+        code_readahead_backward(_code.fd, _start, _end, _end == (ssize_t)_code.filesize); \
         SYSCALL(_n = pread(_code.fd, _code.buf, CODE_PAGESIZE, _start)); \
         if (unlikely(_n != CODE_PAGESIZE)) crash("code_revpageiter: read() failed\n"); \
         uint8_t *PAGE = (uint8_t*)ASSUME_ALIGNED(_code.buf, CODE_BUFALIGN); \
@@ -597,6 +1053,16 @@ enum LowLevelOpcode {
     /* 0 */ LOP_NOP,
     /* 2 */ LOP_SETMUL,
     /* 3 */ LOP_SETADDMUL,
+    /* 4 */ LOP_ADD3,
+    /* 4 */ LOP_SUBMUL,
+    /* 4 */ LOP_DIFFMUL,
+    /* 3 */ LOP_NEGMUL,
+    /* 2 */ LOP_BATCHINV,
+    /* 1 */ LOP_ACC1,
+    /* 3 */ LOP_ACC3,
+    /* 1 */ LOP_NACC1,
+    /* 3 */ LOP_NACC3,
+    /* 1 */ LOP_ACCEND,
     LOP_COUNT
 };
 
@@ -628,6 +1094,16 @@ static const uint8_t LoOpSize[LOP_COUNT] = {
     sizeof(LoOp0), // NOP
     sizeof(LoOp2), // SETMUL
     sizeof(LoOp3), // SETADDMUL
+    sizeof(LoOp4), // ADD3
+    sizeof(LoOp4), // SUBMUL
+    sizeof(LoOp4), // DIFFMUL
+    sizeof(LoOp3), // NEGMUL
+    sizeof(LoOp2), // BATCHINV
+    sizeof(LoOp1), // ACC1
+    sizeof(LoOp3), // ACC3
+    sizeof(LoOp1), // NACC1
+    sizeof(LoOp3), // NACC3
+    sizeof(LoOp1), // ACCEND
 };
 
 static const char *LoOpName[LOP_COUNT] = {
@@ -652,6 +1128,55 @@ static const char *LoOpName[LOP_COUNT] = {
     "nop",
     "setmul",
     "setaddmul",
+    "add3",
+    "submul",
+    "diffmul",
+    "negmul",
+    "batchinv",
+    "acc1",
+    "acc3",
+    "nacc1",
+    "nacc3",
+    "accend",
+};
+
+/* The roles of the LoOp fields, one character per field:
+ * 'd' is a location that is written, 's' is a location that
+ * is read, 'x' is a location that is both read and written,
+ * and 'i' is an immediate value (not a location).
+ */
+static constexpr const char *LoOpArgs[LOP_COUNT] = {
+    "", // HALT
+    "di", // VAR
+    "dii", // INT
+    "dii", // NEGINT
+    "di", // BIGINT
+    "ds", // COPY
+    "ds", // INV
+    "ds", // NEGINV
+    "ds", // NEG
+    "ds", // SHOUP_PRECOMP
+    "dsi", // POW
+    "dss", // ADD
+    "dss", // SUB
+    "dss", // MUL
+    "dsss", // SHOUP_MUL
+    "dsss", // ADDMUL
+    "si", // ASSERT_INT
+    "si", // ASSERT_NEGINT
+    "", // NOP
+    "xs", // SETMUL
+    "xss", // SETADDMUL
+    "dsss", // ADD3
+    "dsss", // SUBMUL
+    "dsss", // DIFFMUL
+    "dss", // NEGMUL
+    "ds", // BATCHINV
+    "s", // ACC1
+    "sss", // ACC3
+    "s", // NACC1
+    "sss", // NACC3
+    "d", // ACCEND
 };
 
 #define LOOP_ITER_BEGIN(from, to) \
@@ -671,6 +1196,111 @@ static const char *LoOpName[LOP_COUNT] = {
     } \
 }
 
+/* Compact encoding of the finalized code.
+ *
+ * Here each instruction is a one-byte opcode, a one-byte
+ * layout, and then its fields, each stored in 1 to 4 bytes,
+ * as given by the consecutive bit pairs of the layout byte.
+ * The destination is stored as the (zigzag) difference from
+ * the previous destination, the source locations as the
+ * differences from the destination (or from the previous
+ * destination if the instruction has none), and the
+ * immediates as they are; the differences are taken modulo
+ * 2^32. Because the layout byte gives the positions of all
+ * the fields at once, they can be loaded in parallel, each
+ * with one unaligned load and a mask, rather than one after
+ * another as with varints. NOPs are dropped, and zero bytes
+ * (HALTs) are only used as the padding at the end.
+ *
+ * Because of the delta coding the compact code can only be
+ * decoded in order, from the start; it is used for keeping
+ * the finalized code in memory, and for saving traces.
+ */
+
+#define COMPACT_MAXOPSIZE (2 + 4*4)
+
+// offset[f][k] is the offset of the field k from the start of
+// an instruction with the layout byte f; offset[f][n] is the
+// size of the whole instruction with n fields.
+struct CompactLayout {
+    uint8_t offset[256][5];
+    constexpr CompactLayout() : offset() {
+        for (int f = 0; f < 256; f++) {
+            offset[f][0] = 2;
+            for (int k = 0; k < 4; k++) {
+                offset[f][k+1] = offset[f][k] + ((f >> (2*k)) & 3) + 1;
+            }
+        }
+    }
+};
+
+static constexpr CompactLayout compact_layout;
+static constexpr uint32_t compact_masks[4] = {0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF};
+
+static inline uint32_t compact_zigzag(uint32_t d) { return (d << 1) ^ (uint32_t)((int32_t)d >> 31); }
+static inline uint32_t compact_unzigzag(uint32_t z) { return (z >> 1) ^ (uint32_t)-(int32_t)(z & 1); }
+
+// Encode one instruction at p; return the end of it.
+static inline uint8_t *
+compact_encode_op(uint8_t *p, uint32_t &prev, const LoOp4 &op)
+{
+    const char *roles = LoOpArgs[op.op];
+    const uint32_t *args = &op.a;
+    uint32_t base = prev;
+    uint8_t layout = 0;
+    uint8_t *q = p + 2;
+    for (int k = 0; roles[k]; k++) {
+        uint32_t x;
+        if (roles[k] == 'i') {
+            x = args[k];
+        } else if ((k == 0) && (roles[k] != 's')) {
+            x = compact_zigzag(args[k] - prev);
+            prev = base = args[k];
+        } else {
+            x = compact_zigzag(args[k] - base);
+        }
+        int len = (x < (1u << 8)) ? 1 : (x < (1u << 16)) ? 2 : (x < (1u << 24)) ? 3 : 4;
+        layout |= (len - 1) << (2*k);
+        memcpy(q, &x, len);
+        q += len;
+    }
+    p[0] = (uint8_t)op.op;
+    p[1] = layout;
+    return q;
+}
+
+static inline uint32_t
+compact_field(const uint8_t *p, uint8_t layout, int k)
+{
+    uint32_t w;
+    memcpy(&w, p + compact_layout.offset[layout][k], 4);
+    return w & compact_masks[(layout >> (2*k)) & 3];
+}
+
+// Decode one instruction at p into op; return the end of it.
+// Note that this reads up to 3 bytes past the end.
+static inline const uint8_t *
+compact_decode_op(const uint8_t *p, uint32_t &prev, LoOp4 &op)
+{
+    op = LoOp4{p[0], 0, 0, 0, 0};
+    if (unlikely(op.op >= LOP_COUNT)) return NULL;
+    const char *roles = LoOpArgs[op.op];
+    uint32_t *args = &op.a;
+    uint32_t base = prev;
+    int k = 0;
+    for (; roles[k]; k++) {
+        uint32_t x = compact_field(p, p[1], k);
+        if (roles[k] == 'i') {
+            args[k] = x;
+        } else if ((k == 0) && (roles[k] != 's')) {
+            args[k] = prev = base = prev + compact_unzigzag(x);
+        } else {
+            args[k] = base + compact_unzigzag(x);
+        }
+    }
+    return p + compact_layout.offset[p[1]][k];
+}
+
 /* Traces
  */
 
@@ -694,6 +1324,21 @@ struct Trace {
     std::vector<std::string> output_names;
 };
 
+// An index of input or output names: each name maps to the
+// index of its first occurrence.
+typedef std::unordered_map<std::string, size_t> NameIndex;
+
+API NameIndex
+name_index(const std::vector<std::string> &names)
+{
+    NameIndex index;
+    index.reserve(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!names[i].empty()) index.emplace(names[i], i);
+    }
+    return index;
+}
+
 API Trace
 tr_init()
 {
@@ -715,6 +1360,8 @@ tr_flush(Trace &tr)
 {
     code_flush(tr.fincode);
     code_flush(tr.code);
+    code_sync(tr.fincode);
+    code_sync(tr.code);
     tr.nextloc = tr.nfinlocations + code_size(tr.code)/sizeof(HiOp);
 }
 
@@ -725,7 +1372,9 @@ tr_flush(Trace &tr)
  * - { u16 len; u8 name[len]; } for each input
  * - { u64 loc; u16 len; u8 name[len]; } for each output
  * - { u32 len; u8 value[len]; } for each big constant (GMP format)
- * - Instruction{...} for each finalized instruction
+ * - Instruction{...} for each finalized instruction, or the
+ *   finalized code in the compact form (see compact_encode_op())
+ *   if the magic is RATRACER_MAGIC_COMPACT
  * - Instruction{...} for each instruction
  */
 
@@ -740,9 +1389,38 @@ struct PACKED TraceFileHeader {
 };
 
 static const uint64_t RATRACER_MAGIC = UINT64_C(0x3430303043524052);
+static const uint64_t RATRACER_MAGIC_COMPACT = UINT64_C(0x3530303043524052);
+
+// Feed the finalized code in the compact form to fn(), in
+// pieces; return the total size.
+template <typename F> size_t
+code_compact_foreach(const Code &fincode, F fn)
+{
+    uint8_t buf[4096 + COMPACT_MAXOPSIZE];
+    uint8_t *p = buf;
+    size_t size = 0;
+    uint32_t prev = 0;
+    Code code = fincode;
+    CODE_PAGEITER_BEGIN(code, 0)
+    LOOP_ITER_BEGIN(PAGE, PAGEEND)
+        if ((OP != LOP_HALT) && (OP != LOP_NOP)) {
+            p = compact_encode_op(p, prev, *(LoOp4*)INSTR);
+            if (p - buf >= 4096) {
+                fn(buf, p - buf);
+                size += p - buf;
+                p = buf;
+            }
+        }
+    LOOP_ITER_END(PAGE, PAGEEND)
+    CODE_PAGEITER_END()
+    if (p > buf) fn(buf, p - buf);
+    return size + (p - buf);
+}
 
+// Save the trace into f; with compact set, the finalized code is
+// stored in the compact form (see tr_import_compact()).
 API int
-tr_export_to_FILE(Trace &t, FILE *f)
+tr_export_to_FILE(Trace &t, FILE *f, bool compact = false)
 {
     tr_flush(t);
     assert(t.ninputs < UINT32_MAX);
@@ -750,14 +1428,15 @@ tr_export_to_FILE(Trace &t, FILE *f)
     assert(t.constants.size() < UINT32_MAX);
     assert(t.nfinlocations < UINT32_MAX);
     TraceFileHeader h = {
-        RATRACER_MAGIC,
+        compact ? RATRACER_MAGIC_COMPACT : RATRACER_MAGIC,
         (uint32_t)t.ninputs,
         (uint32_t)t.noutputs,
         (uint32_t)t.constants.size(),
         (uint32_t)t.nfinlocations,
-        t.fincode.filesize,
+        compact ? code_compact_foreach(t.fincode, [](const uint8_t*, size_t) {}) : t.fincode.filesize,
         t.code.filesize
     };
+    bool ok = true;
     if (fwrite(&h, sizeof(TraceFileHeader), 1, f) != 1) goto fail;
     for (size_t i = 0; i < t.ninputs; i++) {
         if (i < t.input_names.size()) {
@@ -792,9 +1471,16 @@ tr_export_to_FILE(Trace &t, FILE *f)
     for (size_t i = 0; i < t.constants.size(); i++) {
         fmpz_out_raw(f, &t.constants[i]);
     }
-    CODE_PAGEITER_BEGIN(t.fincode, 0)
-        if (fwrite(PAGE, PAGEEND - PAGE, 1, f) != 1) goto fail;
-    CODE_PAGEITER_END()
+    if (compact) {
+        code_compact_foreach(t.fincode, [&](const uint8_t *p, size_t n) {
+            if (ok && (fwrite(p, n, 1, f) != 1)) ok = false;
+        });
+        if (!ok) goto fail;
+    } else {
+        CODE_PAGEITER_BEGIN(t.fincode, 0)
+            if (fwrite(PAGE, PAGEEND - PAGE, 1, f) != 1) goto fail;
+        CODE_PAGEITER_END()
+    }
     CODE_PAGEITER_BEGIN(t.code, 0)
         if (fwrite(PAGE, PAGEEND - PAGE, 1, f) != 1) goto fail;
     CODE_PAGEITER_END()
@@ -807,7 +1493,17 @@ API int
 tr_export(Trace &t, const char *filename)
 {
     OPEN_FILE_W(f, filename);
-    int r = tr_export_to_FILE(t, f);
+    int r = tr_export_to_FILE(t, f, false);
+    CLOSE_FILE(f);
+    return r;
+}
+
+// Same, but with the finalized code in the compact form.
+API int
+tr_export_compact(Trace &t, const char *filename)
+{
+    OPEN_FILE_W(f, filename);
+    int r = tr_export_to_FILE(t, f, true);
     CLOSE_FILE(f);
     return r;
 }
@@ -815,14 +1511,60 @@ tr_export(Trace &t, const char *filename)
 /* Trace construction
  */
 
+API size_t
+hiop_hash(const HiOp *op)
+{
+    uint64_t A = *(uint64_t*)ASSUME_ALIGNED((const uint8_t*)op, 8);
+    uint64_t B = *(uint64_t*)ASSUME_ALIGNED((const uint8_t*)op + 8, 8);
+    size_t h = A*0x9E3779B185EBCA87ull; // XXH_PRIME64_1
+    h ^= h >> 33;
+    h *= 0xC2B2AE3D27D4EB4Full; // XXH_PRIME64_2;
+    h += B;
+    h ^= h >> 33;
+    h *= 0xC2B2AE3D27D4EB4Full; // XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ull; // XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+struct HiOpHash {
+    inline size_t operator()(const HiOp &op) const { return hiop_hash(&op); }
+};
+
+struct HiOpEq {
+    inline bool operator()(const HiOp &a, const HiOp &b) const {
+        return memcmp(&a, &b, sizeof(HiOp)) == 0;
+    }
+};
+
+/* Record-time hash-consing.
+ *
+ * If hashcons_limit is not zero, the tracer remembers the
+ * instructions it has recorded (with the operands of the
+ * commutative ones sorted, as in tr_opt_deduplicate()), and
+ * returns the already recorded value instead of recording
+ * the same instruction again. The table is cleared once it
+ * holds hashcons_limit entries, and whenever the locations it
+ * refers to may no longer be valid (see hashcons_clear()).
+ */
+
+// The approximate memory cost of one hash-consing entry.
+#define HASHCONS_ENTRY_SIZE (sizeof(HiOp) + sizeof(Value) + 2*sizeof(void*))
+
 struct Tracer {
     nmod_t mod;
     Trace t;
     std::unordered_map<int64_t, Value> const_cache;
     std::unordered_map<size_t, Value> var_cache;
+    std::unordered_map<HiOp, Value, HiOpHash, HiOpEq> hashcons;
+    size_t hashcons_limit;
+    size_t hashcons_hits;
     NameTable var_names;
 
     void clear();
+    void hashcons_clear();
+    Value record(const HiOp &op, ncoef_t n);
     size_t checkpoint();
     void rollback(size_t checkpoint);
     Value var(size_t idx);
@@ -874,12 +1616,80 @@ tracer_of_trace(Trace &t)
     return tr;
 }
 
+// A tracer that records into a trace of its own (a shard),
+// with the same modulus, inputs, and input values as the given
+// one. Several shards can be recorded concurrently, and later
+// appended to one trace with tr_merge(). The variables known
+// to the parent are recorded as VAR instructions up front, but
+// with the parent's values, so that the replacements made with
+// set_var() apply to the shard too: the same zero and inverse
+// checks are made during the tracing, and the VARs themselves
+// are to be replaced after the merge (as with the_varmap).
+API Tracer
+tracer_init_shard(const Tracer &parent)
+{
+    Tracer tr = {};
+    tr.mod = parent.mod;
+    tr.t = tr_init();
+    tr.t.ninputs = parent.t.ninputs;
+    tr.t.input_names = parent.t.input_names;
+    for (size_t i = 0; i < tr.t.input_names.size(); i++) {
+        const auto &name = tr.t.input_names[i];
+        nt_append(tr.var_names, name.data(), name.size());
+    }
+    for (auto &&kv : parent.var_cache) {
+        code_pack_HiOp1(tr.t.code, HOP_VAR, (nloc_t)kv.first);
+        tr.var_cache[kv.first] = Value{tr.t.nextloc++, kv.second.n};
+    }
+    tr.hashcons_limit = parent.hashcons_limit;
+    return tr;
+}
+
 #define tr (*this)
 
 void
 Tracer::clear()
 {
     tr_clear(tr.t);
+    tr.hashcons_clear();
+}
+
+// Forget all the recorded instructions. This must be called
+// whenever the trace is rewritten so that the locations it
+// refers to may now hold something else.
+void
+Tracer::hashcons_clear()
+{
+    tr.hashcons.clear();
+}
+
+// Record an instruction whose value is n, or return the
+// already recorded equivalent one when hash-consing.
+Value
+Tracer::record(const HiOp &op, ncoef_t n)
+{
+    if (tr.hashcons_limit == 0) {
+        code_pack(tr.t.code, 16, HiOp, op);
+        return Value{tr.t.nextloc++, n};
+    }
+    HiOp key = op;
+    if ((op.op == HOP_ADD) || (op.op == HOP_MUL)) {
+        if (op.a > op.b) { key.a = op.b; key.b = op.a; }
+    } else if (op.op == HOP_ADDMUL) {
+        if (op.b > op.c) { key.b = op.c; key.c = op.b; }
+    }
+    auto it = tr.hashcons.find(key);
+    if (it != tr.hashcons.end()) {
+        tr.hashcons_hits++;
+        return it->second;
+    }
+    if (tr.hashcons.size() >= tr.hashcons_limit) {
+        tr.hashcons.clear();
+    }
+    code_pack(tr.t.code, 16, HiOp, op);
+    Value v = Value{tr.t.nextloc++, n};
+    tr.hashcons[key] = v;
+    return v;
 }
 
 API ncoef_t
@@ -909,6 +1719,7 @@ Tracer::rollback(size_t checkpoint)
 {
     code_truncate(tr.t.code, checkpoint);
     tr.t.nextloc = tr.t.nfinlocations + code_size(tr.t.code)/sizeof(HiOp);
+    tr.hashcons_clear();
 }
 
 Value
@@ -999,8 +1810,7 @@ Tracer::is_minus1(const Value &a) const
 Value
 Tracer::mul(const Value &a, const Value &b)
 {
-    code_pack_HiOp2(tr.t.code, HOP_MUL, a.loc, b.loc);
-    return Value{tr.t.nextloc++, nmod_mul(a.n, b.n, tr.mod)};
+    return tr.record(HiOp{HOP_MUL, a.loc, b.loc, 0}, nmod_mul(a.n, b.n, tr.mod));
 }
 
 Value
@@ -1012,8 +1822,7 @@ Tracer::mulint(const Value &a, int64_t b)
 Value
 Tracer::add(const Value &a, const Value &b)
 {
-    code_pack_HiOp2(tr.t.code, HOP_ADD, a.loc, b.loc);
-    return Value{tr.t.nextloc++, _nmod_add(a.n, b.n, tr.mod)};
+    return tr.record(HiOp{HOP_ADD, a.loc, b.loc, 0}, _nmod_add(a.n, b.n, tr.mod));
 }
 
 Value
@@ -1025,36 +1834,31 @@ Tracer::addint(const Value &a, int64_t b)
 Value
 Tracer::sub(const Value &a, const Value &b)
 {
-    code_pack_HiOp2(tr.t.code, HOP_SUB, a.loc, b.loc);
-    return Value{tr.t.nextloc++, _nmod_sub(a.n, b.n, tr.mod)};
+    return tr.record(HiOp{HOP_SUB, a.loc, b.loc, 0}, _nmod_sub(a.n, b.n, tr.mod));
 }
 
 Value
 Tracer::addmul(const Value &a, const Value &b1, const Value &b2)
 {
-    code_pack_HiOp3(tr.t.code, HOP_ADDMUL, a.loc, b1.loc, b2.loc);
-    return Value{tr.t.nextloc++, nmod_addmul(a.n, b1.n, b2.n, tr.mod)};
+    return tr.record(HiOp{HOP_ADDMUL, a.loc, b1.loc, b2.loc}, nmod_addmul(a.n, b1.n, b2.n, tr.mod));
 }
 
 Value
 Tracer::inv(const Value &a)
 {
-    code_pack_HiOp1(tr.t.code, HOP_INV, a.loc);
-    return Value{tr.t.nextloc++, nmod_inv(a.n, tr.mod)};
+    return tr.record(HiOp{HOP_INV, a.loc, 0, 0}, nmod_inv(a.n, tr.mod));
 }
 
 Value
 Tracer::neginv(const Value &a)
 {
-    code_pack_HiOp1(tr.t.code, HOP_NEGINV, a.loc);
-    return Value{tr.t.nextloc++, nmod_inv(nmod_neg(a.n, tr.mod), tr.mod)};
+    return tr.record(HiOp{HOP_NEGINV, a.loc, 0, 0}, nmod_inv(nmod_neg(a.n, tr.mod), tr.mod));
 }
 
 Value
 Tracer::neg(const Value &a)
 {
-    code_pack_HiOp1(tr.t.code, HOP_NEG, a.loc);
-    return Value{tr.t.nextloc++, nmod_neg(a.n, tr.mod)};
+    return tr.record(HiOp{HOP_NEG, a.loc, 0, 0}, nmod_neg(a.n, tr.mod));
 }
 
 Value
@@ -1066,23 +1870,20 @@ Tracer::pow(const Value &base, long exp)
     case 1: return base;
     case 2: return tr.mul(base, base);
     default:
-        code_pack_HiOp2(tr.t.code, HOP_POW, base.loc, (uint64_t)exp);
-        return Value{tr.t.nextloc++, nmod_pow_ui(base.n, exp, tr.mod)};
+        return tr.record(HiOp{HOP_POW, base.loc, (uint64_t)exp, 0}, nmod_pow_ui(base.n, exp, tr.mod));
     }
 }
 
 Value
 Tracer::shoup_precomp(const Value &a)
 {
-    code_pack_HiOp1(tr.t.code, HOP_SHOUP_PRECOMP, a.loc);
-    return Value{tr.t.nextloc++, n_mulmod_precomp_shoup(a.n, tr.mod.n)};
+    return tr.record(HiOp{HOP_SHOUP_PRECOMP, a.loc, 0, 0}, n_mulmod_precomp_shoup(a.n, tr.mod.n));
 }
 
 Value
 Tracer::shoup_mul(const Value &a, const Value &aprecomp, const Value &b)
 {
-    code_pack_HiOp3(tr.t.code, HOP_SHOUP_MUL, a.loc, aprecomp.loc, b.loc);
-    return Value{tr.t.nextloc++, n_mulmod_shoup(a.n, b.n, aprecomp.n, tr.mod.n)};
+    return tr.record(HiOp{HOP_SHOUP_MUL, a.loc, aprecomp.loc, b.loc}, n_mulmod_shoup(a.n, b.n, aprecomp.n, tr.mod.n));
 }
 
 Value